@@ -7,11 +7,13 @@
 
 #include "freertos/FreeRTOS.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "driver/gpio.h"
 #include "driver/gptimer.h"
 
 #include "acr.h"
+#include "latency.h"
 
 // Notations:
 // 
@@ -60,6 +62,9 @@ typedef struct {
   int sign;      // Will oscilate between +1 and -1 
   int variance;  // Used to equilibrate the number of positive and negative ON phases
   int last_frame_on_count; // number of ON cycles (written by interrupt)
+  int64_t last_isr_us;     // esp_timer_get_time() at the previous interrupt
+  uint32_t p_trace;        // The latency trace of the last target (0 if none or already applied)
+  acr_stats_t p_stats;     // The counters (written by interrupt)
 } acr_state_t ;
 
 static acr_state_t acr_state =
@@ -73,6 +78,9 @@ static acr_state_t acr_state =
       .sign = +1,
       .variance = 0,
       .last_frame_on_count=0, 
+      .last_isr_us = 0,
+      .p_trace = 0,
+      .p_stats = {},
     };
 
 
@@ -108,6 +116,8 @@ static bool IRAM_ATTR on_ac_cycle_cb(gptimer_handle_t timer, const gptimer_alarm
   taskENTER_CRITICAL_ISR(&S->mutex);
   unsigned frame_size          = S->p_frame_size;
   acr_count_t frame_on_target  = S->p_frame_on_target;
+  uint32_t trace               = S->p_trace;
+  S->p_trace = 0;
   taskEXIT_CRITICAL_ISR(&S->mutex);
 
   acr_count_t *on_count = S->on_count ;
@@ -142,10 +152,31 @@ static bool IRAM_ATTR on_ac_cycle_cb(gptimer_handle_t timer, const gptimer_alarm
   
   gpio_set_level((gpio_num_t) S->gpio, state);
 
+  latency_mark(trace, LATENCY_APPLIED);
+
   S->last_frame_on_count = frame_on_count + state ;
 
   S->sign = -sign ; 
   S->index = index ; 
+
+  // The jitter of the interrupt is the deviation of the measured interval
+  // from the timer period. It includes the latency of the interrupt.
+  int64_t now = esp_timer_get_time();
+  uint32_t jitter = 0;
+  if (S->last_isr_us != 0) {
+    int64_t delta = now - S->last_isr_us - S->p_stats.period_us ;
+    jitter = (uint32_t) (delta < 0 ? -delta : delta);
+  }
+  S->last_isr_us = now;
+
+  taskENTER_CRITICAL_ISR(&S->mutex);
+  S->p_stats.cycles++;
+  S->p_stats.on_cycles += state;
+  S->p_stats.jitter_last_us = jitter;
+  if (jitter > S->p_stats.jitter_max_us) {
+    S->p_stats.jitter_max_us = jitter;
+  }
+  taskEXIT_CRITICAL_ISR(&S->mutex);
  
   return false;
 }
@@ -174,6 +205,8 @@ void acr_start(int freq, int gpio_num) {
       .auto_reload_on_alarm = true,
     },
   };
+  acr_state.p_stats.period_us = alarm_config.alarm_count;
+
   gptimer_event_callbacks_t cbs = {
     .on_alarm = on_ac_cycle_cb,
   };
@@ -202,7 +235,7 @@ static int compute_frame_on_target(double ratio, int frame_size) {
   return n ;
 }
 
-double acr_set_target_ratio(double ratio) {
+double acr_set_target_ratio(double ratio, uint32_t trace) {
 
   if (isnan(ratio))
     ratio = 0.0 ;
@@ -214,9 +247,14 @@ double acr_set_target_ratio(double ratio) {
   int frame_on_target = compute_frame_on_target(ratio, acr_state.p_frame_size);
     
   acr_state.target_ratio = ratio ;
+
+  latency_mark(trace, LATENCY_RELAY_SET);
   
   taskENTER_CRITICAL(&acr_state.mutex);
   acr_state.p_frame_on_target = frame_on_target ; 
+  if (trace) {
+    acr_state.p_trace = trace;
+  }
   taskEXIT_CRITICAL(&acr_state.mutex);
 
   return acr_state.target_ratio ;
@@ -256,3 +294,9 @@ int acr_get_frame_size() {
   return acr_state.p_frame_size ; 
 }
 
+void acr_get_stats(acr_stats_t *stats) {
+  taskENTER_CRITICAL(&acr_state.mutex);
+  *stats = acr_state.p_stats;
+  taskEXIT_CRITICAL(&acr_state.mutex);
+}
+
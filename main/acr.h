@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -31,7 +33,10 @@ void acr_start(int ac_freq, int gpio_num);
 //
 // Return the target ratio that was actually set.
 //
-double acr_set_target_ratio(double ratio);
+// 'trace' is a latency trace (or 0) that is closed by the first AC cycle
+// using the new target (see latency.h).
+//
+double acr_set_target_ratio(double ratio, uint32_t trace);
 
 
 // Get the current target ratio as set by acr_set_target_ratio()
@@ -69,6 +74,18 @@ int acr_get_frame_size(void);
 
 void acr_dump() ;
 
+// Counters maintained by the interrupt handler since acr_start()
+typedef struct {
+  uint32_t cycles;          // The number of AC cycles
+  uint32_t on_cycles;       // The number of ON cycles
+  uint32_t period_us;       // The expected interval between two interrupts
+  uint32_t jitter_last_us;  // The deviation of the last interval from period_us
+  uint32_t jitter_max_us;   // The largest deviation so far
+} acr_stats_t ;
+
+// Get a consistent copy of the counters.
+void acr_get_stats(acr_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
@@ -38,14 +38,18 @@
 #include "ui_http.h"
 #include "ui_mqtt.h"
 #include "rgb_led.h"
+#include "boot.h"
+#include "ota.h"
+#include "history.h"
+#include "power_filter.h"
+#include "latency.h"
+#include "telemetry.h"
 
 //#include "ui_telnet.h"
 
 #include "app_events.h"
 static const char TAG[] = "app" ;
 
-ESP_EVENT_DEFINE_BASE(APP_EVENT);
-
 #define TZ_FRANCE   "CET-1CEST,M3.2.0/2:00:00,M11.1.0/2:00:00"
 #define TZ_DEFAULT  TZ_FRANCE
 
@@ -84,6 +88,9 @@ static esp_netif_t *wifi_sta_netif;   // Wifi network interface (STA)
 static esp_netif_t *wifi_ap_netif;    // Wifi network interface (AP)
 
 static app_state_t state ;
+
+// The conditioning of the available power (see power_filter.h)
+static power_filter meter_filter(CONFIG_APP_METER_MEDIAN, CONFIG_APP_METER_EMA_PERCENT);
   
 // The current state of the WiFi 
 typedef enum {
@@ -146,6 +153,14 @@ void dump_state(stf::mask_t mask) {
   if (mask & stf::mqtt_uri) {
     printf("state.mqtt_uri = \"%s\"\n",state.mqtt.uri.c_str());
   }
+
+  if (mask & stf::meter_topic) {
+    printf("state.meter_topic = \"%s\"\n",state.mqtt.meter_topic.c_str());
+  }
+
+  if (mask & stf::meter_expr) {
+    printf("state.meter_expr = \"%s\"\n",state.mqtt.meter_expr.c_str());
+  }
       
   if (mask & stf::wifi_ssid) {
     printf("state.wifi.ssid = \"%s\"\n",state.wifi.ssid.c_str());
@@ -186,6 +201,14 @@ void load_state(stf::mask_t mask)
   if (mask & stf::mqtt_uri) {
     app_nvs_get_s("mqtt_uri", state.mqtt.uri, CONFIG_MQTT_BROKER_URI);
   }
+
+  if (mask & stf::meter_topic) {
+    app_nvs_get_s("meter_topic", state.mqtt.meter_topic, CONFIG_APP_METER_TOPIC);
+  }
+
+  if (mask & stf::meter_expr) {
+    app_nvs_get_s("meter_expr", state.mqtt.meter_expr, CONFIG_APP_METER_EXPR);
+  }
       
   if (mask & stf::wifi_ssid) {
     app_nvs_get_s("wifi_ssid", state.wifi.ssid, "");
@@ -226,6 +249,14 @@ void save_state(stf::mask_t mask)
   if (mask & stf::mqtt_uri) {
     nvs_set_str(app_nvs,"mqtt_uri",state.mqtt.uri.c_str());
   }
+
+  if (mask & stf::meter_topic) {
+    nvs_set_str(app_nvs,"meter_topic",state.mqtt.meter_topic.c_str());
+  }
+
+  if (mask & stf::meter_expr) {
+    nvs_set_str(app_nvs,"meter_expr",state.mqtt.meter_expr.c_str());
+  }
       
   if (mask & stf::wifi_ssid) {
     nvs_set_str(app_nvs,"wifi_ssid",state.wifi.ssid.c_str());
@@ -243,6 +274,41 @@ void save_state(stf::mask_t mask)
       
 }    
 
+static app_listener_t app_listeners[APP_MAX_LISTENERS];
+static int app_listener_count = 0;
+
+static portMUX_TYPE app_listener_mutex = portMUX_INITIALIZER_UNLOCKED;
+
+// Reminder: the boot stages that register listeners may run concurrently.
+void app_add_listener(app_listener_t listener)
+{
+  taskENTER_CRITICAL(&app_listener_mutex);
+  bool ok = (app_listener_count < APP_MAX_LISTENERS);
+  if (ok) {
+    app_listeners[app_listener_count++] = listener;
+  }
+  taskEXIT_CRITICAL(&app_listener_mutex);
+  if (!ok) {
+    ESP_LOGE(TAG, "Too many listeners");
+  }
+}
+
+// Must be called once after each modification of the state. 
+static void notify_change(stf::mask_t mask)
+{
+  if (mask==0) {
+    return;
+  }
+  state.version++;
+  // The entries below the count are never modified once registered
+  taskENTER_CRITICAL(&app_listener_mutex);
+  int count = app_listener_count;
+  taskEXIT_CRITICAL(&app_listener_mutex);
+  for (int i=0; i<count; i++) {
+    app_listeners[i](mask, state);
+  }
+}
+
 
 
 // Change the hostname.
@@ -262,6 +328,7 @@ set_hostname(const char *hostname)
   
   state.hostname = hostname;  
   save_state(stf::hostname);
+  notify_change(stf::hostname);
 
 }
 
@@ -279,6 +346,7 @@ set_timezone(const char *timezone)
   }
   state.timezone = timezone;
   save_state(stf::timezone);
+  notify_change(stf::timezone);
   setenv("TZ", state.timezone.c_str(), 1);
   tzset();
 }
@@ -295,6 +363,37 @@ set_mqtt_uri(const char *uri)
   }
   state.mqtt.uri = uri;
   save_state(stf::mqtt_uri);
+  notify_change(stf::mqtt_uri);
+}
+
+// Set the MQTT topic of the energy meter
+static void
+set_meter_topic(const char *topic)
+{
+  if (topic==NULL || topic[0]=='\0') {
+    return ;
+  }
+  if (state.mqtt.meter_topic == topic) {
+    return;
+  }
+  state.mqtt.meter_topic = topic;
+  save_state(stf::meter_topic);
+  notify_change(stf::meter_topic);
+}
+
+// Set the expression of the available power. It was validated by the caller.
+static void
+set_meter_expr(const char *expr)
+{
+  if (expr==NULL || expr[0]=='\0') {
+    return ;
+  }
+  if (state.mqtt.meter_expr == expr) {
+    return;
+  }
+  state.mqtt.meter_expr = expr;
+  save_state(stf::meter_expr);
+  notify_change(stf::meter_expr);
 }
 
 
@@ -310,29 +409,23 @@ set_ui_password(const char *password)
   } 
   state.ui.password=password;
   save_state(stf::ui_password);
+  notify_change(stf::ui_password);
 
 }
 
 
-void
-set_full_power(int value, bool save)
-{
-  if (value<=0)
-    value = 1;
-  
-  state.full_power = value;
-
-  if (save) {
-    save_state(stf::full_power);
-  }
-}
-
-static void update_ac_relay() {
+// Update the AC relay according to the current state.
+//
+// Return the mask of the relay fields that were changed.
+//
+// 'trace' is the latency trace of the available power (AUTO mode only).
+static stf::mask_t update_ac_relay(uint32_t trace=0) {
   int power=0;
+  double ratio=0;
   if (state.mode==AC_MODE_MANUAL)
   {
     power = state.m.power ;
-    double ratio = acr_set_target_ratio( double(power) / state.full_power );
+    ratio = acr_set_target_ratio( double(power) / state.full_power, 0 );
     ESP_LOGI(TAG, "manual ratio:%4.1f%% target:%d/%d",
              ratio*100,
              power,
@@ -343,7 +436,7 @@ static void update_ac_relay() {
 
     power = state.a.available_power+state.a.over_power ;
     power = std::max(power, state.a.min_power);
-    double ratio = acr_set_target_ratio( double(power) / state.full_power );
+    ratio = acr_set_target_ratio( double(power) / state.full_power, trace );
     ESP_LOGI(TAG, "auto ratio %4.1f%% target %d/%d avail %d over %d min %d",
              ratio*100,
              power,
@@ -352,9 +445,97 @@ static void update_ac_relay() {
              state.a.over_power,
              state.a.min_power);    
   }
+
+  stf::mask_t changed = 0;
+  if (power != state.relay.power) {
+    state.relay.power = power;
+    changed |= stf::relay_power;
+  }
+  if (ratio != state.relay.ratio) {
+    state.relay.ratio = ratio;
+    changed |= stf::relay_ratio;
+  }
+  return changed;
 }
 
 
+//
+// Apply the fields of an app_config_t.
+//
+// The AC relay is updated once and only if needed, the NVS is committed once 
+// and the listeners are notified once.
+//
+static void apply_config(const app_config_t &config)
+{
+  stf::mask_t mask    = config.mask & app_config_mask;
+  stf::mask_t changed = 0;
+
+  if (mask & stf::mode) {
+    switch(config.mode) {
+      case AC_MODE_AUTO:
+      case AC_MODE_MANUAL:
+        if (config.mode != state.mode) {
+          state.mode = config.mode;
+          changed |= stf::mode;
+        }
+        break;
+    }
+  }
+
+  if (mask & stf::frame_size) {
+    int new_frame_size = acr_set_frame_size(config.frame_size) ;
+    if ( new_frame_size != state.frame_size ) {
+      state.frame_size = new_frame_size;
+      changed |= stf::frame_size;
+    }
+  }
+
+  if (mask & stf::full_power) {
+    int value = std::max(1, config.full_power);
+    if (value != state.full_power) {
+      state.full_power = value;
+      changed |= stf::full_power;
+    }
+  }
+
+  if (mask & stf::manual_power) {
+    if (config.manual_power != state.m.power) {
+      state.m.power = config.manual_power;
+      changed |= stf::manual_power;
+    }
+  }
+
+  if (mask & stf::auto_over_power) {
+    if (config.auto_over_power != state.a.over_power) {
+      state.a.over_power = config.auto_over_power;
+      changed |= stf::auto_over_power;
+    }
+  }
+
+  if (mask & stf::auto_min_power) {
+    if (config.auto_min_power != state.a.min_power) {
+      state.a.min_power = config.auto_min_power;
+      changed |= stf::auto_min_power;
+    }
+  }
+
+  // The fields that have an effect on the AC relay
+  constexpr stf::mask_t relay_fields =
+    stf::mode | stf::full_power | stf::manual_power |
+    stf::auto_over_power | stf::auto_min_power ;
+  
+  if (changed & relay_fields) {
+    changed |= update_ac_relay();
+  }
+
+  stf::mask_t save = config.save & mask & stf::all_saved;
+  if (save) {
+    save_state(save);
+  }
+
+  notify_change(changed);
+}
+
 static void start_wifi_connection()
 {
   wifi_config_t wifi_config;
@@ -396,6 +577,7 @@ static void network_event_handler(void* arg, esp_event_base_t event_base,
 
       case WIFI_EVENT_STA_DISCONNECTED:
         ESP_LOGI(TAG, "WIFI_EVENT_STA_DISCONNECTED");
+        ota_set_health(OTA_HEALTH_WIFI, false);
         switch(app_wifi_state) {
           case APP_WIFI_OK:
             app_wifi_state = APP_WIFI_FAIL;
@@ -433,6 +615,8 @@ static void network_event_handler(void* arg, esp_event_base_t event_base,
       {     
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "Got IP:" IPSTR, IP2STR(&event->ip_info.ip));
+        boot_mark("wifi connected");
+        ota_set_health(OTA_HEALTH_WIFI, true);
         wifi_config_t wifi_config;
         ESP_ERROR_CHECK(esp_wifi_get_config(WIFI_IF_STA, &wifi_config) );
         ESP_LOGI(TAG, "Connected to WiFi SSID:%s Password:%s",
@@ -475,181 +659,221 @@ static void app_event_hour_tic()
   // TODO
 }
 
-static void app_event_handler(void* dummy,
-                              esp_event_base_t event_base,
-                              int32_t event_id,
-                              void* data)
-{  
-  switch(event_id) {
-    case APP_EVENT_SYNC:
-    {
-      app_event_sync_t *arg = (app_event_sync_t*) data ;
-      xSemaphoreGive(arg->sem);
+//
+// The handlers of the application events.
+//
+// There is one specialization of app_on<EVENT> per entry in APP_EVENTS and
+// each receives the payload type bound to its event by app_event_desc<EVENT>.
+//
+// All handlers are executed by the application task (see app_event_start)
+// so they are the only code allowed to modify the application state.
+//
+template <app_event_t EVENT>
+static void app_on(const typename app_event_desc<EVENT>::payload_t &arg);
+
+template <>
+void app_on<APP_EVENT_SYNC>(const app_event_sync_t &arg)
+{
+  xSemaphoreGive(arg.sem);
+}
+
+template <>
+void app_on<APP_EVENT_QUERY_STATE>(app_state_t * const &dest)
+{
+  if (dest) {
+    *dest = state ;
+  }
+}
+
+template <>
+void app_on<APP_EVENT_REBOOT>(const app_event_none_t &arg)
+{
+  esp_restart();
+}
+
+template <>
+void app_on<APP_EVENT_CONFIG>(const app_config_t &config)
+{
+  apply_config(config);
+}
+
+template <>
+void app_on<APP_EVENT_AUTO_AVAILABLE_POWER>(const app_event_power_t &arg)
+{
+  int value = arg.power;
+  latency_mark(arg.trace, LATENCY_DISPATCHED);
+
+  // The deadband is a number of steps of the relay ratio
+  meter_filter.set_deadband(CONFIG_APP_METER_DEADBAND_STEPS * state.full_power / std::max(1, state.frame_size));
+  if (meter_filter.update(value)) {
+    state.a.available_power = meter_filter.output() ;
+    stf::mask_t changed = stf::auto_available_power;
+    if (state.mode==AC_MODE_AUTO) {
+      changed |= update_ac_relay(arg.trace);
     }
-    break;
-    
-    case APP_EVENT_MODE:
-    {
-      ac_mode_t new_mode = * (ac_mode_t*) data ;
-      if (new_mode!=state.mode) {
-        switch(new_mode) {
-          case AC_MODE_AUTO:
-          case AC_MODE_MANUAL:
-            state.mode = new_mode;
-            update_ac_relay();
-            break;
-        }
-      }
+    notify_change(changed);
+  } else {
+    ESP_LOGD(TAG, "available power %d filtered out", value);
+  }
+
+  // The first available power marks the end of the startup
+  static bool first = true;
+  if (first) {
+    first = false;
+    boot_mark("controlling");
+    boot_print_profile();
+  }
+}
+
+template <>
+void app_on<APP_EVENT_WIFI_CRED>(const app_wifi_cred_t &cred)
+{
+  state.wifi.ssid     = cred.ssid;
+  state.wifi.password = cred.password;
+  save_state(stf::wifi_ssid | stf::wifi_password);
+  notify_change(stf::wifi_ssid | stf::wifi_password);
+}
+
+template <>
+void app_on<APP_EVENT_HOSTNAME>(const app_hostname_t &hostname)
+{
+  set_hostname(hostname.data) ;
+}
+
+template <>
+void app_on<APP_EVENT_TIMEZONE>(const app_timezone_t &timezone)
+{
+  set_timezone(timezone.data) ;
+}
+
+template <>
+void app_on<APP_EVENT_MQTT_URI>(const app_mqtt_uri_t &uri)
+{
+  set_mqtt_uri(uri.data) ;
+}
+
+template <>
+void app_on<APP_EVENT_METER_TOPIC>(const app_meter_topic_t &topic)
+{
+  set_meter_topic(topic.data) ;
+}
+
+template <>
+void app_on<APP_EVENT_METER_EXPR>(const app_meter_expr_t &expr)
+{
+  set_meter_expr(expr.data) ;
+}
+
+template <>
+void app_on<APP_EVENT_UI_PASSWORD>(const app_password_t &password)
+{
+  set_ui_password(password.data) ;
+}
+
+template <>
+void app_on<APP_EVENT_BUTTON_PRESS>(const app_event_button_t &press)
+{
+  ESP_LOGI(TAG, "Button Press id=%c duration=%d",press.id, press.duration_ms);
+}
+
+template <>
+void app_on<APP_EVENT_BUTTON_RELEASE>(const app_event_button_t &press)
+{
+  ESP_LOGI(TAG, "Button Release id=%c duration=%d",press.id, press.duration_ms);
+
+  if (press.id=='A' || press.id=='B') {
+    if (press.duration_ms>2000) {
+      // TODO: Clear wifi credential and other settings and then reboot
+      // start_wifi_connection();
+
     }
-    break;
-    
-    case APP_EVENT_QUERY_STATE:
-     {
-       app_state_t *dest = * (app_state_t **) data ;
-       if (dest) {
-         *dest = state ;
-       }
-     }
-     break;      
-
-    case APP_EVENT_REBOOT:   
-      esp_restart();
-      break;
+  }
+}
 
-    case APP_EVENT_AUTO_AVAILABLE_POWER: 
-      {
-        state.a.available_power = *(int*)data ; 
-        if (state.mode==AC_MODE_AUTO) {
-          update_ac_relay();
-        }
-      }
-      break;
+template <>
+void app_on<APP_EVENT_MINUTE_TIC>(const app_event_none_t &arg)
+{
+  app_event_minute_tic() ;
+  telemetry_save() ;
+  ota_check_health() ;
+}
 
-    case APP_EVENT_AUTO_MIN_POWER:
-      {
-        state.a.min_power = *(int*)data ; 
-        if (state.mode==AC_MODE_AUTO) {
-          update_ac_relay();
-        }
-      }
-      break;
+template <>
+void app_on<APP_EVENT_HOUR_TIC>(const app_event_none_t &arg)
+{
+  app_event_hour_tic() ;
+}
 
-    case APP_EVENT_AUTO_OVER_POWER:
-      {
-        state.a.over_power = *(int*)data ; 
-        if (state.mode==AC_MODE_AUTO) {
-          update_ac_relay();
-        }
-      }
-      break;
+template <>
+void app_on<APP_EVENT_NETWORK>(const app_event_network_t &ev)
+{
+  network_event_handler(NULL, ev.base, ev.id, (void*) &ev.data);
+}
 
-    case APP_EVENT_MANUAL_POWER:
-      {
-        state.m.power = *(int*)data ; 
-        if (state.mode==AC_MODE_AUTO) {
-          update_ac_relay();
-        }
-      }
-      break;
+// Copy the payload out of the event slot and call the handler.
+template <app_event_t EVENT>
+static void app_dispatch(const void *slot)
+{
+  typename app_event_desc<EVENT>::payload_t arg;
+  memcpy((void*) &arg, slot, sizeof(arg));
+  app_on<EVENT>(arg);
+}
 
-    
-     case APP_EVENT_WIFI_CRED:
-      {
-        app_wifi_cred_t *cred = (app_wifi_cred_t *)data ;
-        state.wifi.ssid     = cred->ssid;
-        state.wifi.password = cred->password;
-        save_state(stf::wifi_ssid | stf::wifi_password);
-      }
-      break;
-      
-    case APP_EVENT_FULL_POWER:
-      {
-        app_event_full_power_t *ev = (app_event_full_power_t *) data;
-        state.full_power = *(int*)data ;
-        if (state.full_power <= 0 ) {
-          state.full_power = 1 ;
-        }
-        if (state.mode==AC_MODE_AUTO) {
-          update_ac_relay();
-        }
-        if (ev->save) {
-          save_state(stf::full_power);
-        }
-      }
-      break;
+typedef struct {
+  app_event_t id;
+  void (*dispatch)(const void *slot);
+} app_event_entry_t ;
 
+#define DEF_EVENT(EVENT, TYPE) { EVENT, &app_dispatch<EVENT> },
 
-    case APP_EVENT_FRAME_SIZE:
-      {
-        app_event_frame_size_t *ev = (app_event_frame_size_t *) data;
-        int new_frame_size = acr_set_frame_size(ev->value) ;
-        if ( new_frame_size != state.frame_size ) {
-          state.frame_size = new_frame_size;
-        }
-        
-        if (ev->save) {
-          save_state(stf::frame_size); 
-        }
-      }
-      break;
-      
-    case APP_EVENT_BUTTON_PRESS:
-      {
-        app_event_button_t * press = (app_event_button_t*)data;
-        ESP_LOGI(TAG, "Button Press id=%c duration=%d",press->id, press->duration_ms);
-      }
-      break;
-      
-    case APP_EVENT_BUTTON_RELEASE:
-      {
-        app_event_button_t * press = (app_event_button_t*)data;
-        ESP_LOGI(TAG, "Button Release id=%c duration=%d",press->id, press->duration_ms);
-
-        if (press->id=='A' || press->id=='B') {
-          if (press->duration_ms>2000) {
-            // TODO: Clear wifi credential and other settings and then reboot
-            // start_wifi_connection();
-            
-          }
-        }
-      }
-      break;
-      
-    case APP_EVENT_HOSTNAME:
-      set_hostname( (char*)data ) ;
-      break;
-      
-    case APP_EVENT_MQTT_URI:
-      set_mqtt_uri( (char*)data ) ;
-      break;
-      
-    case APP_EVENT_TIMEZONE:
-      set_timezone( (char*)data ) ;
-      break;
-      
-    case APP_EVENT_UI_PASSWORD:
-      set_ui_password( (char*)data ) ;
-      break;
-      
-    case APP_EVENT_MINUTE_TIC:
-      app_event_minute_tic() ;
-      break;
-      
-    case APP_EVENT_HOUR_TIC:
-      app_event_hour_tic() ;
-      break;
-      
-    default:
-      ESP_LOGE(TAG, "Unknown APP EVENT %d",(int) event_id);
-      break;
+static constexpr app_event_entry_t app_event_table[] = {
+  APP_EVENTS
+};
+
+#undef DEF_EVENT
+
+// The table is indexed by event identifier.
+static constexpr bool app_event_table_is_ordered()
+{
+  for (int i=0; i<APP_EVENT_COUNT; i++) {
+    if (app_event_table[i].id != i) {
+      return false;
+    }
   }
+  return true;
 }
 
-static void
-heap_debug(void)
+static_assert(sizeof(app_event_table)/sizeof(app_event_table[0]) == APP_EVENT_COUNT,
+              "APP_EVENTS must describe all events");
+static_assert(app_event_table_is_ordered(),
+              "APP_EVENTS must follow the order of app_event_t");
+
+void
+app_event_dispatch(const app_event_msg_t &msg)
 {
-  printf("free heap size: %lu\n", esp_get_free_heap_size());
-  printf("minimum free heap size: %lu\n", esp_get_minimum_free_heap_size());
+  if (msg.id < 0 || msg.id >= APP_EVENT_COUNT) {
+    ESP_LOGE(TAG, "Unknown APP EVENT %d",(int) msg.id);
+    return;
+  }
+  app_event_table[msg.id].dispatch(msg.slot);
+}
+
+// Forward the network events to the application task so that they
+// do not compete with the application events for the state.
+static void network_event_forwarder(void* arg, esp_event_base_t event_base,
+                                    int32_t event_id, void* event_data)
+{
+  app_event_network_t ev = {};
+  ev.base = event_base;
+  ev.id   = event_id;
+  if (event_base==WIFI_EVENT && event_id==WIFI_EVENT_AP_STACONNECTED) {
+    ev.data.ap_staconnected = *(wifi_event_ap_staconnected_t*) event_data;
+  } else if (event_base==WIFI_EVENT && event_id==WIFI_EVENT_AP_STADISCONNECTED) {
+    ev.data.ap_stadisconnected = *(wifi_event_ap_stadisconnected_t*) event_data;
+  } else if (event_base==IP_EVENT && event_id==IP_EVENT_STA_GOT_IP) {
+    ev.data.got_ip = *(ip_event_got_ip_t*) event_data;
+  }
+  app_post<APP_EVENT_NETWORK>(ev);
 }
 
 static void
@@ -717,43 +941,23 @@ setup_wifi()
   
 }
 
-#ifdef __cplusplus
-extern "C" 
-#endif
-void app_main(void)
-{
-  
-  ESP_LOGI(TAG, "[APP] Startup..");
-  ESP_LOGI(TAG, "[APP] Free memory: %" PRIu32 " bytes", esp_get_free_heap_size());
-  ESP_LOGI(TAG, "[APP] IDF version: %s", esp_get_idf_version());
-  esp_log_level_set("*", ESP_LOG_INFO);
-  //esp_log_level_set("mqtt_client", ESP_LOG_VERBOSE);
-  //esp_log_level_set("transport_base", ESP_LOG_VERBOSE);
-  //esp_log_level_set("esp-tls", ESP_LOG_VERBOSE);
-  //esp_log_level_set("transport", ESP_LOG_VERBOSE);
-  //esp_log_level_set("outbox", ESP_LOG_VERBOSE);
-  
-  ///////////// Make sure that the RELAY pin is OFF during startup
-  
-  gpio_reset_pin((gpio_num_t)CONFIG_RELAY_GPIO);
-  gpio_set_direction((gpio_num_t)CONFIG_RELAY_GPIO, GPIO_MODE_OUTPUT);
-  gpio_set_level((gpio_num_t)CONFIG_RELAY_GPIO, 0);
-
-  /////////////
+//
+// The startup stages (see app_main)
+//
+// Remark: The state is loaded by boot_stage_state and it is then
+//         only read by the other stages. 
+//
 
-  resource_init();
-  
-  /////////////
-    
+static void
+boot_stage_led()
+{
   led_init();
   led_set_rgb(RGB_GREEN);
+}
 
-  //////////// Start monitoring the buttons 
-  
-  if ( ! button_driver_init() ) {
-    ESP_LOGE(TAG, "Failed to initialize button driver");
-  }
-  
+static void
+boot_stage_state()
+{
   setup_nvs();
 
   load_state(stf::all_saved);
@@ -761,69 +965,148 @@ void app_main(void)
   
   ESP_LOGI(TAG, "Hostname %s", state.hostname.c_str());
 
-  acr_set_target_ratio(0);  
-  acr_set_frame_size( state.frame_size );  
-  acr_start(AC_FREQ, CONFIG_RELAY_GPIO); 
-
   // Setup the timezone
   // See man tzset for the POSIX timezone format
   setenv("TZ", state.timezone.c_str(), 1);
   tzset();
+}
+
+static void
+boot_stage_events()
+{
+  // Start processing the application events
+  app_event_start();
   
   // Create the main event loop and register events. 
   
   ESP_ERROR_CHECK(esp_event_loop_create_default());
 
-  esp_event_handler_instance_t instance_app_id;
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(APP_EVENT,
-                                                      ESP_EVENT_ANY_ID,
-                                                      &app_event_handler,
-                                                      NULL,
-                                                      &instance_app_id));
-
   esp_event_handler_instance_t instance_any_id;
   ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                       ESP_EVENT_ANY_ID,
-                                                      &network_event_handler,
+                                                      &network_event_forwarder,
                                                       NULL,
                                                       &instance_any_id));
 
   esp_event_handler_instance_t instance_got_ip;
   ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
                                                       IP_EVENT_STA_GOT_IP,
-                                                      &network_event_handler,
+                                                      &network_event_forwarder,
                                                       NULL,
                                                       &instance_got_ip));
 
-  
   ESP_ERROR_CHECK(esp_netif_init());
+}
 
-  
+static void
+boot_stage_buttons()
+{
+  if ( ! button_driver_init() ) {
+    ESP_LOGE(TAG, "Failed to initialize button driver");
+  }
+}
+
+static void
+boot_stage_acr()
+{
+  acr_set_target_ratio(0, 0);  
+  acr_set_frame_size( state.frame_size );  
+  acr_start(AC_FREQ, CONFIG_RELAY_GPIO); 
+}
+
+static void
+boot_stage_sntp()
+{
   esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG("pool.ntp.org");
   esp_netif_sntp_init(&config);
+}
 
-  
+//
+// We are not yet connected to WiFi but we can already start the various UI. 
+//
 
-  //
-  // We are not yet connected to WiFi but we can already start the various UI. 
-  //
-  //ui_telnet_start();
+static void
+boot_stage_http()
+{
   ui_http_start(state.ui.password) ;
-  ui_mqtt_start(state.mqtt.uri.c_str(), state.hostname.c_str() );
-  
-  //
+}
+
+static void
+boot_stage_history()
+{
+  history_start(state);
+}
+
+static void
+boot_stage_mqtt()
+{
+  ui_mqtt_start(state);
+}
+
+static void
+boot_stage_wifi()
+{
   // Setup the network interfaces for the WiFi
-  //
-  
   wifi_sta_netif = esp_netif_create_default_wifi_sta();
   wifi_ap_netif  = esp_netif_create_default_wifi_ap();
   esp_netif_set_hostname(wifi_sta_netif, state.hostname.c_str()); 
   esp_netif_set_hostname(wifi_ap_netif, state.hostname.c_str()); 
 
   setup_wifi();
+}
+
+#ifdef __cplusplus
+extern "C" 
+#endif
+void app_main(void)
+{
+  
+  ESP_LOGI(TAG, "[APP] Startup..");
+  ESP_LOGI(TAG, "[APP] Free memory: %" PRIu32 " bytes", esp_get_free_heap_size());
+  ESP_LOGI(TAG, "[APP] IDF version: %s", esp_get_idf_version());
+  esp_log_level_set("*", ESP_LOG_INFO);
+  //esp_log_level_set("mqtt_client", ESP_LOG_VERBOSE);
+  //esp_log_level_set("transport_base", ESP_LOG_VERBOSE);
+  //esp_log_level_set("esp-tls", ESP_LOG_VERBOSE);
+  //esp_log_level_set("transport", ESP_LOG_VERBOSE);
+  //esp_log_level_set("outbox", ESP_LOG_VERBOSE);
+  
+  boot_init();
+
+  ///////////// Make sure that the RELAY pin is OFF during startup
+  
+  gpio_reset_pin((gpio_num_t)CONFIG_RELAY_GPIO);
+  gpio_set_direction((gpio_num_t)CONFIG_RELAY_GPIO, GPIO_MODE_OUTPUT);
+  gpio_set_level((gpio_num_t)CONFIG_RELAY_GPIO, 0);
+
+  /////////////
+
+  boot_run("ota", &ota_init, 0, 0);
+  boot_run("resources", &resource_init, 0, 0);
 
   //
-  // Trigger events at regular intervals in the default event loop.
+  // The stages below are started in order but their dependencies
+  // are explicit so the independent ones can run concurrently.
+  // See boot.h
+  //
+  
+  boot_run_async("led", &boot_stage_led, 0, BOOT_LED);
+  boot_run_async("state", &boot_stage_state, 0, BOOT_STATE);
+  boot_run("events", &boot_stage_events, 0, BOOT_EVENTS);
+  boot_run("buttons", &boot_stage_buttons, BOOT_EVENTS, 0);
+  boot_run("acr", &boot_stage_acr, BOOT_STATE, BOOT_ACR);
+  boot_run("history", &boot_stage_history, BOOT_STATE|BOOT_ACR, 0);
+  boot_run_async("http", &boot_stage_http, BOOT_STATE|BOOT_EVENTS, BOOT_HTTP);
+  boot_run_async("mqtt", &boot_stage_mqtt, BOOT_STATE|BOOT_EVENTS, BOOT_MQTT);
+  boot_run("wifi", &boot_stage_wifi, BOOT_STATE|BOOT_EVENTS|BOOT_LED, BOOT_WIFI);
+  boot_run("sntp", &boot_stage_sntp, BOOT_STATE|BOOT_EVENTS, 0);
+
+  boot_wait(BOOT_ACR|BOOT_HTTP|BOOT_MQTT|BOOT_WIFI);
+  boot_mark("started");
+  boot_print_profile();
+
+  //
+  // Trigger events at regular intervals in the application task.
   //
   // Note: The clock will start at EPOCH (Jan 1st 1970, 00:00 UTC+00:00)
   //       until the NTP service sets a proper time.
@@ -837,18 +1120,16 @@ void app_main(void)
     // Trigger app_event_minute_tic at each minute change
     if (local_time.tm_min != last_minute ) {
       last_minute = local_time.tm_min ;
-      app_post_event(APP_EVENT_MINUTE_TIC, NULL, 0);
+      app_post<APP_EVENT_MINUTE_TIC>({});
     }
     
     // Trigger app_event_hour_tic at each hour change
     if (last_hour != local_time.tm_hour) {
       last_hour = local_time.tm_hour;
-      app_post_event(APP_EVENT_HOUR_TIC, NULL, 0);
+      app_post<APP_EVENT_HOUR_TIC>({});
     }
 
     vTaskDelay( 10 * 1000 / portTICK_PERIOD_MS);
-
-    if(false) heap_debug();
   }
 
 }
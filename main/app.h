@@ -14,6 +14,12 @@ void app_post_reboot(void);
 //
 void app_post_query_state(app_state_t *state_copy, bool async=false);
 
+// Apply several changes to the configuration at once.
+//
+// The AC relay is updated at most once, the NVS is committed at most once and
+// the listeners are notified once with all the modified fields.
+void app_post_config(const app_config_t &config);
+
 // Set the operation mode
 void app_post_mode(ac_mode_t mode);
 
@@ -37,7 +43,7 @@ void app_post_timezone(const char *timezone);
 void app_post_wifi_cred(const char *ssid, const char *password);
 
 // Set values for AUTO mode 
-void app_post_auto_available_power(int value) ;
+void app_post_auto_available_power(int value, uint32_t trace=0) ;
 void app_post_auto_min_power(int value) ;
 void app_post_auto_over_power(int value) ;
 void app_post_auto_fallback_power(int value) ;
@@ -51,9 +57,26 @@ void app_post_hostname(const char *hostname);
 // Set the MQTT broker URI (will take effect after reboot)
 void app_post_mqtt_uri(const char *uri);
 
+// Set the topic and the expression of the energy meter (will take effect after reboot).
+// The expression must be valid (see meter_expr.h).
+void app_post_meter_topic(const char *topic);
+void app_post_meter_expr(const char *expr);
+
 //void set_hostname(const char *hostname) ; // TODO: make an APP event
 //void set_full_power(int value) ; // TODO: make an APP event
 void set_default_frame_size(int value) ; // TODO: make an APP event
 
 // Set UI password (will take effect after reboot)
 void app_post_ui_password(const char *password) ;
+
+// A listener is called by the application task after each modification
+// of the state. The mask indicates which fields were modified.
+//
+// A listener shall return quickly and must not wait for the completion
+// of application events (e.g. with app_sync or app_post_query_state).
+typedef void (*app_listener_t)(stf::mask_t mask, const app_state_t &state);
+
+#define APP_MAX_LISTENERS 6
+
+// Register a listener. Shall be called during startup.
+void app_add_listener(app_listener_t listener);
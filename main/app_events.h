@@ -1,60 +1,160 @@
 #pragma once
 
+#include <type_traits>
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 
 #include "esp_event.h"
+#include "esp_wifi.h"
+#include "esp_netif.h"
 
-ESP_EVENT_DECLARE_BASE(APP_EVENT);
+#include "app_types.h"
 
 typedef enum {
   APP_EVENT_SYNC,                 // Wait for all previous events to be completed
   APP_EVENT_QUERY_STATE,          // Get a copy of the current state of the application
   APP_EVENT_REBOOT,               // Reboot the device.
-  APP_EVENT_MODE,                 // Set the AC mode
-  APP_EVENT_MANUAL_POWER,         // Set the target power (Manual mode)
-  APP_EVENT_MODE_AUTO,            // Switch to Auto mode 
+  APP_EVENT_CONFIG,               // Apply an app_config_t (mode, frame size, full power and target powers)
   APP_EVENT_AUTO_AVAILABLE_POWER, // Set the available power (Auto mode)
-  APP_EVENT_AUTO_OVER_POWER,      // Set by how much to overshoot the power (Auto mode)
-  APP_EVENT_AUTO_MIN_POWER,       // Set the minimum target power (Auto mode)
-  APP_EVENT_FULL_POWER,           // Define the maximum possible power (when the AC relay is on at 100%)
-  APP_EVENT_FRAME_SIZE,           // Define the number of cycles in each frame (i.e. 1/100 seconds for AC 50Hz)
   APP_EVENT_WIFI_CRED,            // Set WiFi credentials
   APP_EVENT_HOSTNAME,             // Set Hostname
   APP_EVENT_TIMEZONE,             // Set the Timezone (POSIX)
   APP_EVENT_MQTT_URI,             // Set the MQTT Broker URI
-  APP_EVENT_UI_PASSWORD,          // Set the User Interface password (http, ...) 
+  APP_EVENT_METER_TOPIC,          // Set the MQTT topic of the energy meter
+  APP_EVENT_METER_EXPR,           // Set the expression of the available power (see meter_expr.h)
+  APP_EVENT_UI_PASSWORD,          // Set the User Interface password (http, ...)
 
   APP_EVENT_BUTTON_PRESS,         // A button is currently being pressed.
   APP_EVENT_BUTTON_RELEASE,       // A button was released.
 
   // The events below are internal and should not be triggered by the UI
-  APP_EVENT_MINUTE_TIC,           // Triggered roughly once per minute 
+  APP_EVENT_MINUTE_TIC,           // Triggered roughly once per minute
   APP_EVENT_HOUR_TIC,             // Triggered every hour usually at the '0' minute mark but will also happen
                                   // at startup and after a timezone or time update if the 'hour' changed.
+  APP_EVENT_NETWORK,              // A WIFI_EVENT or IP_EVENT forwarded from the default event loop.
+
+  APP_EVENT_COUNT                 // Not an event. Must remain last.
 } app_event_t;
 
 
+// The payload of the events that do not carry any data
+typedef struct {
+} app_event_none_t ;
+
 typedef struct {
   SemaphoreHandle_t sem;
 } app_event_sync_t ;
 
 typedef struct {
   char id;
-  int  duration_ms; 
+  int  duration_ms;
 } app_event_button_t ;
 
 typedef struct {
-  int  value;
-  bool save;
-} app_event_frame_size_t ;
+  int      power;
+  uint32_t trace;   // A latency trace or 0 (see latency.h)
+} app_event_power_t ;
 
+// Only the network events that are actually used by the application are forwarded.
 typedef struct {
-  int  value;
-  bool save;
-} app_event_full_power_t ;
+  esp_event_base_t base;
+  int32_t          id;
+  union {
+    wifi_event_ap_staconnected_t    ap_staconnected;
+    wifi_event_ap_stadisconnected_t ap_stadisconnected;
+    ip_event_got_ip_t               got_ip;
+  } data;
+} app_event_network_t ;
+
+//
+// The event descriptor table.
+//
+// Each entry binds an event identifier to the type of its payload.
+// The entries must follow the order of app_event_t (this is verified
+// in app.cc where the dispatch table is generated).
+//
+#define APP_EVENTS \
+  DEF_EVENT(APP_EVENT_SYNC,                 app_event_sync_t)       \
+  DEF_EVENT(APP_EVENT_QUERY_STATE,          app_state_t *)          \
+  DEF_EVENT(APP_EVENT_REBOOT,               app_event_none_t)       \
+  DEF_EVENT(APP_EVENT_CONFIG,               app_config_t)           \
+  DEF_EVENT(APP_EVENT_AUTO_AVAILABLE_POWER, app_event_power_t)      \
+  DEF_EVENT(APP_EVENT_WIFI_CRED,            app_wifi_cred_t)        \
+  DEF_EVENT(APP_EVENT_HOSTNAME,             app_hostname_t)         \
+  DEF_EVENT(APP_EVENT_TIMEZONE,             app_timezone_t)         \
+  DEF_EVENT(APP_EVENT_MQTT_URI,             app_mqtt_uri_t)         \
+  DEF_EVENT(APP_EVENT_METER_TOPIC,          app_meter_topic_t)      \
+  DEF_EVENT(APP_EVENT_METER_EXPR,           app_meter_expr_t)       \
+  DEF_EVENT(APP_EVENT_UI_PASSWORD,          app_password_t)         \
+  DEF_EVENT(APP_EVENT_BUTTON_PRESS,         app_event_button_t)     \
+  DEF_EVENT(APP_EVENT_BUTTON_RELEASE,       app_event_button_t)     \
+  DEF_EVENT(APP_EVENT_MINUTE_TIC,           app_event_none_t)       \
+  DEF_EVENT(APP_EVENT_HOUR_TIC,             app_event_none_t)       \
+  DEF_EVENT(APP_EVENT_NETWORK,              app_event_network_t)    \
+
+// The payload of each event is copied by value into a slot of that size.
+// The largest payloads are currently app_wifi_cred_t and app_timezone_t.
+#define APP_EVENT_SLOT_SIZE 64
+
+// The number of pending events in the application queue
+#define APP_EVENT_QUEUE_LENGTH 16
+
+#define APP_EVENT_TASK_STACK_SIZE 4096
+#define APP_EVENT_TASK_PRIORITY   10
+
+// app_event_desc<EVENT>::payload_t is the payload type of EVENT.
+//
+// There is intentionally no generic definition so an event
+// missing from APP_EVENTS cannot be posted.
+template <app_event_t EVENT>
+struct app_event_desc;
+
+#define DEF_EVENT(EVENT, TYPE)                                          \
+  template <>                                                           \
+  struct app_event_desc<EVENT> {                                        \
+    typedef TYPE payload_t;                                             \
+    static_assert(sizeof(TYPE) <= APP_EVENT_SLOT_SIZE,                  \
+                  "The payload of " #EVENT " is too large");            \
+    static_assert(std::is_trivially_copyable<TYPE>::value,              \
+                  "The payload of " #EVENT " must be trivially copyable"); \
+  };
+
+APP_EVENTS
+
+#undef DEF_EVENT
+
+// An event as stored in the application queue
+typedef struct {
+  app_event_t id;
+  alignas(8) uint8_t slot[APP_EVENT_SLOT_SIZE];
+} app_event_msg_t ;
+
+// Create the application queue and the task that processes its events.
+// Must be called before posting any event.
+void app_event_start(void);
+
+// Process an event in the application task (see app.cc)
+void app_event_dispatch(const app_event_msg_t &msg);
+
+// The name of an event (e.g. "APP_EVENT_SYNC")
+const char *app_event_name(app_event_t event);
 
+// The number of events of that kind processed so far by the application task
+uint32_t app_event_count(app_event_t event);
 
+// Untyped post. Prefer app_post<EVENT>() below.
 void app_post_event(app_event_t event, const void *arg, size_t argsize);
 
+//
+// Post an event with its payload.
+//
+// The payload is copied into the queue so the queue never allocates memory.
+//
+template <app_event_t EVENT>
+inline void
+app_post(const typename app_event_desc<EVENT>::payload_t &payload)
+{
+  app_post_event(EVENT, &payload, sizeof(payload));
+}
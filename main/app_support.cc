@@ -1,12 +1,80 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
 #include "app_events.h"
 #include "app.h"
 
+static const char TAG[] = "app_support" ;
+
+static QueueHandle_t app_event_queue = NULL;
+
+// The queue is allocated statically so posting an event never allocates memory.
+static StaticQueue_t app_event_queue_buffer;
+static uint8_t app_event_queue_storage[APP_EVENT_QUEUE_LENGTH * sizeof(app_event_msg_t)];
+
+#define DEF_EVENT(EVENT, TYPE) #EVENT,
+static const char * const app_event_names[APP_EVENT_COUNT] = {
+  APP_EVENTS
+};
+#undef DEF_EVENT
+
+// Only written by the application task
+static uint32_t app_event_counts[APP_EVENT_COUNT];
+
+static void
+app_event_task(void *arg)
+{
+  app_event_msg_t msg;
+  while (true) {
+    if (xQueueReceive(app_event_queue, &msg, portMAX_DELAY)) {
+      app_event_dispatch(msg);
+      if (msg.id < APP_EVENT_COUNT) {
+        app_event_counts[msg.id]++;
+      }
+    }
+  }
+}
+
+const char *
+app_event_name(app_event_t event)
+{
+  return (event < APP_EVENT_COUNT) ? app_event_names[event] : "?" ;
+}
+
+uint32_t
+app_event_count(app_event_t event)
+{
+  return (event < APP_EVENT_COUNT) ? app_event_counts[event] : 0 ;
+}
+
+void
+app_event_start(void)
+{
+  app_event_queue = xQueueCreateStatic(APP_EVENT_QUEUE_LENGTH,
+                                       sizeof(app_event_msg_t),
+                                       app_event_queue_storage,
+                                       &app_event_queue_buffer);
+  xTaskCreate(app_event_task, "app", APP_EVENT_TASK_STACK_SIZE, NULL, APP_EVENT_TASK_PRIORITY, NULL);
+}
+
 void
 app_post_event(app_event_t event, const void *arg, size_t argsize) {
-  esp_event_post(APP_EVENT, event, arg, argsize, portMAX_DELAY);
+  if (app_event_queue == NULL) {
+    ESP_LOGE(TAG, "Event %d posted before app_event_start()", (int) event);
+    return;
+  }
+  if (argsize > APP_EVENT_SLOT_SIZE) {
+    ESP_LOGE(TAG, "Payload of event %d is too large (%d bytes)", (int) event, (int) argsize);
+    return;
+  }
+  app_event_msg_t msg;
+  msg.id = event;
+  memcpy(msg.slot, arg, argsize);
+  xQueueSend(app_event_queue, &msg, portMAX_DELAY);
 }
 
 void
@@ -17,13 +85,13 @@ app_sync(void)
   app_event_sync_t arg = {
     .sem = sem_handle
   };
-  app_post_event(APP_EVENT_SYNC, &arg, sizeof(arg) );
+  app_post<APP_EVENT_SYNC>(arg);
   xSemaphoreTake(sem_handle, portMAX_DELAY);
 }
 
 void app_post_query_state(app_state_t *state_copy, bool async)
 {
-  app_post_event(APP_EVENT_QUERY_STATE, &state_copy, sizeof(app_state_t*) );
+  app_post<APP_EVENT_QUERY_STATE>(state_copy);
   if (!async) {
     app_sync();
   }
@@ -32,95 +100,144 @@ void app_post_query_state(app_state_t *state_copy, bool async)
 void
 app_post_reboot(void)
 {
-  app_post_event(APP_EVENT_REBOOT, NULL, 0);
+  app_post<APP_EVENT_REBOOT>({});
+}
+
+void
+app_post_config(const app_config_t &config)
+{
+  app_post<APP_EVENT_CONFIG>(config);
 }
 
 void
 app_post_mode(ac_mode_t mode)
 {
-  app_post_event(APP_EVENT_MODE, &mode, sizeof(mode));
+  app_config_t config = {};
+  config.mask = stf::mode;
+  config.mode = mode;
+  app_post_config(config);
 }
 
 void
 app_post_frame_size(int value, bool save)
 {
-  app_event_frame_size_t args = { .value=value , .save=save };
-  app_post_event(APP_EVENT_FRAME_SIZE, &args, sizeof(args));
+  app_config_t config = {};
+  config.mask = stf::frame_size;
+  config.save = save ? stf::frame_size : 0;
+  config.frame_size = value;
+  app_post_config(config);
 }
 
 void
-app_post_auto_available_power(int value)
+app_post_auto_available_power(int value, uint32_t trace)
 {
-  app_post_event(APP_EVENT_AUTO_AVAILABLE_POWER, &value, sizeof(value));
+  app_event_power_t args = { .power=value, .trace=trace } ;
+  app_post<APP_EVENT_AUTO_AVAILABLE_POWER>(args);
 }
 
 void
 app_post_auto_min_power(int value)
 {
-  app_post_event(APP_EVENT_AUTO_MIN_POWER, &value, sizeof(value));
+  app_config_t config = {};
+  config.mask = stf::auto_min_power;
+  config.auto_min_power = value;
+  app_post_config(config);
 }
 
 void
 app_post_auto_over_power(int value)
 {
-  app_post_event(APP_EVENT_AUTO_OVER_POWER, &value, sizeof(value));
+  app_config_t config = {};
+  config.mask = stf::auto_over_power;
+  config.auto_over_power = value;
+  app_post_config(config);
 }
 
 
 void
 app_post_manual_power(int value)
 {
-  app_post_event(APP_EVENT_MANUAL_POWER, &value, sizeof(value));
+  app_config_t config = {};
+  config.mask = stf::manual_power;
+  config.manual_power = value;
+  app_post_config(config);
 }
 
 
 void
 app_post_full_power(int value, bool save)
 {
-  app_event_full_power_t args = { .value=value , .save=save };
-  app_post_event(APP_EVENT_FULL_POWER, &args, sizeof(args));
+  app_config_t config = {};
+  config.mask = stf::full_power;
+  config.save = save ? stf::full_power : 0;
+  config.full_power = value;
+  app_post_config(config);
 }
 
 void
 app_post_timezone(const char *timezone)
 {
-  app_post_event(APP_EVENT_TIMEZONE, timezone, strlen(timezone)+1);
+  app_timezone_t arg;
+  arg = timezone;
+  app_post<APP_EVENT_TIMEZONE>(arg);
 }
 
 void
 app_post_hostname(const char *hostname)
 {
-  app_post_event(APP_EVENT_HOSTNAME, hostname, strlen(hostname)+1);
+  app_hostname_t arg;
+  arg = hostname;
+  app_post<APP_EVENT_HOSTNAME>(arg);
 }
 
 void
 app_post_ui_password(const char *password)
 {
-  app_post_event(APP_EVENT_UI_PASSWORD, password, strlen(password)+1);
+  app_password_t arg;
+  arg = password;
+  app_post<APP_EVENT_UI_PASSWORD>(arg);
 }
 
 void
 app_post_mqtt_uri(const char *uri)
 {
-  app_post_event(APP_EVENT_MQTT_URI, uri, strlen(uri)+1);
+  app_mqtt_uri_t arg;
+  arg = uri;
+  app_post<APP_EVENT_MQTT_URI>(arg);
+}
+
+void
+app_post_meter_topic(const char *topic)
+{
+  app_meter_topic_t arg;
+  arg = topic;
+  app_post<APP_EVENT_METER_TOPIC>(arg);
+}
+
+void
+app_post_meter_expr(const char *expr)
+{
+  app_meter_expr_t arg;
+  arg = expr;
+  app_post<APP_EVENT_METER_EXPR>(arg);
 }
 
 void app_post_button_press(char id, int duration_ms)
 {
   app_event_button_t args = { .id=id, .duration_ms=duration_ms } ;
-  app_post_event(APP_EVENT_BUTTON_PRESS, &args, sizeof(args));
+  app_post<APP_EVENT_BUTTON_PRESS>(args);
 }
 
 void app_post_button_release(char id, int duration_ms)
 {
   app_event_button_t args = { .id=id, .duration_ms=duration_ms } ;
-  app_post_event(APP_EVENT_BUTTON_RELEASE, &args, sizeof(args));
+  app_post<APP_EVENT_BUTTON_RELEASE>(args);
 }
 
 void app_post_wifi_cred(const char *ssid, const char *password)
 {
   app_wifi_cred_t cred={} ;
-  cred.ssid = ssid; 
-  cred.password = password; 
-  app_post_event(APP_EVENT_WIFI_CRED, &cred, sizeof(cred));
+  cred.ssid = ssid;
+  cred.password = password;
+  app_post<APP_EVENT_WIFI_CRED>(cred);
 }
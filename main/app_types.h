@@ -12,12 +12,16 @@ typedef enum {
 #define APP_SSID_MAXLEN     32
 #define APP_PASSWORD_MAXLEN 64
 #define APP_MQTT_URI_MAXLEN 64
+#define APP_METER_TOPIC_MAXLEN 64
+#define APP_METER_EXPR_MAXLEN  64
 
 typedef char_buffer<32> app_ssid_t;
 typedef char_buffer<32> app_password_t;
 typedef char_buffer<64> app_timezone_t;
 typedef char_buffer<32> app_hostname_t;
 typedef char_buffer<64> app_mqtt_uri_t;
+typedef char_buffer<64> app_meter_topic_t;
+typedef char_buffer<64> app_meter_expr_t;
 
 typedef struct {
   app_ssid_t ssid;
@@ -29,6 +33,7 @@ typedef struct {
 // Unless specified otherwise, all char buffers are NULL-terminated.  
 //
 typedef struct {
+  uint32_t version;  // Incremented each time the state is modified
   ac_mode_t mode; 
   int  full_power;   // The estimated AC power when 100% ON (saved in nvs)
   int  frame_size;   // The default frame size (saved in nvs).
@@ -40,6 +45,8 @@ typedef struct {
   app_wifi_cred_t wifi ;
   struct {
     app_mqtt_uri_t uri;
+    app_meter_topic_t meter_topic;  // The topic of the energy meter (saved in nvs)
+    app_meter_expr_t  meter_expr;   // The available power as an expression of the meter fields (saved in nvs)
   } mqtt;
   // Settings for AUTO mode (using MQTT)
   struct {
@@ -55,6 +62,11 @@ typedef struct {
   struct {
     int power;  // The target power
   } f;
+  // The current AC relay settings (computed from the fields above) 
+  struct {
+    int    power;  // The target power 
+    double ratio;  // The target ratio as returned by acr_set_target_ratio()
+  } relay;
 } app_state_t ; 
 
 // 'stf' stands for STate Field
@@ -78,12 +90,44 @@ constexpr mask_t auto_over_power = 1<<9 ;
 constexpr mask_t auto_min_power = 1<<10 ;
 constexpr mask_t manual_power = 1<<11 ;
 constexpr mask_t mqtt_uri   = 1<<12 ;
+constexpr mask_t relay_power = 1<<13 ;
+constexpr mask_t relay_ratio = 1<<14 ;
+constexpr mask_t meter_topic = 1<<15 ;
+constexpr mask_t meter_expr  = 1<<16 ;
 
 constexpr mask_t all   = mask_t(-1) ;
 
 // All fields that are saved in NVS 
 constexpr mask_t all_saved =
   frame_size | full_power | timezone | hostname |
-  wifi_ssid | wifi_password | ui_password | mqtt_uri;
+  wifi_ssid | wifi_password | ui_password | mqtt_uri |
+  meter_topic | meter_expr;
+
+// All fields that are secrets 
+constexpr mask_t all_secrets = wifi_password | ui_password ;
 
 } 
+
+//
+// A set of changes to the configuration that shall be applied atomically.
+//
+// Only the fields selected by .mask are applied. The fields selected by .save
+// are also saved in NVS (if they are part of stf::all_saved).
+//
+// Only the numerical fields of the state can be modified that way. 
+//
+typedef struct {
+  stf::mask_t mask;
+  stf::mask_t save;
+  ac_mode_t mode;
+  int frame_size;
+  int full_power;
+  int manual_power;
+  int auto_over_power;
+  int auto_min_power;
+} app_config_t ;
+
+// All fields that can be modified by an app_config_t 
+constexpr stf::mask_t app_config_mask =
+  stf::mode | stf::frame_size | stf::full_power | stf::manual_power |
+  stf::auto_over_power | stf::auto_min_power ;
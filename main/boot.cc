@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <algorithm>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "boot.h"
+
+static const char TAG[] = "boot" ;
+
+typedef struct {
+  const char *name;
+  boot_fn_t   fn;
+  EventBits_t wait;
+  EventBits_t done;
+  int64_t     t_start;   // in us since startup
+  int64_t     t_end;     // in us since startup or -1 while running
+} boot_stage_t ;
+
+static boot_stage_t boot_stages[BOOT_MAX_STAGES];
+static int boot_stage_count = 0;
+static portMUX_TYPE boot_mutex = portMUX_INITIALIZER_UNLOCKED;
+
+static StaticEventGroup_t boot_group_buffer;
+static EventGroupHandle_t boot_group = NULL;
+
+void
+boot_init(void)
+{
+  boot_group = xEventGroupCreateStatic(&boot_group_buffer);
+}
+
+// Reserve a new stage or return NULL if there are too many stages.
+// If 'unique' is true, return NULL if a stage with the same name exists.
+static boot_stage_t *
+boot_new_stage(const char *name, bool unique)
+{
+  boot_stage_t *stage = NULL;
+  taskENTER_CRITICAL(&boot_mutex);
+  bool found = false;
+  if (unique) {
+    for (int i=0; i<boot_stage_count; i++) {
+      if (!strcmp(boot_stages[i].name, name)) {
+        found = true;
+        break;
+      }
+    }
+  }
+  if (!found && boot_stage_count < BOOT_MAX_STAGES) {
+    stage = &boot_stages[boot_stage_count++];
+    stage->name    = name;
+    stage->t_start = -1;
+    stage->t_end   = -1;
+  }
+  taskEXIT_CRITICAL(&boot_mutex);
+  return stage;
+}
+
+void
+boot_wait(EventBits_t bits)
+{
+  if (bits) {
+    xEventGroupWaitBits(boot_group, bits, pdFALSE, pdTRUE, portMAX_DELAY);
+  }
+}
+
+static void
+boot_execute(boot_stage_t *stage)
+{
+  boot_wait(stage->wait);
+  stage->t_start = esp_timer_get_time();
+  stage->fn();
+  stage->t_end = esp_timer_get_time();
+  if (stage->done) {
+    xEventGroupSetBits(boot_group, stage->done);
+  }
+}
+
+void
+boot_run(const char *name, boot_fn_t fn, EventBits_t wait, EventBits_t done)
+{
+  boot_stage_t *stage = boot_new_stage(name, false);
+  if (!stage) {
+    ESP_LOGE(TAG, "Too many stages. Cannot profile '%s'", name);
+    boot_wait(wait);
+    fn();
+    xEventGroupSetBits(boot_group, done);
+    return;
+  }
+  stage->fn   = fn;
+  stage->wait = wait;
+  stage->done = done;
+  boot_execute(stage);
+}
+
+static void
+boot_task(void *arg)
+{
+  boot_execute((boot_stage_t *) arg);
+  vTaskDelete(NULL);
+}
+
+void
+boot_run_async(const char *name, boot_fn_t fn, EventBits_t wait, EventBits_t done)
+{
+  boot_stage_t *stage = boot_new_stage(name, false);
+  if (stage) {
+    stage->fn   = fn;
+    stage->wait = wait;
+    stage->done = done;
+    // Use the same priority as the caller (usually the main task)
+    if (xTaskCreate(boot_task, name, BOOT_TASK_STACK_SIZE, stage, uxTaskPriorityGet(NULL), NULL) == pdPASS) {
+      return;
+    }
+    ESP_LOGE(TAG, "Failed to create a task for '%s'", name);
+  } else {
+    ESP_LOGE(TAG, "Too many stages. Cannot start '%s' asynchronously", name);
+  }
+  boot_run(name, fn, wait, done);
+}
+
+void
+boot_mark(const char *name)
+{
+  int64_t now = esp_timer_get_time();
+  boot_stage_t *stage = boot_new_stage(name, true);
+  if (stage) {
+    stage->fn      = NULL;
+    stage->wait    = 0;
+    stage->done    = 0;
+    stage->t_end   = now;
+    stage->t_start = now;
+  }
+}
+
+void
+boot_print_profile(void)
+{
+  constexpr int WIDTH = 40; // Width of the timeline in characters
+
+  int count;
+  int64_t last = 1;
+  taskENTER_CRITICAL(&boot_mutex);
+  count = boot_stage_count;
+  taskEXIT_CRITICAL(&boot_mutex);
+
+  for (int i=0; i<count; i++) {
+    last = std::max(last, boot_stages[i].t_end);
+  }
+
+  printf("Boot profile (reset reason %d, all times in ms since startup)\n", (int) esp_reset_reason());
+  printf("   start      end  duration  timeline\n");
+  for (int i=0; i<count; i++) {
+    const boot_stage_t &stage = boot_stages[i];
+    if (stage.t_start < 0) {
+      printf("       -        -         -  %*s  %s (waiting)\n", WIDTH, "", stage.name);
+      continue;
+    }
+    if (stage.t_end < 0) {
+      printf("%8.1f        -         -  %*s  %s (running)\n", stage.t_start/1000.0, WIDTH, "", stage.name);
+      continue;
+    }
+    char line[WIDTH+1];
+    int a = stage.t_start * WIDTH / last ;
+    int b = stage.t_end * WIDTH / last ;
+    for (int k=0; k<WIDTH; k++) {
+      line[k] = (k<a) ? ' ' : (k<=b) ? (stage.fn ? '=' : '|') : ' ' ;
+    }
+    line[WIDTH] = '\0';
+    printf("%8.1f %8.1f %9.1f  %s  %s\n",
+           stage.t_start/1000.0,
+           stage.t_end/1000.0,
+           (stage.t_end-stage.t_start)/1000.0,
+           line,
+           stage.name);
+  }
+}
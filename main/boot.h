@@ -0,0 +1,52 @@
+#pragma once
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+//
+// Staged startup with boot-time profiling.
+//
+// The startup is split in stages. Each stage sets one or more BOOT_xxx bits
+// when it completes and can wait for the bits of the stages it depends on.
+// Stages without dependencies between them can be run concurrently with
+// boot_run_async().
+//
+// The start and end time of each stage (from esp_timer_get_time) is recorded
+// so that boot_print_profile() can print a timeline of the startup.
+//
+
+#define BOOT_LED      (1<<0)   // The RGB led is initialized
+#define BOOT_STATE    (1<<1)   // The NVS is initialized and the state is loaded
+#define BOOT_EVENTS   (1<<2)   // The app queue, the default event loop and esp_netif are ready
+#define BOOT_ACR      (1<<3)   // The AC relay is running
+#define BOOT_HTTP     (1<<4)   // The HTTP server is started
+#define BOOT_MQTT     (1<<5)   // The MQTT client is started
+#define BOOT_WIFI     (1<<6)   // The WiFi is started
+
+#define BOOT_MAX_STAGES 24
+
+// The stack size of the tasks created by boot_run_async()
+#define BOOT_TASK_STACK_SIZE 4096
+
+typedef void (*boot_fn_t)(void);
+
+// Must be called first.
+void boot_init(void);
+
+// Wait for the stages in 'wait' and then run a stage in the current task.
+void boot_run(const char *name, boot_fn_t fn, EventBits_t wait, EventBits_t done);
+
+// Same as boot_run() but in a new task.
+void boot_run_async(const char *name, boot_fn_t fn, EventBits_t wait, EventBits_t done);
+
+// Wait for the completion of the specified stages.
+void boot_wait(EventBits_t bits);
+
+// Record a milestone (a stage without duration).
+//
+// Only the first occurence of each milestone is recorded
+// so this can be called from code executed more than once.
+void boot_mark(const char *name);
+
+// Print the timeline of all the recorded stages
+void boot_print_profile(void);
@@ -0,0 +1,549 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "esp_log.h"
+
+#include "command.h"
+#include "perfect_hash.h"
+#include "meter_expr.h"
+#include "ota.h"
+
+static const char TAG[] = "command" ;
+
+//
+// The schemas of the commands.
+//
+// FIELD(NAME, TYPE, REQUIRED) describes one field. The trailing comma is
+// intentional so that a command without fields can use an empty list.
+//
+#define FIELD(NAME, TYPE, REQUIRED) { NAME, CMD_TYPE_##TYPE, REQUIRED },
+
+#define REQUIRED true
+#define OPTIONAL false
+
+//
+// The table of all commands.
+//
+// DEF_COMMAND(NAME, ID, FLAGS, FIELDS) where
+//   - NAME is the action name
+//   - ID is used to name the handler cmd_on_ID
+//   - FLAGS is a combination of CMD_xxx flags
+//   - FIELDS is a list of FIELD()
+//
+#define COMMANDS                                                        \
+  DEF_COMMAND("reboot",         reboot,         0,                      \
+              )                                                         \
+  DEF_COMMAND("get-state",      get_state,      0,                      \
+              )                                                         \
+  DEF_COMMAND("set-full-power", set_full_power, 0,                      \
+              FIELD("value", INT, REQUIRED)                             \
+              FIELD("save", BOOL, OPTIONAL))                            \
+  DEF_COMMAND("set-frame-size", set_frame_size, 0,                      \
+              FIELD("value", INT, REQUIRED)                             \
+              FIELD("save", BOOL, OPTIONAL))                            \
+  DEF_COMMAND("set-wifi-cred",  set_wifi_cred,  0,                      \
+              FIELD("wifi_ssid", STRING, REQUIRED)                      \
+              FIELD("wifi_password", STRING, REQUIRED))                 \
+  DEF_COMMAND("set-time",       set_time,       0,                      \
+              FIELD("timezone", STRING, REQUIRED))                      \
+  DEF_COMMAND("set-hostname",   set_hostname,   0,                      \
+              FIELD("hostname", STRING, REQUIRED))                      \
+  DEF_COMMAND("auto-mode",      auto_mode,      0,                      \
+              FIELD("auto_over_power", INT, REQUIRED)                   \
+              FIELD("auto_min_power", INT, REQUIRED))                   \
+  DEF_COMMAND("manual-mode",    manual_mode,    0,                      \
+              FIELD("manual_power", INT, REQUIRED))                     \
+  DEF_COMMAND("mqtt",           mqtt,           0,                      \
+              FIELD("mqtt_uri", STRING, REQUIRED))                      \
+  DEF_COMMAND("meter",          meter,          0,                      \
+              FIELD("meter_topic", STRING, REQUIRED)                    \
+              FIELD("meter_expr", STRING, REQUIRED))                    \
+  DEF_COMMAND("ui",             ui,             0,                      \
+              FIELD("ui_password", STRING, REQUIRED))                   \
+  DEF_COMMAND("set",            set,            CMD_MQTT,               \
+              FIELD("mode", STRING, OPTIONAL)                           \
+              FIELD("frame_size", INT, OPTIONAL)                        \
+              FIELD("full_power", INT, OPTIONAL)                        \
+              FIELD("manual_power", INT, OPTIONAL)                      \
+              FIELD("auto_min_power", INT, OPTIONAL)                    \
+              FIELD("auto_over_power", INT, OPTIONAL))                  \
+
+
+//
+// The accessors of the input fields
+//
+
+const char *
+cmd_get_string(const cmd_context_t &ctx, const char *name, const char *default_value)
+{
+  const json_field_t *item = ctx.input.find(name);
+  return (item && item->type == JSON_TYPE_STRING) ? item->str : default_value ;
+}
+
+// Reminder: json numbers are all 'double' so they are
+//           truncated and clamped to the range of 'int'.
+int
+cmd_get_int(const cmd_context_t &ctx, const char *name, int default_value)
+{
+  const json_field_t *item = ctx.input.find(name);
+  if (!item || item->type != JSON_TYPE_NUMBER) {
+    return default_value;
+  } else if (item->number >= INT32_MAX) {
+    return INT32_MAX;
+  } else if (item->number <= INT32_MIN) {
+    return INT32_MIN;
+  } else {
+    return (int) item->number;
+  }
+}
+
+bool
+cmd_get_bool(const cmd_context_t &ctx, const char *name, bool default_value)
+{
+  const json_field_t *item = ctx.input.find(name);
+  if (!item) {
+    return default_value;
+  } else if ( item->type == JSON_TYPE_TRUE ) {
+    return true;
+  } else if ( item->type == JSON_TYPE_FALSE ) {
+    return false;
+  } else {
+    return default_value;
+  }
+}
+
+bool
+cmd_has(const cmd_context_t &ctx, const char *name)
+{
+  return ctx.input.find(name) != NULL;
+}
+
+//
+// The command handlers
+//
+
+static bool cmd_on_reboot(cmd_context_t &ctx)
+{
+  ctx.effects.mask |= CMD_EFFECT_REBOOT;
+  return true ;
+}
+
+static bool cmd_on_get_state(cmd_context_t &ctx)
+{
+  ctx.report = stf::all ;
+  return true ;
+}
+
+static bool cmd_on_set_full_power(cmd_context_t &ctx)
+{
+  ctx.config.mask |= stf::full_power;
+  ctx.config.full_power = cmd_get_int(ctx, "value");
+  if (cmd_get_bool(ctx, "save", false)) {
+    ctx.config.save |= stf::full_power;
+  }
+  ctx.report |= stf::full_power;
+  return true ;
+}
+
+static bool cmd_on_set_frame_size(cmd_context_t &ctx)
+{
+  ctx.config.mask |= stf::frame_size;
+  ctx.config.frame_size = cmd_get_int(ctx, "value");
+  if (cmd_get_bool(ctx, "save", false)) {
+    ctx.config.save |= stf::frame_size;
+  }
+  ctx.report |= stf::frame_size;
+  return true ;
+}
+
+static bool cmd_on_set_wifi_cred(cmd_context_t &ctx)
+{
+  ctx.effects.mask |= CMD_EFFECT_WIFI_CRED;
+  ctx.effects.wifi_ssid     = cmd_get_string(ctx, "wifi_ssid");
+  ctx.effects.wifi_password = cmd_get_string(ctx, "wifi_password");
+  ctx.report |= stf::wifi_ssid | stf::wifi_password;
+  return true ;
+}
+
+static bool cmd_on_set_time(cmd_context_t &ctx)
+{
+  ctx.effects.mask |= CMD_EFFECT_TIMEZONE;
+  ctx.effects.timezone = cmd_get_string(ctx, "timezone");
+  ctx.report |= stf::timezone;
+  return true ;
+}
+
+static bool cmd_on_set_hostname(cmd_context_t &ctx)
+{
+  ctx.effects.mask |= CMD_EFFECT_HOSTNAME;
+  ctx.effects.hostname = cmd_get_string(ctx, "hostname");
+  ctx.report |= stf::hostname;
+  return true ;
+}
+
+static bool cmd_on_mqtt(cmd_context_t &ctx)
+{
+  ctx.effects.mask |= CMD_EFFECT_MQTT_URI;
+  ctx.effects.mqtt_uri = cmd_get_string(ctx, "mqtt_uri");
+  ctx.report |= stf::mqtt_uri;
+  return true ;
+}
+
+// The expression is compiled here only to report the errors to the user.
+static bool cmd_on_meter(cmd_context_t &ctx)
+{
+  const char *topic = cmd_get_string(ctx, "meter_topic");
+  const char *expr  = cmd_get_string(ctx, "meter_expr");
+  if (topic[0] == '\0' || strlen(topic) >= APP_METER_TOPIC_MAXLEN) {
+    cmd_write_error(ctx.output, "Bad meter topic");
+    return false;
+  }
+  if (strlen(expr) >= APP_METER_EXPR_MAXLEN) {
+    cmd_write_error(ctx.output, "Meter expression is too long");
+    return false;
+  }
+  meter_expr_t program;
+  char error[64];
+  if (!meter_expr_compile(program, expr, error, sizeof(error))) {
+    cmd_write_error(ctx.output, "Bad meter expression: %s", error);
+    return false;
+  }
+  ctx.effects.mask |= CMD_EFFECT_METER;
+  ctx.effects.meter_topic = topic;
+  ctx.effects.meter_expr  = expr;
+  ctx.report |= stf::meter_topic | stf::meter_expr;
+  return true ;
+}
+
+static bool cmd_on_ui(cmd_context_t &ctx)
+{
+  ctx.effects.mask |= CMD_EFFECT_UI_PASSWORD;
+  ctx.effects.ui_password = cmd_get_string(ctx, "ui_password");
+  ctx.report |= stf::ui_password;
+  return true ;
+}
+
+static bool cmd_on_auto_mode(cmd_context_t &ctx)
+{
+  ctx.config.mask |= stf::auto_over_power | stf::auto_min_power ;
+  ctx.config.auto_over_power = cmd_get_int(ctx, "auto_over_power");
+  ctx.config.auto_min_power  = cmd_get_int(ctx, "auto_min_power");
+  ctx.report |= stf::auto_over_power | stf::auto_min_power;
+  return true ;
+}
+
+static bool cmd_on_manual_mode(cmd_context_t &ctx)
+{
+  ctx.config.mask |= stf::manual_power;
+  ctx.config.manual_power = cmd_get_int(ctx, "manual_power");
+  ctx.report |= stf::manual_power;
+  return true ;
+}
+
+// Set any combination of the numerical fields at once.
+static bool cmd_on_set(cmd_context_t &ctx)
+{
+  app_config_t &config = ctx.config;
+
+  const char *mode = cmd_get_string(ctx, "mode");
+  if (mode) {
+    if (!strcmp(mode,"auto")) {
+      config.mode = AC_MODE_AUTO;
+    } else if (!strcmp(mode,"manual")) {
+      config.mode = AC_MODE_MANUAL;
+    } else {
+      cmd_write_error(ctx.output, "Unknown mode %s", mode);
+      return false;
+    }
+    config.mask |= stf::mode;
+  }
+
+  if (cmd_has(ctx, "frame_size")) {
+    config.mask |= stf::frame_size;
+    config.frame_size = cmd_get_int(ctx, "frame_size");
+  }
+
+  if (cmd_has(ctx, "full_power")) {
+    config.mask |= stf::full_power;
+    config.full_power = cmd_get_int(ctx, "full_power");
+  }
+
+  if (cmd_has(ctx, "manual_power")) {
+    config.mask |= stf::manual_power;
+    config.manual_power = cmd_get_int(ctx, "manual_power");
+  }
+
+  if (cmd_has(ctx, "auto_min_power")) {
+    config.mask |= stf::auto_min_power;
+    config.auto_min_power = cmd_get_int(ctx, "auto_min_power");
+  }
+
+  if (cmd_has(ctx, "auto_over_power")) {
+    config.mask |= stf::auto_over_power;
+    config.auto_over_power = cmd_get_int(ctx, "auto_over_power");
+  }
+
+  ctx.report |= config.mask;
+  return true;
+}
+
+//
+// The command table and its perfect hash.
+//
+
+#define DEF_COMMAND(NAME, ID, FLAGS, FIELDS) \
+  static constexpr cmd_field_t cmd_fields_##ID[] = { FIELDS { NULL, CMD_TYPE_INT, false } };
+COMMANDS
+#undef DEF_COMMAND
+
+static constexpr cmd_desc_t cmd_table[] = {
+#define DEF_COMMAND(NAME, ID, FLAGS, FIELDS) \
+  { .name = NAME, .handler = cmd_on_##ID, .fields = cmd_fields_##ID, .flags = FLAGS },
+  COMMANDS
+#undef DEF_COMMAND
+};
+
+// The lookup by name uses a perfect hash computed at compile time (see
+// perfect_hash.h). The size of the hash table must be a power of 2.
+constexpr int CMD_HASH_SIZE = 32;
+
+static constexpr auto cmd_index =
+  perfect_hash_build<CMD_HASH_SIZE>(cmd_table, [](const cmd_desc_t &cmd) { return cmd.name; });
+
+static_assert(cmd_index.seed >= 0, "No perfect hash found for the command names. Increase CMD_HASH_SIZE");
+
+const cmd_desc_t *
+cmd_find(const char *name)
+{
+  int i = cmd_index.lookup(name);
+  if (i >= 0 && strcmp(cmd_table[i].name, name) == 0) {
+    return &cmd_table[i];
+  }
+  return NULL;
+}
+
+//
+// Execution
+//
+
+void
+cmd_write_error(json_writer &output, const char *format, ...)
+{
+  char msg[100];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(msg, sizeof(msg), format, args);
+  va_end(args);
+  msg[sizeof(msg)-1] = '\0';
+
+  output.add_string("error", msg);
+}
+
+// Check the input against the schema of a command
+static bool
+cmd_check_fields(const cmd_desc_t *cmd, const json_reader &input, json_writer &output)
+{
+  for (const cmd_field_t *field = cmd->fields; field->name; field++) {
+    const json_field_t *item = input.find(field->name);
+    if (!item) {
+      if (field->required) {
+        cmd_write_error(output, "Missing field %s", field->name);
+        return false;
+      }
+      continue;
+    }
+    switch (field->type) {
+      case CMD_TYPE_INT:
+        if (item->type != JSON_TYPE_NUMBER) {
+          cmd_write_error(output, "Number expected for field %s", field->name);
+          return false;
+        }
+        break;
+      case CMD_TYPE_BOOL:
+        if (item->type != JSON_TYPE_TRUE && item->type != JSON_TYPE_FALSE) {
+          cmd_write_error(output, "Boolean expected for field %s", field->name);
+          return false;
+        }
+        break;
+      case CMD_TYPE_STRING:
+        if (item->type != JSON_TYPE_STRING) {
+          cmd_write_error(output, "String expected for field %s", field->name);
+          return false;
+        }
+        break;
+    }
+  }
+  return true;
+}
+
+bool
+cmd_run(cmd_batch_t &batch, const char *name, const json_reader &input, json_writer &output, bool authenticated)
+{
+  const cmd_desc_t *cmd = cmd_find(name);
+  if (!cmd) {
+    cmd_write_error(output, "Unsupported action");
+    return false;
+  }
+
+  if (!(cmd->flags & CMD_MQTT) && !authenticated) {
+    ESP_LOGW(TAG, "Refused unauthenticated '%s'", name);
+    cmd_write_error(output, "Authentication required");
+    return false;
+  }
+
+  if (!cmd_check_fields(cmd, input, output)) {
+    return false;
+  }
+
+  // The handler works on a copy so a failed command has no effect on the batch 
+  cmd_batch_t copy = batch;
+  cmd_context_t ctx = { .input = input, .output = output, .config = copy.config,
+                        .effects = copy.effects, .report = copy.report };
+  if (!cmd->handler(ctx)) {
+    return false;
+  }
+  batch = copy;
+  return true;
+}
+
+void
+cmd_commit(cmd_batch_t &batch, json_writer *output)
+{
+  if (batch.config.mask) {
+    app_post_config(batch.config);
+  }
+
+  const cmd_effects_t &effects = batch.effects;
+  if (effects.mask & CMD_EFFECT_WIFI_CRED) {
+    app_post_wifi_cred(effects.wifi_ssid, effects.wifi_password);
+  }
+  if (effects.mask & CMD_EFFECT_TIMEZONE) {
+    app_post_timezone(effects.timezone);
+  }
+  if (effects.mask & CMD_EFFECT_HOSTNAME) {
+    app_post_hostname(effects.hostname);
+  }
+  if (effects.mask & CMD_EFFECT_MQTT_URI) {
+    app_post_mqtt_uri(effects.mqtt_uri);
+  }
+  if (effects.mask & CMD_EFFECT_METER) {
+    app_post_meter_topic(effects.meter_topic);
+    app_post_meter_expr(effects.meter_expr);
+  }
+  if (effects.mask & CMD_EFFECT_UI_PASSWORD) {
+    app_post_ui_password(effects.ui_password);
+  }
+  // Delayed so that the response is sent first
+  if (effects.mask & CMD_EFFECT_REBOOT) {
+    ota_reboot();
+  }
+
+  if (output && batch.report) {
+    app_state_t state;
+    app_post_query_state(&state);
+    cmd_write_state(*output, batch.report, state);
+  }
+}
+
+bool
+cmd_execute(const char *name, const json_reader &input, json_writer &output, bool authenticated, bool report)
+{
+  cmd_batch_t batch = {};
+  if (!cmd_run(batch, name, input, output, authenticated)) {
+    return false;
+  }
+  cmd_commit(batch, report ? &output : NULL);
+  return true;
+}
+
+void
+cmd_write_state(json_writer &output, stf::mask_t mask, const app_state_t &state)
+{
+  if (mask & stf::mode)
+    {
+      const char *mode_name;
+      switch(state.mode) {
+        case AC_MODE_AUTO:   mode_name="auto"; break ;
+        case AC_MODE_MANUAL: mode_name="manual"; break;
+        default: mode_name="unknown" ; break;
+      }
+      output.add_string("mode", mode_name);
+    }
+
+  if (mask & stf::frame_size) {
+    output.add_int("frame_size", state.frame_size);
+  }
+
+  if (mask & stf::full_power) {
+    output.add_int("full_power", state.full_power);
+  }
+
+  if (mask & stf::timezone)
+  {
+    output.add_string("timezone", state.timezone.data);
+    // Also generate the localtime
+    time_t now;
+    struct tm timeinfo;
+    char buffer[64];
+    time(&now);
+    localtime_r(&now, &timeinfo);
+    strftime(buffer, sizeof(buffer), "%F %T UTC%z", &timeinfo);
+    output.add_string("localtime", buffer);
+  }
+
+  if (mask & stf::hostname) {
+    output.add_string("hostname", state.hostname.data);
+  }
+
+  if (mask & stf::mqtt_uri) {
+    output.add_string("mqtt_uri", state.mqtt.uri.data);
+  }
+
+  if (mask & stf::meter_topic) {
+    output.add_string("meter_topic", state.mqtt.meter_topic.data);
+  }
+
+  if (mask & stf::meter_expr) {
+    output.add_string("meter_expr", state.mqtt.meter_expr.data);
+  }
+
+  if (mask & stf::wifi_ssid ) {
+    output.add_string("wifi_ssid", state.wifi.ssid.data);
+  }
+
+  if (mask & stf::wifi_password) {
+    output.add_string("wifi_password", state.wifi.password.data);
+  }
+
+  if (mask & stf::ui_password) {
+    output.add_string("ui_password", state.ui.password.data);
+  }
+
+  if (mask & stf::auto_available_power) {
+    output.add_int("auto_available_power", state.a.available_power);
+  }
+
+  if (mask & stf::auto_over_power) {
+    output.add_int("auto_over_power", state.a.over_power);
+  }
+
+  if (mask & stf::auto_min_power) {
+    output.add_int("auto_min_power", state.a.min_power);
+  }
+
+  if (mask & stf::manual_power) {
+    output.add_int("manual_power", state.m.power);
+  }
+
+  if (mask & stf::relay_power) {
+    output.add_int("relay_power", state.relay.power);
+  }
+
+  if (mask & stf::relay_ratio) {
+    output.add_double("relay_ratio", state.relay.ratio);
+  }
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "app.h"
+#include "json_reader.h"
+#include "json_writer.h"
+
+//
+// The command registry shared by all user interfaces (http, mqtt, ...)
+//
+// A command is identified by its action name (e.g. "set-full-power") and
+// receives its arguments as the fields of a flat JSON object. The fields
+// are validated against the schema of the command before its handler is
+// called.
+//
+// The changes requested by a command are collected in an app_config_t and
+// applied as a single transaction once the handler succeeds. The other
+// side effects (e.g. a reboot or new WiFi credentials) are also recorded
+// and only performed with the transaction. The state fields that were
+// modified are then reported in the output.
+//
+// The lookup of the action name uses a perfect hash computed at compile
+// time (see command.cc).
+//
+
+typedef enum {
+  CMD_TYPE_INT,
+  CMD_TYPE_BOOL,
+  CMD_TYPE_STRING,
+} cmd_type_t ;
+
+typedef struct {
+  const char *name;    // NULL for the last field of a schema
+  cmd_type_t  type;
+  bool        required;
+} cmd_field_t ;
+
+// The command flags
+#define CMD_MQTT   (1<<0)   // Allowed to the unauthenticated clients of the MQTT set topic
+
+// The side effects that are not part of app_config_t (see cmd_effects_t)
+#define CMD_EFFECT_REBOOT      (1<<0)
+#define CMD_EFFECT_WIFI_CRED   (1<<1)
+#define CMD_EFFECT_TIMEZONE    (1<<2)
+#define CMD_EFFECT_HOSTNAME    (1<<3)
+#define CMD_EFFECT_MQTT_URI    (1<<4)
+#define CMD_EFFECT_METER       (1<<5)
+#define CMD_EFFECT_UI_PASSWORD (1<<6)
+
+// The side effects requested by the commands of a transaction. The last
+// command wins if several commands request the same effect.
+//
+// Reminder: the strings point into the input of the commands (see
+//           json_reader) which must remain alive until cmd_commit().
+typedef struct {
+  int         mask;    // CMD_EFFECT_xxx
+  const char *wifi_ssid;
+  const char *wifi_password;
+  const char *timezone;
+  const char *hostname;
+  const char *mqtt_uri;
+  const char *meter_topic;
+  const char *meter_expr;
+  const char *ui_password;
+} cmd_effects_t ;
+
+// A transaction shared by one or more commands
+typedef struct {
+  app_config_t  config;    // The changes applied by cmd_commit()
+  cmd_effects_t effects;   // The side effects performed by cmd_commit()
+  stf::mask_t   report;    // The state fields reported by cmd_commit()
+} cmd_batch_t ;
+
+// The context passed to the handler of a command
+typedef struct {
+  const json_reader &input;
+  json_writer       &output;
+  app_config_t      &config;    // The transaction (applied after the handler)
+  cmd_effects_t     &effects;   // Performed with the transaction
+  stf::mask_t       &report;    // The state fields to report after the transaction
+} cmd_context_t ;
+
+typedef bool (*cmd_handler_t)(cmd_context_t &ctx);
+
+typedef struct {
+  const char        *name;
+  cmd_handler_t      handler;
+  const cmd_field_t *fields;
+  int                flags;
+} cmd_desc_t ;
+
+// Get a command by name or NULL.
+const cmd_desc_t *cmd_find(const char *name);
+
+//
+// Execute the command 'name' with the fields of 'input' as arguments.
+//
+// An "error" item is written to 'output' on failure. If 'report' is true
+// then the state fields modified by the command are written to 'output'.
+//
+// 'authenticated' tells whether the client was authenticated by the
+// user interface. If not (i.e. the MQTT set topic), only the commands with
+// the CMD_MQTT flag are accepted.
+//
+// This function may block until the command is processed by the
+// application task so it shall not be called from that task.
+//
+bool cmd_execute(const char *name, const json_reader &input, json_writer &output, bool authenticated, bool report=true);
+
+//
+// Execute several commands as a single transaction:
+//
+//   cmd_batch_t batch = {};
+//   cmd_run(batch, ...);   // for each command
+//   cmd_commit(batch, &output);
+//
+// cmd_run() validates and runs one command. The changes to the configuration
+// and the other side effects are accumulated in the batch (so the last
+// command wins if several commands change the same field) and are only
+// applied by cmd_commit(). Nothing happens if cmd_commit() is not called
+// (e.g. when a later command of the batch fails).
+//
+bool cmd_run(cmd_batch_t &batch, const char *name, const json_reader &input, json_writer &output, bool authenticated);
+
+// Apply the changes of a batch, perform its side effects (the reboot last)
+// and write the reported state fields to 'output' (unless NULL).
+void cmd_commit(cmd_batch_t &batch, json_writer *output);
+
+// Write some fields of the state to 'output'
+void cmd_write_state(json_writer &output, stf::mask_t mask, const app_state_t &state);
+
+// Write an "error" item to 'output'
+void cmd_write_error(json_writer &output, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Accessors for the fields of the input of a command.
+// Their validity was checked against the schema of the command.
+int         cmd_get_int(const cmd_context_t &ctx, const char *name, int default_value=0);
+bool        cmd_get_bool(const cmd_context_t &ctx, const char *name, bool default_value=false);
+const char *cmd_get_string(const cmd_context_t &ctx, const char *name, const char *default_value=NULL);
+bool        cmd_has(const cmd_context_t &ctx, const char *name);
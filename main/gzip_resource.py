@@ -0,0 +1,25 @@
+#!/usr/bin/env python3
+#
+# Compress a resource file with gzip.
+#
+# The output is reproducible (no file name and a null timestamp in the
+# gzip header) so the firmware does not change when nothing changed.
+#
+# Usage: gzip_resource.py INPUT OUTPUT
+#
+
+import gzip
+import sys
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('Usage: gzip_resource.py INPUT OUTPUT')
+    with open(sys.argv[1], 'rb') as f:
+        data = f.read()
+    with open(sys.argv[2], 'wb') as f:
+        f.write(gzip.compress(data, compresslevel=9, mtime=0))
+
+
+if __name__ == '__main__':
+    main()
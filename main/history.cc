@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "history.h"
+#include "app.h"
+#include "acr.h"
+
+static const char TAG[] = "history" ;
+
+// The size of a block including its header
+#define HISTORY_BLOCK_SIZE 256
+
+// The estimated average size of an encoded sample. That is only used
+// to size the rings.
+#define HISTORY_SAMPLE_SIZE_ESTIMATE (2*HISTORY_CHANNEL_COUNT)
+
+// The maximum size of an encoded sample (a varint of 32 bits takes 5 bytes)
+#define HISTORY_SAMPLE_SIZE_MAX (5*HISTORY_CHANNEL_COUNT)
+
+typedef struct {
+  uint32_t start;    // The time of the first sample
+  uint16_t count;    // The number of samples
+  uint16_t used;     // The number of bytes used in data
+  uint8_t  data[HISTORY_BLOCK_SIZE-8];
+} history_block_t ;
+
+static_assert(sizeof(history_block_t) == HISTORY_BLOCK_SIZE, "Unexpected padding in history_block_t");
+
+// The number of blocks required to store 'samples' samples (approximately)
+#define HISTORY_BLOCKS(samples) \
+  (((samples) * HISTORY_SAMPLE_SIZE_ESTIMATE) / sizeof(history_block_t::data) + 2)
+
+//
+// The tiers in the order of history_tier_t.
+//
+//   DEF_TIER(ID, PERIOD, RETENTION)
+//
+// The PERIOD (in seconds) of a tier must be a multiple of the period of
+// the previous tier. The RETENTION is the number of samples.
+//
+#define HISTORY_TIERS \
+  DEF_TIER(HISTORY_TIER_1S,  1,    10*60)     \
+  DEF_TIER(HISTORY_TIER_1M,  60,   24*60)     \
+  DEF_TIER(HISTORY_TIER_15M, 900,  30*24*4)   \
+
+#define DEF_TIER(ID, PERIOD, RETENTION) static history_block_t blocks_##ID[HISTORY_BLOCKS(RETENTION)];
+HISTORY_TIERS
+#undef DEF_TIER
+
+typedef struct {
+  history_block_t *blocks;
+  uint32_t nblocks;
+  uint32_t period;
+  uint32_t generation;    // The number of blocks started so far. The current one is generation-1
+  uint32_t valid;         // The number of valid blocks in the ring
+  int32_t  last[HISTORY_CHANNEL_COUNT];    // The last sample of the current block
+  // The accumulation of the samples for the next tier
+  int64_t  sum[HISTORY_CHANNEL_COUNT];
+  uint32_t sum_count;
+  uint32_t sum_start;
+} history_tier_state_t ;
+
+static history_tier_state_t tiers[] = {
+#define DEF_TIER(ID, PERIOD, RETENTION) \
+  { .blocks = blocks_##ID, .nblocks = HISTORY_BLOCKS(RETENTION), .period = PERIOD },
+  HISTORY_TIERS
+#undef DEF_TIER
+};
+
+static_assert(sizeof(tiers)/sizeof(tiers[0]) == HISTORY_TIER_COUNT, "HISTORY_TIERS does not match history_tier_t");
+
+#define DEF_CHANNEL(ID, NAME, UNIT) NAME,
+static const char * const channel_names[HISTORY_CHANNEL_COUNT] = { HISTORY_CHANNELS };
+#undef DEF_CHANNEL
+
+#define DEF_CHANNEL(ID, NAME, UNIT) UNIT,
+static const char * const channel_units[HISTORY_CHANNEL_COUNT] = { HISTORY_CHANNELS };
+#undef DEF_CHANNEL
+
+// Protects the tiers and the values below
+static portMUX_TYPE history_mutex = portMUX_INITIALIZER_UNLOCKED;
+
+// The latest values of the channels provided by the application state
+static int32_t  current[HISTORY_CHANNEL_COUNT];
+
+// The current time in seconds
+static uint32_t now = 0;
+
+static esp_timer_handle_t history_timer = NULL;
+
+static inline uint32_t
+zigzag(int32_t v)
+{
+  return (uint32_t(v) << 1) ^ uint32_t(v >> 31);
+}
+
+static inline int32_t
+unzigzag(uint32_t v)
+{
+  return int32_t(v >> 1) ^ -int32_t(v & 1);
+}
+
+static inline uint8_t *
+put_varint(uint8_t *p, uint32_t v)
+{
+  while (v >= 0x80) {
+    *p++ = uint8_t(v) | 0x80;
+    v >>= 7;
+  }
+  *p++ = uint8_t(v);
+  return p;
+}
+
+static inline const uint8_t *
+get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+  uint32_t result = 0;
+  for (int shift=0; shift<35 && p<end; shift+=7) {
+    uint8_t b = *p++;
+    result |= uint32_t(b & 0x7F) << shift;
+    if ((b & 0x80) == 0) {
+      *v = result;
+      return p;
+    }
+  }
+  return NULL;  // Truncated (should not happen)
+}
+
+// The average of 'count' values rounded to the nearest integer
+static inline int32_t
+average(int64_t sum, uint32_t count)
+{
+  return (sum >= 0) ? int32_t((sum + count/2) / count) : -int32_t((-sum + count/2) / count);
+}
+
+// Append a sample to a tier and cascade to the next tiers.
+// Must be called with history_mutex held.
+static void
+append(int t, uint32_t time, const int32_t *value)
+{
+  history_tier_state_t &tier = tiers[t];
+  history_block_t *block = &tier.blocks[(tier.generation + tier.nblocks - 1) % tier.nblocks];
+
+  // Start a new block when the current one is full
+  if (tier.generation == 0 ||
+      block->used + HISTORY_SAMPLE_SIZE_MAX > sizeof(block->data) ||
+      block->count == UINT16_MAX) {
+    block = &tier.blocks[tier.generation % tier.nblocks];
+    tier.generation++;
+    if (tier.valid < tier.nblocks) {
+      tier.valid++;
+    }
+    block->start = time;
+    block->count = 0;
+    block->used  = 0;
+    memset(tier.last, 0, sizeof(tier.last));
+  }
+
+  uint8_t *p = block->data + block->used;
+  for (int c=0; c<HISTORY_CHANNEL_COUNT; c++) {
+    p = put_varint(p, zigzag(value[c] - tier.last[c]));
+    tier.last[c] = value[c];
+  }
+  block->used = p - block->data;
+  block->count++;
+
+  if (t+1 >= HISTORY_TIER_COUNT) {
+    return;
+  }
+
+  // Downsample into the next tier
+  if (tier.sum_count == 0) {
+    tier.sum_start = time;
+  }
+  for (int c=0; c<HISTORY_CHANNEL_COUNT; c++) {
+    tier.sum[c] += value[c];
+  }
+  tier.sum_count++;
+  if (tier.sum_count * tier.period >= tiers[t+1].period) {
+    int32_t avg[HISTORY_CHANNEL_COUNT];
+    for (int c=0; c<HISTORY_CHANNEL_COUNT; c++) {
+      avg[c] = average(tier.sum[c], tier.sum_count);
+      tier.sum[c] = 0;
+    }
+    tier.sum_count = 0;
+    append(t+1, tier.sum_start, avg);
+  }
+}
+
+static void
+history_timer_callback(void *arg)
+{
+  int32_t value[HISTORY_CHANNEL_COUNT];
+
+  // The achieved ratio is read directly from the AC relay
+  int32_t ratio = lround(acr_get_last_achieved_ratio() * 1000);
+
+  taskENTER_CRITICAL(&history_mutex);
+  current[HISTORY_CHANNEL_acr_ratio] = ratio;
+  memcpy(value, current, sizeof(value));
+  append(0, now, value);
+  now++;
+  taskEXIT_CRITICAL(&history_mutex);
+}
+
+static void
+history_state_listener(stf::mask_t mask, const app_state_t &state)
+{
+  if (mask & (stf::auto_available_power|stf::relay_power)) {
+    taskENTER_CRITICAL(&history_mutex);
+    current[HISTORY_CHANNEL_available_power] = state.a.available_power;
+    current[HISTORY_CHANNEL_relay_power]     = state.relay.power;
+    taskEXIT_CRITICAL(&history_mutex);
+  }
+}
+
+void
+history_start(const app_state_t &state)
+{
+  current[HISTORY_CHANNEL_available_power] = state.a.available_power;
+  current[HISTORY_CHANNEL_relay_power]     = state.relay.power;
+  app_add_listener(history_state_listener);
+
+  size_t total = 0;
+  for (auto &tier : tiers) {
+    total += tier.nblocks * sizeof(history_block_t);
+  }
+  ESP_LOGI(TAG, "%u bytes of history", (unsigned) total);
+
+  const esp_timer_create_args_t timer_args = {
+    .callback = history_timer_callback,
+    .name = "history"
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &history_timer));
+  ESP_ERROR_CHECK(esp_timer_start_periodic(history_timer, 1000*1000));
+}
+
+uint32_t
+history_now(void)
+{
+  taskENTER_CRITICAL(&history_mutex);
+  uint32_t result = now;
+  taskEXIT_CRITICAL(&history_mutex);
+  return result;
+}
+
+uint32_t
+history_period(history_tier_t tier)
+{
+  return tiers[tier].period;
+}
+
+uint32_t
+history_oldest(history_tier_t t)
+{
+  history_tier_state_t &tier = tiers[t];
+  taskENTER_CRITICAL(&history_mutex);
+  uint32_t result = UINT32_MAX;
+  if (tier.valid > 0) {
+    result = tier.blocks[(tier.generation - tier.valid) % tier.nblocks].start;
+  }
+  taskEXIT_CRITICAL(&history_mutex);
+  return result;
+}
+
+const char *
+history_channel_name(history_channel_t channel)
+{
+  return channel_names[channel];
+}
+
+const char *
+history_channel_unit(history_channel_t channel)
+{
+  return channel_units[channel];
+}
+
+bool
+history_read(history_tier_t t, uint32_t from, uint32_t to, history_fn_t fn, void *ctx)
+{
+  history_tier_state_t &tier = tiers[t];
+  history_block_t block;   // A copy of the block being decoded
+  uint32_t g = 0;          // The generation of the next block to decode
+
+  while (true) {
+    // Copy the next block. Reminder: the ring may have moved since the
+    // previous block so some blocks may have been dropped.
+    taskENTER_CRITICAL(&history_mutex);
+    uint32_t oldest = tier.generation - tier.valid;
+    if (g < oldest) {
+      g = oldest;
+    }
+    bool found = (g < tier.generation);
+    if (found) {
+      block = tier.blocks[g % tier.nblocks];
+    }
+    taskEXIT_CRITICAL(&history_mutex);
+
+    if (!found || block.start > to) {
+      return true;
+    }
+    g++;
+
+    if (block.start + block.count * tier.period <= from) {
+      continue;   // The whole block is too old
+    }
+
+    // Decode the block
+    history_sample_t sample = {};
+    const uint8_t *p   = block.data;
+    const uint8_t *end = block.data + block.used;
+    for (int k=0; k<block.count; k++) {
+      for (int c=0; c<HISTORY_CHANNEL_COUNT; c++) {
+        uint32_t v;
+        p = get_varint(p, end, &v);
+        if (!p) {
+          ESP_LOGE(TAG, "Corrupted block");
+          return true;
+        }
+        sample.value[c] += unzigzag(v);
+      }
+      sample.time = block.start + k * tier.period;
+      if (sample.time > to) {
+        return true;
+      }
+      if (sample.time >= from && !fn(ctx, sample)) {
+        return false;
+      }
+    }
+  }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "app_types.h"
+
+//
+// An in-RAM history of a few values of the application (the channels).
+//
+// The channels are sampled every second and stored in several tiers of
+// decreasing resolution. Each tier is fed with the averages of the
+// samples of the previous tier (so the downsampling is incremental).
+//
+// The samples of a tier are stored in a preallocated ring of fixed-size
+// blocks. Inside a block, each value is encoded as the zigzag varint of its
+// difference with the previous sample so a sample typically takes a few
+// bytes. When the ring is full, the oldest block is dropped. The retention
+// of each tier is thus approximate (see HISTORY_TIERS in history.cc).
+//
+// The time of a sample is the number of seconds since history_start()
+// (see history_now()). The sample of a tier with a period P covers the
+// interval [time, time+P).
+//
+// Nothing is allocated and appending a sample takes a constant time.
+//
+
+//
+// The channels. The values are integers so the ratios are scaled.
+//
+//   DEF_CHANNEL(ID, NAME, UNIT)
+//
+#define HISTORY_CHANNELS \
+  DEF_CHANNEL(available_power, "available_power", "W")       \
+  DEF_CHANNEL(relay_power,     "relay_power",     "W")       \
+  DEF_CHANNEL(acr_ratio,       "acr_ratio",       "1/1000")  \
+
+typedef enum {
+#define DEF_CHANNEL(ID, NAME, UNIT) HISTORY_CHANNEL_##ID,
+  HISTORY_CHANNELS
+#undef DEF_CHANNEL
+  HISTORY_CHANNEL_COUNT    // Not a channel. Must remain last.
+} history_channel_t ;
+
+typedef enum {
+  HISTORY_TIER_1S,     // 1 sample per second for about 10 minutes
+  HISTORY_TIER_1M,     // 1 sample per minute for about 24 hours
+  HISTORY_TIER_15M,    // 1 sample per 15 minutes for about 30 days
+  HISTORY_TIER_COUNT   // Not a tier. Must remain last.
+} history_tier_t ;
+
+typedef struct {
+  uint32_t time;                           // See history_now()
+  int32_t  value[HISTORY_CHANNEL_COUNT];
+} history_sample_t ;
+
+// Called for each sample by history_read(). Return false to stop.
+typedef bool (*history_fn_t)(void *ctx, const history_sample_t &sample);
+
+// Start sampling. Shall be called once during startup.
+void history_start(const app_state_t &state);
+
+// The current time of the history in seconds.
+uint32_t history_now(void);
+
+// The period of a tier in seconds.
+uint32_t history_period(history_tier_t tier);
+
+// The time of the oldest sample still stored in a tier (or UINT32_MAX if
+// the tier is empty).
+uint32_t history_oldest(history_tier_t tier);
+
+// The name and the unit of a channel.
+const char *history_channel_name(history_channel_t channel);
+const char *history_channel_unit(history_channel_t channel);
+
+//
+// Call 'fn' for each sample of 'tier' such that from <= time <= to, in
+// chronological order.
+//
+// The ring is not locked while 'fn' is called so 'fn' may block (e.g. to
+// send data to the network). The samples appended in the meantime may or
+// may not be reported.
+//
+// Return false if 'fn' returned false.
+//
+bool history_read(history_tier_t tier, uint32_t from, uint32_t to, history_fn_t fn, void *ctx);
@@ -0,0 +1,560 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "json_reader.h"
+
+typedef struct {
+  char *p;     // The current position
+  char *end;   // The end of the text
+} cursor_t ;
+
+static inline void
+skip_spaces(cursor_t &c)
+{
+  while (c.p < c.end && (*c.p==' ' || *c.p=='\t' || *c.p=='\n' || *c.p=='\r')) {
+    c.p++;
+  }
+}
+
+static inline bool
+expect(cursor_t &c, char ch)
+{
+  skip_spaces(c);
+  if (c.p < c.end && *c.p == ch) {
+    c.p++;
+    return true;
+  }
+  return false;
+}
+
+static int
+hex_digit(char ch)
+{
+  if (ch>='0' && ch<='9') return ch-'0';
+  if (ch>='a' && ch<='f') return ch-'a'+10;
+  if (ch>='A' && ch<='F') return ch-'A'+10;
+  return -1;
+}
+
+static bool
+parse_hex4(cursor_t &c, uint32_t &value)
+{
+  if (c.end - c.p < 4) {
+    return false;
+  }
+  value = 0;
+  for (int i=0; i<4; i++) {
+    int d = hex_digit(*c.p++);
+    if (d < 0) {
+      return false;
+    }
+    value = (value<<4) | d;
+  }
+  return true;
+}
+
+//
+// Parse a string at the current position (which must be a '"').
+//
+// The unescaped string is written in place and NULL-terminated. This is
+// always possible because an escape sequence is never shorter than the
+// character it encodes and because the closing quote can hold the '\0'.
+//
+static bool
+parse_string(cursor_t &c, char **str)
+{
+  if (!expect(c, '"')) {
+    return false;
+  }
+  char *out = c.p;
+  *str = out;
+  while (c.p < c.end) {
+    unsigned char ch = *c.p++;
+    if (ch == '"') {
+      *out = '\0';
+      return true;
+    }
+    if (ch < 0x20) {
+      return false;
+    }
+    if (ch != '\\') {
+      *out++ = ch;
+      continue;
+    }
+    if (c.p >= c.end) {
+      return false;
+    }
+    ch = *c.p++;
+    switch (ch) {
+      case '"':  *out++ = '"';  break;
+      case '\\': *out++ = '\\'; break;
+      case '/':  *out++ = '/';  break;
+      case 'b':  *out++ = '\b'; break;
+      case 'f':  *out++ = '\f'; break;
+      case 'n':  *out++ = '\n'; break;
+      case 'r':  *out++ = '\r'; break;
+      case 't':  *out++ = '\t'; break;
+      case 'u': {
+        uint32_t cp;
+        if (!parse_hex4(c, cp)) {
+          return false;
+        }
+        if (cp >= 0xD800 && cp < 0xDC00) {
+          // A high surrogate must be followed by a low surrogate
+          uint32_t low;
+          if (c.end - c.p < 2 || c.p[0] != '\\' || c.p[1] != 'u') {
+            return false;
+          }
+          c.p += 2;
+          if (!parse_hex4(c, low) || low < 0xDC00 || low >= 0xE000) {
+            return false;
+          }
+          cp = 0x10000 + ((cp-0xD800)<<10) + (low-0xDC00);
+        } else if (cp >= 0xDC00 && cp < 0xE000) {
+          return false;
+        }
+        if (cp == 0) {
+          return false;  // Would truncate the C string
+        } else if (cp < 0x80) {
+          *out++ = cp;
+        } else if (cp < 0x800) {
+          *out++ = 0xC0 | (cp>>6);
+          *out++ = 0x80 | (cp & 0x3F);
+        } else if (cp < 0x10000) {
+          *out++ = 0xE0 | (cp>>12);
+          *out++ = 0x80 | ((cp>>6) & 0x3F);
+          *out++ = 0x80 | (cp & 0x3F);
+        } else {
+          *out++ = 0xF0 | (cp>>18);
+          *out++ = 0x80 | ((cp>>12) & 0x3F);
+          *out++ = 0x80 | ((cp>>6) & 0x3F);
+          *out++ = 0x80 | (cp & 0x3F);
+        }
+        break;
+      }
+      default:
+        return false;
+    }
+  }
+  return false;
+}
+
+static bool
+parse_number(cursor_t &c, double *value)
+{
+  // Check the JSON syntax since strtod is more permissive
+  char *p = c.p;
+  if (p < c.end && *p == '-') p++;
+  if (p >= c.end || *p < '0' || *p > '9') {
+    return false;
+  }
+  if (*p == '0') {
+    p++;
+  } else {
+    while (p < c.end && *p >= '0' && *p <= '9') p++;
+  }
+  if (p < c.end && *p == '.') {
+    p++;
+    if (p >= c.end || *p < '0' || *p > '9') return false;
+    while (p < c.end && *p >= '0' && *p <= '9') p++;
+  }
+  if (p < c.end && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < c.end && (*p == '+' || *p == '-')) p++;
+    if (p >= c.end || *p < '0' || *p > '9') return false;
+    while (p < c.end && *p >= '0' && *p <= '9') p++;
+  }
+  *value = strtod(c.p, NULL);
+  c.p = p;
+  return true;
+}
+
+static bool
+parse_literal(cursor_t &c, const char *word)
+{
+  size_t n = strlen(word);
+  if (size_t(c.end - c.p) < n || memcmp(c.p, word, n) != 0) {
+    return false;
+  }
+  c.p += n;
+  return true;
+}
+
+static bool parse_value(cursor_t &c, json_field_t *field, int depth);
+
+// Skip the remaining of an object or an array after its opening character.
+static bool
+skip_container(cursor_t &c, char close, int depth)
+{
+  if (depth >= JSON_READER_MAX_DEPTH) {
+    return false;
+  }
+  if (expect(c, close)) {
+    return true;
+  }
+  do {
+    if (close == '}') {
+      char *key;
+      if (!parse_string(c, &key) || !expect(c, ':')) {
+        return false;
+      }
+    }
+    if (!parse_value(c, NULL, depth+1)) {
+      return false;
+    }
+  } while (expect(c, ','));
+  return expect(c, close);
+}
+
+// Parse a value. The result is stored in 'field' unless NULL.
+static bool
+parse_value(cursor_t &c, json_field_t *field, int depth)
+{
+  json_field_t dummy;
+  if (!field) {
+    field = &dummy;
+  }
+  skip_spaces(c);
+  if (c.p >= c.end) {
+    return false;
+  }
+  switch (*c.p) {
+    case '"': {
+      char *str;
+      field->type = JSON_TYPE_STRING;
+      if (!parse_string(c, &str)) {
+        return false;
+      }
+      field->str = str;
+      return true;
+    }
+    case '{':
+      c.p++;
+      field->type = JSON_TYPE_OTHER;
+      return skip_container(c, '}', depth);
+    case '[':
+      c.p++;
+      field->type = JSON_TYPE_OTHER;
+      return skip_container(c, ']', depth);
+    case 't':
+      field->type = JSON_TYPE_TRUE;
+      return parse_literal(c, "true");
+    case 'f':
+      field->type = JSON_TYPE_FALSE;
+      return parse_literal(c, "false");
+    case 'n':
+      field->type = JSON_TYPE_NULL;
+      return parse_literal(c, "null");
+    default:
+      field->type = JSON_TYPE_NUMBER;
+      return parse_number(c, &field->number);
+  }
+}
+
+// Parse an object and advance 'p' after it.
+bool
+json_reader::parse_object(char *&p, char *end)
+{
+  cursor_t c = { p, end };
+  count = 0;
+
+  if (!expect(c, '{')) {
+    return false;
+  }
+  if (!expect(c, '}')) {
+    do {
+      if (count >= JSON_READER_MAX_FIELDS) {
+        count = 0;
+        return false;
+      }
+      json_field_t &field = fields[count];
+      char *key;
+      if (!parse_string(c, &key) || !expect(c, ':') || !parse_value(c, &field, 0)) {
+        count = 0;
+        return false;
+      }
+      field.key = key;
+      count++;
+    } while (expect(c, ','));
+    if (!expect(c, '}')) {
+      count = 0;
+      return false;
+    }
+  }
+  p = c.p;
+  return true;
+}
+
+bool
+json_reader::parse(char *text, size_t size)
+{
+  char *end = text+size;
+  if (!parse_object(text, end)) {
+    return false;
+  }
+  cursor_t c = { text, end };
+  skip_spaces(c);
+  if (c.p != c.end) {
+    count = 0;
+    return false;
+  }
+  return true;
+}
+
+bool
+json_reader::parse_array(char *text, size_t size, json_item_fn_t fn, void *ctx)
+{
+  cursor_t c = { text, text+size };
+  count = 0;
+
+  if (!expect(c, '[')) {
+    return false;
+  }
+  if (!expect(c, ']')) {
+    do {
+      if (!parse_object(c.p, c.end) || !fn(ctx, *this)) {
+        return false;
+      }
+    } while (expect(c, ','));
+    if (!expect(c, ']')) {
+      return false;
+    }
+  }
+  skip_spaces(c);
+  return c.p == c.end;
+}
+
+const json_field_t *
+json_reader::find(const char *key) const
+{
+  for (int i=count-1; i>=0; i--) {
+    if (strcmp(fields[i].key, key) == 0) {
+      return &fields[i];
+    }
+  }
+  return NULL;
+}
+
+//
+// json_extract_numbers()
+//
+// The scanner below validates and skips the values without modifying
+// the text.
+//
+
+typedef struct {
+  const char *p;     // The current position
+  const char *end;   // The end of the text
+} scan_t ;
+
+static inline void
+scan_spaces(scan_t &s)
+{
+  while (s.p < s.end && (*s.p==' ' || *s.p=='\t' || *s.p=='\n' || *s.p=='\r')) {
+    s.p++;
+  }
+}
+
+static inline bool
+scan_expect(scan_t &s, char ch)
+{
+  scan_spaces(s);
+  if (s.p < s.end && *s.p == ch) {
+    s.p++;
+    return true;
+  }
+  return false;
+}
+
+// Scan a string. On success, 'str' and 'len' give its raw content
+// (without the quotes) and 'escaped' tells if it contains escape sequences.
+static bool
+scan_string(scan_t &s, const char **str, size_t *len, bool *escaped)
+{
+  if (!scan_expect(s, '"')) {
+    return false;
+  }
+  const char *start = s.p;
+  *escaped = false;
+  while (s.p < s.end) {
+    unsigned char ch = *s.p++;
+    if (ch == '"') {
+      *str = start;
+      *len = s.p - 1 - start;
+      return true;
+    }
+    if (ch < 0x20) {
+      return false;
+    }
+    if (ch == '\\') {
+      *escaped = true;
+      if (s.p >= s.end) {
+        return false;
+      }
+      ch = *s.p++;
+      if (ch == 'u') {
+        for (int i=0; i<4; i++) {
+          if (s.p >= s.end || hex_digit(*s.p++) < 0) {
+            return false;
+          }
+        }
+      } else if (!strchr("\"\\/bfnrt", ch) || ch == '\0') {
+        return false;
+      }
+    }
+  }
+  return false;
+}
+
+// The value is only converted if 'value' is not NULL (strtod is by far
+// the slowest part of the scanning).
+static bool
+scan_number(scan_t &s, double *value)
+{
+  // Same syntax as parse_number but the text is copied because strtod
+  // requires a terminated string.
+  const char *p = s.p;
+  if (p < s.end && *p == '-') p++;
+  if (p >= s.end || *p < '0' || *p > '9') {
+    return false;
+  }
+  if (*p == '0') {
+    p++;
+  } else {
+    while (p < s.end && *p >= '0' && *p <= '9') p++;
+  }
+  if (p < s.end && *p == '.') {
+    p++;
+    if (p >= s.end || *p < '0' || *p > '9') return false;
+    while (p < s.end && *p >= '0' && *p <= '9') p++;
+  }
+  if (p < s.end && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < s.end && (*p == '+' || *p == '-')) p++;
+    if (p >= s.end || *p < '0' || *p > '9') return false;
+    while (p < s.end && *p >= '0' && *p <= '9') p++;
+  }
+  char text[32];
+  size_t n = p - s.p;
+  if (n >= sizeof(text)) {
+    return false;
+  }
+  if (value) {
+    memcpy(text, s.p, n);
+    text[n] = '\0';
+    *value = strtod(text, NULL);
+  }
+  s.p = p;
+  return true;
+}
+
+static bool
+scan_literal(scan_t &s, const char *word)
+{
+  size_t n = strlen(word);
+  if (size_t(s.end - s.p) < n || memcmp(s.p, word, n) != 0) {
+    return false;
+  }
+  s.p += n;
+  return true;
+}
+
+// Scan a value. If it is a number then it is stored in 'number' (unless
+// NULL) and 'is_number' is set.
+static bool
+scan_value(scan_t &s, int depth, double *number, bool *is_number)
+{
+  *is_number = false;
+  scan_spaces(s);
+  if (s.p >= s.end) {
+    return false;
+  }
+  const char *str;
+  size_t len;
+  bool escaped;
+  switch (*s.p) {
+    case '"':
+      return scan_string(s, &str, &len, &escaped);
+    case '{':
+    case '[': {
+      char close = (*s.p == '{') ? '}' : ']' ;
+      s.p++;
+      if (depth >= JSON_READER_MAX_DEPTH) {
+        return false;
+      }
+      if (scan_expect(s, close)) {
+        return true;
+      }
+      do {
+        bool dummy;
+        if (close == '}' && (!scan_string(s, &str, &len, &escaped) || !scan_expect(s, ':'))) {
+          return false;
+        }
+        if (!scan_value(s, depth+1, NULL, &dummy)) {
+          return false;
+        }
+      } while (scan_expect(s, ','));
+      return scan_expect(s, close);
+    }
+    case 't':
+      return scan_literal(s, "true");
+    case 'f':
+      return scan_literal(s, "false");
+    case 'n':
+      return scan_literal(s, "null");
+    default:
+      if (!scan_number(s, number)) {
+        return false;
+      }
+      *is_number = true;
+      return true;
+  }
+}
+
+int
+json_extract_numbers(const char *text, size_t size, const char * const keys[], int nkeys, double values[])
+{
+  scan_t s = { text, text+size };
+  int found = 0;
+
+  if (nkeys > JSON_EXTRACT_MAX_KEYS) {
+    return -1;
+  }
+  if (!scan_expect(s, '{')) {
+    return -1;
+  }
+  if (!scan_expect(s, '}')) {
+    do {
+      const char *key;
+      size_t len;
+      bool escaped;
+      if (!scan_string(s, &key, &len, &escaped) || !scan_expect(s, ':')) {
+        return -1;
+      }
+      int k = -1;
+      if (!escaped) {
+        for (int i=0; i<nkeys; i++) {
+          if (strncmp(keys[i], key, len) == 0 && keys[i][len] == '\0') {
+            k = i;
+            break;
+          }
+        }
+      }
+      double number;
+      bool is_number;
+      if (!scan_value(s, 0, (k >= 0) ? &number : NULL, &is_number)) {
+        return -1;
+      }
+      if (k >= 0 && is_number) {
+        values[k] = number;
+        found |= 1<<k;
+      }
+    } while (scan_expect(s, ','));
+    if (!scan_expect(s, '}')) {
+      return -1;
+    }
+  }
+  scan_spaces(s);
+  return (s.p == s.end) ? found : -1 ;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stddef.h>
+
+//
+// A minimal JSON reader for flat objects.
+//
+// The text is tokenized in place in a single pass: the keys and the strings
+// are unescaped and NULL-terminated inside the input buffer so the fields
+// simply point into that buffer. Nothing is allocated.
+//
+// Only the members of the top-level object are recorded. Nested objects
+// and arrays are validated and skipped (their type is JSON_TYPE_OTHER).
+//
+// A top-level array of flat objects can also be processed one object
+// at a time with parse_array().
+//
+
+typedef enum {
+  JSON_TYPE_NONE,     // Not found
+  JSON_TYPE_STRING,
+  JSON_TYPE_NUMBER,
+  JSON_TYPE_TRUE,
+  JSON_TYPE_FALSE,
+  JSON_TYPE_NULL,
+  JSON_TYPE_OTHER,    // An object or an array
+} json_type_t ;
+
+typedef struct {
+  const char  *key;
+  json_type_t  type;
+  const char  *str;     // For JSON_TYPE_STRING
+  double       number;  // For JSON_TYPE_NUMBER
+} json_field_t ;
+
+// The maximum number of fields in the top-level object.
+// Parsing fails if there are more.
+#define JSON_READER_MAX_FIELDS 16
+
+// The maximum nesting level of the skipped values
+#define JSON_READER_MAX_DEPTH 8
+
+class json_reader;
+
+// Called by json_reader::parse_array() for each object of the array.
+// Return false to stop the parsing.
+typedef bool (*json_item_fn_t)(void *ctx, const json_reader &item);
+
+class json_reader
+{
+public:
+  json_reader() : count(0) {}
+
+  // Parse 'size' bytes of 'text' which must be followed by a '\0'
+  // (so the buffer must contain at least size+1 bytes).
+  //
+  // The text is modified and must remain alive while the fields are used.
+  //
+  // Return false if the text is not a valid JSON object or if it has too
+  // many fields.
+  bool parse(char *text, size_t size);
+
+  // Parse an array of flat objects with the same requirements as parse().
+  //
+  // Each object is parsed into this reader and passed to 'fn'. 
+  //
+  // Return false if the text is not a valid array of objects or if 'fn'
+  // returned false. The objects before the error were already processed.
+  bool parse_array(char *text, size_t size, json_item_fn_t fn, void *ctx);
+
+  // Get a field by name or NULL. If a key is repeated then the last one is returned.
+  const json_field_t *find(const char *key) const;
+
+  int size() const { return count; }
+  const json_field_t &operator[](int i) const { return fields[i]; }
+
+private:
+  bool parse_object(char *&p, char *end);
+
+  json_field_t fields[JSON_READER_MAX_FIELDS];
+  int count;
+};
+
+//
+// Extract the numeric values of some members of a JSON object in a single
+// pass without modifying the text (which does not need a trailing '\0').
+//
+// Only the members of the top-level object are considered. The value of
+// keys[i] is stored in values[i] if it is a number. The keys containing
+// escape sequences are never matched.
+//
+// Return a bit mask of the keys that were found with a number value or
+// -1 if the text is not a valid JSON object.
+//
+#define JSON_EXTRACT_MAX_KEYS 31
+
+int json_extract_numbers(const char *text, size_t size, const char * const keys[], int nkeys, double values[]);
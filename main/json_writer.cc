@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "json_writer.h"
+
+static_assert(JSON_WRITER_MAX_DEPTH < 32, "json_writer::first is too small");
+
+json_writer::json_writer(char *buffer, size_t size, json_flush_t flush, void *ctx) :
+  buffer(buffer),
+  size(size),
+  pos(0),
+  flush_fn(flush),
+  ctx(ctx),
+  first(1),
+  depth(0),
+  error(false),
+  total(0)
+{
+}
+
+bool
+json_writer::flush()
+{
+  if (!error && pos > 0) {
+    error = !flush_fn(ctx, buffer, pos);
+  }
+  pos = 0;
+  return !error;
+}
+
+inline void
+json_writer::put(char c)
+{
+  if (pos == size) {
+    flush();
+  }
+  if (!error) {
+    buffer[pos++] = c;
+    total++;
+  }
+}
+
+void
+json_writer::write(const char *data, size_t n)
+{
+  while (n > 0 && !error) {
+    if (pos == size) {
+      flush();
+      continue;
+    }
+    size_t k = size - pos;
+    if (k > n) {
+      k = n;
+    }
+    memcpy(buffer+pos, data, k);
+    pos   += k;
+    total += k;
+    data  += k;
+    n     -= k;
+  }
+}
+
+void
+json_writer::write_escaped(const char *str)
+{
+  put('"');
+  for (const char *p = str; *p ; p++) {
+    unsigned char c = *p;
+    switch (c) {
+      case '"':  write("\\\"", 2); break;
+      case '\\': write("\\\\", 2); break;
+      case '\n': write("\\n", 2);  break;
+      case '\r': write("\\r", 2);  break;
+      case '\t': write("\\t", 2);  break;
+      default:
+        if (c < 0x20) {
+          char tmp[8];
+          int n = snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+          write(tmp, n);
+        } else {
+          put(c);
+        }
+        break;
+    }
+  }
+  put('"');
+}
+
+// Emit the separator and the key (if any) of the next value
+void
+json_writer::begin_value(const char *key)
+{
+  uint32_t bit = uint32_t(1) << depth;
+  if (first & bit) {
+    first &= ~bit;
+  } else {
+    put(',');
+  }
+  if (key) {
+    write_escaped(key);
+    put(':');
+  }
+}
+
+void
+json_writer::open(char c, const char *key)
+{
+  begin_value(key);
+  if (depth+1 >= JSON_WRITER_MAX_DEPTH) {
+    error = true;
+    return;
+  }
+  put(c);
+  depth++;
+  first |= uint32_t(1) << depth;
+}
+
+void
+json_writer::close(char c)
+{
+  if (depth > 0) {
+    depth--;
+  }
+  put(c);
+}
+
+void json_writer::begin_object(const char *key) { open('{', key); }
+void json_writer::end_object()                  { close('}'); }
+void json_writer::begin_array(const char *key)  { open('[', key); }
+void json_writer::end_array()                   { close(']'); }
+
+void
+json_writer::add_string(const char *key, const char *value)
+{
+  begin_value(key);
+  write_escaped(value);
+}
+
+void
+json_writer::add_int(const char *key, long value)
+{
+  char tmp[24];
+  begin_value(key);
+  write(tmp, snprintf(tmp, sizeof(tmp), "%ld", value));
+}
+
+void
+json_writer::add_double(const char *key, double value)
+{
+  // JSON has no representation for NaN and infinities
+  if (!isfinite(value)) {
+    add_null(key);
+    return;
+  }
+  char tmp[32];
+  begin_value(key);
+  write(tmp, snprintf(tmp, sizeof(tmp), "%.15g", value));
+}
+
+void
+json_writer::add_bool(const char *key, bool value)
+{
+  begin_value(key);
+  if (value) {
+    write("true", 4);
+  } else {
+    write("false", 5);
+  }
+}
+
+void
+json_writer::add_null(const char *key)
+{
+  begin_value(key);
+  write("null", 4);
+}
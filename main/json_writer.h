@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// A streaming JSON writer.
+//
+// The output is accumulated in a fixed buffer provided by the caller
+// (usually on the stack) and passed to a flush function each time that
+// buffer is full. Nothing is allocated.
+//
+// The key of each value must be NULL inside an array and non-NULL inside
+// an object. The writer does not verify that.
+//
+// Errors (a failed flush or a nesting level that is too deep) are sticky:
+// once an error occured, nothing more is written and ok() returns false.
+//
+// Example:
+//
+//   char buffer[256];
+//   json_writer out(buffer, sizeof(buffer), my_flush, my_ctx);
+//   out.begin_object();
+//   out.add_string("name", "foo");
+//   out.add_int("value", 42);
+//   out.end_object();
+//   out.flush();
+//
+
+// Write 'size' bytes of 'data'. Return false on error.
+typedef bool (*json_flush_t)(void *ctx, const char *data, size_t size);
+
+#define JSON_WRITER_MAX_DEPTH 16
+
+class json_writer
+{
+public:
+  json_writer(char *buffer, size_t size, json_flush_t flush, void *ctx);
+
+  void begin_object(const char *key=NULL);
+  void end_object();
+  void begin_array(const char *key=NULL);
+  void end_array();
+
+  void add_string(const char *key, const char *value);
+  void add_int(const char *key, long value);
+  void add_double(const char *key, double value);
+  void add_bool(const char *key, bool value);
+  void add_null(const char *key);
+
+  // Flush the content of the buffer. Return false on error.
+  bool flush();
+
+  // Return false if an error occured.
+  bool ok() const { return !error; }
+
+  // The total number of bytes produced so far
+  size_t count() const { return total; }
+
+private:
+  void put(char c);
+  void write(const char *data, size_t size);
+  void write_escaped(const char *str);
+  void begin_value(const char *key);
+  void open(char c, const char *key);
+  void close(char c);
+
+  char        *buffer;
+  size_t       size;
+  size_t       pos;
+  json_flush_t flush_fn;
+  void        *ctx;
+  uint32_t     first;   // Bit N is set when the next value at depth N is the first one
+  int          depth;
+  bool         error;
+  size_t       total;
+};
@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+
+#include "latency.h"
+
+// The number of traces in flight. A new message is received every few
+// seconds so the older traces are long dead when their slot is reused.
+#define LATENCY_MAX_TRACES 4
+
+typedef struct {
+  uint32_t id;
+  uint32_t points;                    // Bit N is set when point N was reached
+  int64_t  time[LATENCY_POINT_COUNT];
+} latency_trace_t ;
+
+// Protects all the variables below (also used by the ISR of acr.cc)
+static portMUX_TYPE latency_mutex = portMUX_INITIALIZER_UNLOCKED;
+
+static latency_trace_t     traces[LATENCY_MAX_TRACES];
+static uint32_t            last_id = 0;
+static latency_histogram_t histograms[LATENCY_HOP_COUNT];
+
+static const char * const hop_names[LATENCY_HOP_COUNT] = {
+#define DEF_HOP(NAME) NAME,
+  LATENCY_HOPS
+#undef DEF_HOP
+};
+
+static inline int IRAM_ATTR
+bucket_of(uint32_t us)
+{
+  if (us <= (1u << LATENCY_MIN_SHIFT)) {
+    return 0;
+  }
+  // The smallest k such that us <= 2^k
+  int k = 32 - __builtin_clz(us - 1);
+  return (k > LATENCY_MAX_SHIFT) ? LATENCY_BUCKETS-1 : k - LATENCY_MIN_SHIFT ;
+}
+
+// Must be called with latency_mutex held
+static void IRAM_ATTR
+record(int hop, int64_t start, int64_t end)
+{
+  int64_t delta = end - start;
+  uint32_t us = (delta < 0) ? 0 : (delta > UINT32_MAX) ? UINT32_MAX : uint32_t(delta) ;
+  latency_histogram_t &h = histograms[hop];
+  h.count++;
+  h.sum_us += us;
+  h.buckets[bucket_of(us)]++;
+}
+
+uint32_t
+latency_begin(int64_t received_us)
+{
+  portENTER_CRITICAL_SAFE(&latency_mutex);
+  if (++last_id == 0) {
+    last_id = 1;
+  }
+  latency_trace_t &trace = traces[last_id % LATENCY_MAX_TRACES];
+  trace.id = last_id;
+  trace.points = 1u << LATENCY_RECEIVED;
+  trace.time[LATENCY_RECEIVED] = received_us;
+  uint32_t id = last_id;
+  portEXIT_CRITICAL_SAFE(&latency_mutex);
+  return id;
+}
+
+void IRAM_ATTR
+latency_mark(uint32_t id, latency_point_t point)
+{
+  if (id == 0) {
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+
+  portENTER_CRITICAL_SAFE(&latency_mutex);
+  latency_trace_t &trace = traces[id % LATENCY_MAX_TRACES];
+  if (trace.id == id) {
+    trace.time[point] = now;
+    trace.points |= 1u << point;
+    if (point == LATENCY_APPLIED) {
+      if (trace.points == (1u << LATENCY_POINT_COUNT) - 1) {
+        for (int p=1; p<LATENCY_POINT_COUNT; p++) {
+          record(p-1, trace.time[p-1], trace.time[p]);
+        }
+        record(LATENCY_HOP_COUNT-1, trace.time[0], trace.time[LATENCY_APPLIED]);
+      }
+      trace.id = 0;   // Closed
+    }
+  }
+  portEXIT_CRITICAL_SAFE(&latency_mutex);
+}
+
+const char *
+latency_hop_name(int hop)
+{
+  return (hop >= 0 && hop < LATENCY_HOP_COUNT) ? hop_names[hop] : "?" ;
+}
+
+uint32_t
+latency_bucket_le_us(int bucket)
+{
+  return (bucket < LATENCY_BUCKETS-1) ? (1u << (LATENCY_MIN_SHIFT + bucket)) : UINT32_MAX ;
+}
+
+void
+latency_get_histogram(int hop, latency_histogram_t *histogram)
+{
+  portENTER_CRITICAL_SAFE(&latency_mutex);
+  *histogram = histograms[hop];
+  portEXIT_CRITICAL_SAFE(&latency_mutex);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+
+//
+// Tracing of the latency of the control path, from the reception of an
+// energy meter message to the first AC cycle that uses the new target of
+// the relay.
+//
+// A trace is started for each energy meter message and its identifier
+// follows the available power through the application (see the points
+// below). When the last point is reached, the duration of each hop (i.e.
+// between two consecutive points) is added to a histogram with buckets
+// of powers of 2 microseconds.
+//
+// The traces that do not reach the relay (e.g. in MANUAL mode or when the
+// change is filtered out) are silently dropped.
+//
+// Nothing is allocated and latency_mark() can be called from an ISR.
+//
+
+typedef enum {
+  LATENCY_RECEIVED,     // The message is received (MQTT task)
+  LATENCY_POSTED,       // The available power is posted to the application
+  LATENCY_DISPATCHED,   // The application task processes the available power
+  LATENCY_RELAY_SET,    // The new target is given to acr_set_target_ratio()
+  LATENCY_APPLIED,      // The first AC cycle with the new target (ISR)
+  LATENCY_POINT_COUNT   // Not a point. Must remain last.
+} latency_point_t ;
+
+//
+// The hops. Hop N ends at point N+1 except the last one (total) that
+// covers the whole path.
+//
+//   DEF_HOP(NAME)
+//
+#define LATENCY_HOPS \
+  DEF_HOP("parse")    \
+  DEF_HOP("queue")    \
+  DEF_HOP("control")  \
+  DEF_HOP("relay")    \
+  DEF_HOP("total")    \
+
+#define LATENCY_HOP_COUNT LATENCY_POINT_COUNT
+
+// The upper bound of bucket N is 2^(LATENCY_MIN_SHIFT+N) microseconds. The
+// last bucket has no upper bound.
+#define LATENCY_MIN_SHIFT 6      // 64 us
+#define LATENCY_MAX_SHIFT 23     // About 8.4 s
+#define LATENCY_BUCKETS   (LATENCY_MAX_SHIFT - LATENCY_MIN_SHIFT + 2)
+
+typedef struct {
+  uint32_t count;
+  uint64_t sum_us;
+  uint32_t buckets[LATENCY_BUCKETS];   // Not cumulative
+} latency_histogram_t ;
+
+// Start a trace for a message received at 'received_us' (see esp_timer_get_time).
+// Return its identifier (never 0).
+uint32_t latency_begin(int64_t received_us);
+
+// Timestamp a point of a trace. Ignored if 'trace' is 0 or too old.
+void latency_mark(uint32_t trace, latency_point_t point);
+
+// The name of a hop
+const char *latency_hop_name(int hop);
+
+// The upper bound of a bucket in microseconds (UINT32_MAX for the last one)
+uint32_t latency_bucket_le_us(int bucket);
+
+// Get a copy of the histogram of a hop
+void latency_get_histogram(int hop, latency_histogram_t *histogram);
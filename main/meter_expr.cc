@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "meter_expr.h"
+
+// The maximum nesting of the parentheses
+#define METER_EXPR_MAX_DEPTH 4
+
+// The value of a sub-expression: a linear combination of the keys
+typedef struct {
+  double coef[METER_EXPR_MAX_FIELDS];
+  double offset;
+  bool   constant;   // True if no field is involved
+} linear_t ;
+
+typedef struct {
+  meter_expr_t &expr;
+  const char   *text;
+  const char   *p;
+  size_t        used;    // The number of bytes used in expr.names
+  char         *error;
+  size_t        error_size;
+  bool          failed;
+} compiler_t ;
+
+// Only the first error is reported
+static bool
+fail(compiler_t &c, const char *message)
+{
+  if (!c.failed) {
+    c.failed = true;
+    snprintf(c.error, c.error_size, "%s at position %d", message, int(c.p - c.text));
+  }
+  return false;
+}
+
+static void
+skip_spaces(compiler_t &c)
+{
+  while (*c.p == ' ' || *c.p == '\t') {
+    c.p++;
+  }
+}
+
+static void
+scale(linear_t &v, double factor)
+{
+  for (int i=0; i<METER_EXPR_MAX_FIELDS; i++) {
+    v.coef[i] *= factor;
+  }
+  v.offset *= factor;
+}
+
+static inline bool
+is_field_start(char ch)
+{
+  return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_' ;
+}
+
+static inline bool
+is_field_char(char ch)
+{
+  return is_field_start(ch) || (ch >= '0' && ch <= '9') ;
+}
+
+// Return the index of a key in the program (adding it if needed) or -1
+static int
+add_key(compiler_t &c, const char *name, size_t len)
+{
+  meter_expr_t &expr = c.expr;
+  for (int i=0; i<expr.nkeys; i++) {
+    if (strlen(expr.keys[i]) == len && memcmp(expr.keys[i], name, len) == 0) {
+      return i;
+    }
+  }
+  if (expr.nkeys >= METER_EXPR_MAX_FIELDS) {
+    fail(c, "Too many fields");
+    return -1;
+  }
+  if (c.used + len + 1 > sizeof(expr.names)) {
+    fail(c, "Field names are too long");
+    return -1;
+  }
+  char *dest = expr.names + c.used;
+  memcpy(dest, name, len);
+  dest[len] = '\0';
+  c.used += len + 1;
+  expr.keys[expr.nkeys] = dest;
+  return expr.nkeys++;
+}
+
+static bool parse_expr(compiler_t &c, linear_t &out, int depth);
+
+static bool
+parse_factor(compiler_t &c, linear_t &out, int depth)
+{
+  out = {};
+  out.constant = true;
+  skip_spaces(c);
+
+  char ch = *c.p;
+  if (ch == '(') {
+    if (depth >= METER_EXPR_MAX_DEPTH) {
+      return fail(c, "Too many parentheses");
+    }
+    c.p++;
+    if (!parse_expr(c, out, depth+1)) {
+      return false;
+    }
+    skip_spaces(c);
+    if (*c.p != ')') {
+      return fail(c, "Expected ')'");
+    }
+    c.p++;
+    return true;
+  }
+
+  if ((ch >= '0' && ch <= '9') || ch == '.') {
+    char *end;
+    out.offset = strtod(c.p, &end);
+    if (end == c.p) {
+      return fail(c, "Malformed number");
+    }
+    c.p = end;
+    return true;
+  }
+
+  const char *name;
+  size_t len;
+  if (is_field_start(ch)) {
+    name = c.p;
+    while (is_field_char(*c.p)) {
+      c.p++;
+    }
+    len = c.p - name;
+  } else if (ch == '"') {
+    name = ++c.p;
+    while (*c.p != '"') {
+      if (*c.p == '\0' || *c.p == '\\') {
+        return fail(c, "Malformed quoted field");
+      }
+      c.p++;
+    }
+    len = c.p - name;
+    c.p++;
+    if (len == 0) {
+      return fail(c, "Empty field");
+    }
+  } else {
+    return fail(c, "Expected a number or a field");
+  }
+
+  int k = add_key(c, name, len);
+  if (k < 0) {
+    return false;
+  }
+  out.coef[k] = 1;
+  out.constant = false;
+  return true;
+}
+
+static bool
+parse_term(compiler_t &c, linear_t &out, int depth)
+{
+  double sign = 1;
+  skip_spaces(c);
+  if (*c.p == '+' || *c.p == '-') {
+    sign = (*c.p == '-') ? -1 : 1;
+    c.p++;
+  }
+
+  if (!parse_factor(c, out, depth)) {
+    return false;
+  }
+
+  while (true) {
+    skip_spaces(c);
+    char op = *c.p;
+    if (op != '*' && op != '/') {
+      break;
+    }
+    c.p++;
+    linear_t rhs;
+    if (!parse_factor(c, rhs, depth)) {
+      return false;
+    }
+    if (op == '*') {
+      if (!out.constant && !rhs.constant) {
+        return fail(c, "Product of two fields");
+      }
+      if (out.constant) {
+        double factor = out.offset;
+        out = rhs;
+        scale(out, factor);
+      } else {
+        scale(out, rhs.offset);
+      }
+    } else {
+      if (!rhs.constant) {
+        return fail(c, "Division by a field");
+      }
+      if (rhs.offset == 0) {
+        return fail(c, "Division by zero");
+      }
+      scale(out, 1/rhs.offset);
+    }
+  }
+
+  scale(out, sign);
+  return true;
+}
+
+static bool
+parse_expr(compiler_t &c, linear_t &out, int depth)
+{
+  if (!parse_term(c, out, depth)) {
+    return false;
+  }
+  while (true) {
+    skip_spaces(c);
+    char op = *c.p;
+    if (op != '+' && op != '-') {
+      return true;
+    }
+    c.p++;
+    linear_t rhs;
+    if (!parse_term(c, rhs, depth)) {
+      return false;
+    }
+    if (op == '-') {
+      scale(rhs, -1);
+    }
+    for (int i=0; i<METER_EXPR_MAX_FIELDS; i++) {
+      out.coef[i] += rhs.coef[i];
+    }
+    out.offset  += rhs.offset;
+    out.constant = out.constant && rhs.constant;
+  }
+}
+
+bool
+meter_expr_compile(meter_expr_t &expr, const char *text, char *error, size_t error_size)
+{
+  expr = {};
+  compiler_t c = {
+    .expr = expr,
+    .text = text,
+    .p = text,
+    .used = 0,
+    .error = error,
+    .error_size = error_size,
+    .failed = false
+  };
+
+  linear_t result;
+  if (!parse_expr(c, result, 0)) {
+    return false;
+  }
+  skip_spaces(c);
+  if (*c.p != '\0') {
+    return fail(c, "Unexpected character");
+  }
+  if (expr.nkeys == 0) {
+    return fail(c, "No field");
+  }
+
+  for (int i=0; i<expr.nkeys; i++) {
+    if (!isfinite(result.coef[i])) {
+      return fail(c, "Overflow");
+    }
+    expr.coef[i] = result.coef[i];
+  }
+  if (!isfinite(result.offset)) {
+    return fail(c, "Overflow");
+  }
+  expr.offset = result.offset;
+  return true;
+}
+
+bool
+meter_expr_eval(const meter_expr_t &expr, int found, const double values[], double *result)
+{
+  double sum = expr.offset;
+  for (int i=0; i<expr.nkeys; i++) {
+    if (!(found & (1<<i))) {
+      return false;
+    }
+    sum += expr.coef[i] * values[i];
+  }
+  *result = sum;
+  return true;
+}
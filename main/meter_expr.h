@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stddef.h>
+
+//
+// The expression that computes the available power from the fields of
+// the energy meter messages (e.g. "power_b - power_a").
+//
+// The expression is a linear combination of the numeric members of the
+// top-level JSON object of the message:
+//
+//   expr   := term { ('+'|'-') term }
+//   term   := ['+'|'-'] factor { ('*'|'/') factor }
+//   factor := NUMBER | FIELD | '"' KEY '"' | '(' expr ')'
+//
+// where FIELD is [A-Za-z_][A-Za-z0-9_]* and a quoted KEY can contain any
+// character except '"' and '\'. A product must have at most one factor
+// that depends on a field and a divisor must be a constant. Examples:
+//
+//   power_b - power_a
+//   -power
+//   (import - export) * 1000
+//   "Power In" / 10 + 5
+//
+// The expression is compiled once into a small program: the list of the
+// keys to extract (see json_extract_numbers) and their coefficients. The
+// evaluation of a message is then a single pass of the parser followed by
+// a dot product.
+//
+
+#define METER_EXPR_MAXLEN     64
+#define METER_EXPR_MAX_FIELDS 8
+
+typedef struct {
+  int    nkeys;
+  const char *keys[METER_EXPR_MAX_FIELDS];   // Point into names
+  double coef[METER_EXPR_MAX_FIELDS];
+  double offset;
+  char   names[METER_EXPR_MAXLEN];            // The keys separated by '\0'
+} meter_expr_t ;
+
+// Compile 'text'. On error, return false and write a message to 'error'.
+bool meter_expr_compile(meter_expr_t &expr, const char *text, char *error, size_t error_size);
+
+//
+// Evaluate a compiled expression with the values extracted for its keys
+// by json_extract_numbers (i.e. values[i] is the value of expr.keys[i]
+// and 'found' the returned mask).
+//
+// Return false if a key was not found.
+//
+bool meter_expr_eval(const meter_expr_t &expr, int found, const double values[], double *result);
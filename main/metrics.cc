@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+
+#include "metrics.h"
+#include "acr.h"
+#include "app_events.h"
+#include "ui_mqtt.h"
+#include "latency.h"
+#include "telemetry.h"
+
+// The tasks whose stack is monitored (the missing ones are ignored)
+static const char * const monitored_tasks[] = {
+  "main",
+  "app",
+  "button_driver",
+  "httpd",
+  "mqtt_task",
+  "sys_evt",
+  "esp_timer",
+  "tiT",
+  "wifi",
+};
+
+metrics_writer::metrics_writer(char *buffer, size_t size, metrics_flush_t flush, void *ctx) :
+  buffer(buffer),
+  size(size),
+  pos(0),
+  flush_fn(flush),
+  ctx(ctx),
+  error(size < METRICS_MAX_LINE)
+{
+}
+
+bool
+metrics_writer::flush()
+{
+  if (!error && pos > 0) {
+    error = !flush_fn(ctx, buffer, pos);
+  }
+  pos = 0;
+  return !error;
+}
+
+void
+metrics_writer::printf(const char *format, ...)
+{
+  if (size - pos < METRICS_MAX_LINE) {
+    flush();
+  }
+  if (error) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buffer+pos, size-pos, format, args);
+  va_end(args);
+  if (n < 0 || size_t(n) >= size-pos) {
+    error = true;   // Longer than METRICS_MAX_LINE
+    return;
+  }
+  pos += n;
+}
+
+void
+metrics_writer::declare(const char *name, const char *type, const char *help)
+{
+  printf("# HELP %s %s\n", name, help);
+  printf("# TYPE %s %s\n", name, type);
+}
+
+void
+metrics_writer::sample(const char *name, const char *labels, double value)
+{
+  // %.15g is exact for the integers up to 10^15
+  char text[32];
+  if (isnan(value)) {
+    strcpy(text, "NaN");
+  } else {
+    snprintf(text, sizeof(text), "%.15g", value);
+  }
+  if (labels) {
+    printf("%s{%s} %s\n", name, labels, text);
+  } else {
+    printf("%s %s\n", name, text);
+  }
+}
+
+void
+metrics_writer::gauge(const char *name, const char *help, double value)
+{
+  declare(name, "gauge", help);
+  sample(name, NULL, value);
+}
+
+void
+metrics_writer::counter(const char *name, const char *help, double value)
+{
+  declare(name, "counter", help);
+  sample(name, NULL, value);
+}
+
+static void
+write_acr_metrics(metrics_writer &out)
+{
+  acr_stats_t stats;
+  acr_get_stats(&stats);
+  out.gauge("cumulus_acr_target_ratio", "Requested ratio of ON cycles", acr_get_target_ratio());
+  out.gauge("cumulus_acr_achieved_ratio", "Ratio of ON cycles during the last frame", acr_get_last_achieved_ratio());
+  out.counter("cumulus_acr_cycles_total", "AC half-periods since boot", stats.cycles);
+  out.counter("cumulus_acr_on_cycles_total", "ON half-periods since boot", stats.on_cycles);
+  out.gauge("cumulus_acr_isr_jitter_us", "Deviation of the last interrupt interval from the AC period", stats.jitter_last_us);
+  out.gauge("cumulus_acr_isr_jitter_max_us", "Largest deviation of an interrupt interval since boot", stats.jitter_max_us);
+}
+
+static void
+write_event_metrics(metrics_writer &out)
+{
+  out.declare("cumulus_app_events_total", "counter", "Events processed by the application task");
+  for (int i=0; i<APP_EVENT_COUNT; i++) {
+    char labels[48];
+    snprintf(labels, sizeof(labels), "event=\"%s\"", app_event_name(app_event_t(i)));
+    out.sample("cumulus_app_events_total", labels, app_event_count(app_event_t(i)));
+  }
+}
+
+static void
+write_meter_metrics(metrics_writer &out, int64_t now)
+{
+  ui_mqtt_stats_t stats;
+  ui_mqtt_get_stats(&stats);
+  out.counter("cumulus_meter_messages_total", "Valid energy meter messages received", stats.meter_messages);
+  out.gauge("cumulus_meter_age_seconds", "Time since the last energy meter message",
+            stats.meter_last_us ? (now - stats.meter_last_us) * 1e-6 : NAN);
+
+  telemetry_stats_t telemetry;
+  telemetry_get_stats(&telemetry);
+  out.gauge("cumulus_telemetry_pending", "Telemetry records waiting to be published", telemetry.pending);
+  out.counter("cumulus_telemetry_dropped_total", "Telemetry records dropped during an outage", telemetry.dropped);
+}
+
+// See latency.h. The buckets are cumulative in the Prometheus format.
+static void
+write_latency_metrics(metrics_writer &out)
+{
+  out.declare("cumulus_control_latency_seconds", "histogram", "Latency of the control path from an energy meter message to the AC relay");
+  for (int hop=0; hop<LATENCY_HOP_COUNT; hop++) {
+    latency_histogram_t h;
+    latency_get_histogram(hop, &h);
+    char labels[64];
+    uint32_t total = 0;
+    for (int b=0; b<LATENCY_BUCKETS; b++) {
+      total += h.buckets[b];
+      uint32_t le = latency_bucket_le_us(b);
+      if (le == UINT32_MAX) {
+        snprintf(labels, sizeof(labels), "hop=\"%s\",le=\"+Inf\"", latency_hop_name(hop));
+      } else {
+        snprintf(labels, sizeof(labels), "hop=\"%s\",le=\"%g\"", latency_hop_name(hop), le * 1e-6);
+      }
+      out.sample("cumulus_control_latency_seconds_bucket", labels, total);
+    }
+    snprintf(labels, sizeof(labels), "hop=\"%s\"", latency_hop_name(hop));
+    out.sample("cumulus_control_latency_seconds_sum", labels, h.sum_us * 1e-6);
+    out.sample("cumulus_control_latency_seconds_count", labels, h.count);
+  }
+}
+
+static void
+write_system_metrics(metrics_writer &out, int64_t now)
+{
+  out.gauge("cumulus_uptime_seconds", "Time since boot", now * 1e-6);
+  out.gauge("cumulus_heap_free_bytes", "Free heap size", esp_get_free_heap_size());
+  out.gauge("cumulus_heap_min_free_bytes", "Minimum free heap size since boot", esp_get_minimum_free_heap_size());
+
+  out.declare("cumulus_task_stack_free_bytes", "gauge", "Minimum free stack space of a task since its creation");
+  for (const char *name : monitored_tasks) {
+    TaskHandle_t task = xTaskGetHandle(name);
+    if (task) {
+      char labels[48];
+      snprintf(labels, sizeof(labels), "task=\"%s\"", name);
+      // Reminder: the stack is counted in bytes in ESP-IDF
+      out.sample("cumulus_task_stack_free_bytes", labels, uxTaskGetStackHighWaterMark(task));
+    }
+  }
+
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) == ESP_OK) {
+    out.gauge("cumulus_wifi_rssi_dbm", "Signal strength of the WiFi access point", ap.rssi);
+  }
+}
+
+void
+metrics_write_all(metrics_writer &out)
+{
+  int64_t now = esp_timer_get_time();
+  write_acr_metrics(out);
+  write_event_metrics(out);
+  write_meter_metrics(out, now);
+  write_latency_metrics(out);
+  write_system_metrics(out, now);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Runtime metrics in the Prometheus text format.
+//
+// Like json_writer, the output is accumulated in a fixed buffer provided by
+// the caller and passed to a flush function each time that buffer is full.
+// Nothing is allocated so rendering the metrics is cheap enough to be
+// scraped frequently.
+//
+// Example of output:
+//
+//   # HELP cumulus_heap_free_bytes Free heap size
+//   # TYPE cumulus_heap_free_bytes gauge
+//   cumulus_heap_free_bytes 123456
+//
+
+// Write 'size' bytes of 'data'. Return false on error.
+typedef bool (*metrics_flush_t)(void *ctx, const char *data, size_t size);
+
+// The maximum size of a single line of output.
+// The buffer given to metrics_writer must be at least that large.
+#define METRICS_MAX_LINE 160
+
+class metrics_writer
+{
+public:
+  metrics_writer(char *buffer, size_t size, metrics_flush_t flush, void *ctx);
+
+  // Write the HELP and TYPE lines of a metric.
+  // 'type' is "counter" or "gauge".
+  void declare(const char *name, const char *type, const char *help);
+
+  // Write a sample of a declared metric.
+  //
+  // 'labels' is NULL or a preformatted list of labels such as 'task="app"'.
+  // The label values are not escaped.
+  void sample(const char *name, const char *labels, double value);
+
+  // Declare a metric without labels and write its single sample.
+  void gauge(const char *name, const char *help, double value);
+  void counter(const char *name, const char *help, double value);
+
+  // Flush the content of the buffer. Return false on error.
+  bool flush();
+
+  // Return false if an error occured.
+  bool ok() const { return !error; }
+
+private:
+  void printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+  char           *buffer;
+  size_t          size;
+  size_t          pos;
+  metrics_flush_t flush_fn;
+  void           *ctx;
+  bool            error;
+};
+
+// Write all the metrics of the application.
+void metrics_write_all(metrics_writer &out);
@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+
+#include "ota.h"
+#include "app.h"
+
+static const char TAG[] = "ota" ;
+
+// The delay between a successful update and the reboot
+#define OTA_REBOOT_DELAY_US  (1000*1000)
+
+static esp_timer_handle_t rollback_timer = NULL;
+static esp_timer_handle_t reboot_timer = NULL;
+
+// True while the running image waits for ota_confirm()
+static volatile bool pending_verify = false;
+
+#ifdef CONFIG_APP_OTA_HEALTH_MQTT
+#define OTA_HEALTH_REQUIRED (OTA_HEALTH_WIFI | OTA_HEALTH_HTTP | OTA_HEALTH_MQTT)
+#else
+#define OTA_HEALTH_REQUIRED (OTA_HEALTH_WIFI | OTA_HEALTH_HTTP)
+#endif
+
+// Protects the health signals
+static portMUX_TYPE health_mutex = portMUX_INITIALIZER_UNLOCKED;
+static int     health = 0;           // The OTA_HEALTH_* signals currently set
+static int64_t healthy_since = -1;   // When all the required signals were set (or -1)
+
+static struct {
+  const esp_partition_t *partition;   // The slot being written or NULL
+  esp_ota_handle_t handle;
+  size_t size;
+  size_t pos;
+  mbedtls_sha256_context sha;
+} update = { .partition = NULL } ;
+
+static void
+rollback_timer_cb(void *arg)
+{
+  ESP_LOGE(TAG, "The new firmware was not confirmed in time. Rolling back");
+  esp_ota_mark_app_invalid_rollback_and_reboot();
+  // Only returns if there is no other valid image
+  ESP_LOGE(TAG, "Rollback failed");
+}
+
+static void
+reboot_timer_cb(void *arg)
+{
+  app_post_reboot();
+}
+
+void
+ota_init(void)
+{
+  const esp_timer_create_args_t reboot_args = {
+    .callback = &reboot_timer_cb,
+    .name = "ota_reboot"
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&reboot_args, &reboot_timer));
+
+  const esp_partition_t *running = esp_ota_get_running_partition();
+  esp_ota_img_states_t ota_state;
+  if (esp_ota_get_state_partition(running, &ota_state) != ESP_OK) {
+    // e.g. a factory image flashed over USB
+    ESP_LOGI(TAG, "Running from '%s'", running->label);
+    return;
+  }
+  ESP_LOGI(TAG, "Running from '%s' (state %d)", running->label, (int) ota_state);
+  if (ota_state != ESP_OTA_IMG_PENDING_VERIFY) {
+    return;
+  }
+
+  const esp_timer_create_args_t rollback_args = {
+    .callback = &rollback_timer_cb,
+    .name = "ota_rollback"
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&rollback_args, &rollback_timer));
+  pending_verify = true;
+  ESP_ERROR_CHECK(esp_timer_start_once(rollback_timer, CONFIG_APP_OTA_HEALTH_TIMEOUT * 60 * 1000000LL));
+  ESP_LOGW(TAG, "New firmware: waiting %d minutes for confirmation", CONFIG_APP_OTA_HEALTH_TIMEOUT);
+}
+
+void
+ota_confirm(void)
+{
+  if (!pending_verify) {
+    return;
+  }
+  pending_verify = false;
+  esp_timer_stop(rollback_timer);
+  if (esp_ota_mark_app_valid_cancel_rollback() == ESP_OK) {
+    ESP_LOGI(TAG, "New firmware confirmed");
+  } else {
+    ESP_LOGE(TAG, "Failed to confirm the new firmware");
+  }
+}
+
+void
+ota_set_health(int signal, bool ok)
+{
+  taskENTER_CRITICAL(&health_mutex);
+  int old = health;
+  health = ok ? (health | signal) : (health & ~signal) ;
+  bool was_healthy = (old & OTA_HEALTH_REQUIRED) == OTA_HEALTH_REQUIRED;
+  bool is_healthy  = (health & OTA_HEALTH_REQUIRED) == OTA_HEALTH_REQUIRED;
+  if (is_healthy && !was_healthy) {
+    healthy_since = esp_timer_get_time();
+  } else if (!is_healthy) {
+    healthy_since = -1;
+  }
+  taskEXIT_CRITICAL(&health_mutex);
+}
+
+void
+ota_check_health(void)
+{
+  if (!pending_verify) {
+    return;
+  }
+  taskENTER_CRITICAL(&health_mutex);
+  int64_t since = healthy_since;
+  taskEXIT_CRITICAL(&health_mutex);
+
+  if (since >= 0 && esp_timer_get_time() - since >= CONFIG_APP_OTA_HEALTH_UPTIME * 1000000LL) {
+    ota_confirm();
+  }
+}
+
+void
+ota_abort(void)
+{
+  if (update.partition) {
+    ESP_LOGW(TAG, "Update aborted");
+    esp_ota_abort(update.handle);
+    mbedtls_sha256_free(&update.sha);
+    update.partition = NULL;
+  }
+}
+
+bool
+ota_begin(size_t size)
+{
+  ota_abort();
+
+  const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+  if (!partition) {
+    ESP_LOGE(TAG, "No OTA partition");
+    return false;
+  }
+  if (size == 0 || size > partition->size) {
+    ESP_LOGE(TAG, "Cannot store %u bytes in '%s' (max %u)", (unsigned) size, partition->label,
+             (unsigned) partition->size);
+    return false;
+  }
+
+  // The sectors are erased as the image is written so that no single
+  // call blocks long enough for the client to time out.
+  esp_err_t err = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &update.handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "esp_ota_begin failed (%s)", esp_err_to_name(err));
+    return false;
+  }
+
+  ESP_LOGI(TAG, "Writing %u bytes to '%s'", (unsigned) size, partition->label);
+  update.partition = partition;
+  update.size      = size;
+  update.pos       = 0;
+  mbedtls_sha256_init(&update.sha);
+  mbedtls_sha256_starts(&update.sha, 0);
+  return true;
+}
+
+bool
+ota_write(const char *data, size_t size)
+{
+  if (!update.partition) {
+    return false;
+  }
+  if (update.pos + size > update.size) {
+    ESP_LOGE(TAG, "Too much data");
+    ota_abort();
+    return false;
+  }
+  // esp_ota_write also checks the magic byte of the image
+  esp_err_t err = esp_ota_write(update.handle, data, size);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "esp_ota_write failed (%s)", esp_err_to_name(err));
+    ota_abort();
+    return false;
+  }
+  mbedtls_sha256_update(&update.sha, (const unsigned char *) data, size);
+  update.pos += size;
+  return true;
+}
+
+bool
+ota_end(const char *sha256)
+{
+  if (!update.partition) {
+    return false;
+  }
+  if (update.pos != update.size) {
+    ESP_LOGE(TAG, "Incomplete image");
+    ota_abort();
+    return false;
+  }
+
+  uint8_t hash[32];
+  char hex[OTA_SHA256_HEX_SIZE+1];
+  mbedtls_sha256_finish(&update.sha, hash);
+  mbedtls_sha256_free(&update.sha);
+  for (int k=0; k<32; k++) {
+    sprintf(hex+2*k, "%02x", hash[k]);
+  }
+
+  const esp_partition_t *partition = update.partition;
+  update.partition = NULL;
+
+  if (sha256 && strcasecmp(sha256, hex) != 0) {
+    ESP_LOGE(TAG, "SHA-256 mismatch (got %s)", hex);
+    esp_ota_abort(update.handle);
+    return false;
+  }
+
+  // Validate the image (including its own checksum)
+  esp_err_t err = esp_ota_end(update.handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Invalid image (%s)", esp_err_to_name(err));
+    return false;
+  }
+  err = esp_ota_set_boot_partition(partition);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "esp_ota_set_boot_partition failed (%s)", esp_err_to_name(err));
+    return false;
+  }
+  ESP_LOGI(TAG, "Next boot from '%s' (sha256 %s)", partition->label, hex);
+  return true;
+}
+
+void
+ota_reboot(void)
+{
+  esp_timer_stop(reboot_timer);
+  esp_timer_start_once(reboot_timer, OTA_REBOOT_DELAY_US);
+}
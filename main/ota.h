@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Firmware update over the air.
+//
+// The flash holds two application slots (ota_0 and ota_1, see partitions.csv).
+// A new image is streamed into the slot that is not running and the device
+// boots from it after a successful ota_end().
+//
+// The new image starts in a pending state (the bootloader is built with
+// CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE). It must be confirmed within
+// CONFIG_APP_OTA_HEALTH_TIMEOUT minutes or the device reboots on the
+// previous image. A reset before the confirmation has the same effect.
+//
+// The image is confirmed by ota_check_health() once the health signals
+// (see OTA_HEALTH_*) were all reported for CONFIG_APP_OTA_HEALTH_UPTIME
+// seconds without interruption.
+//
+// Usage:
+//
+//   ota_begin(size);
+//   ota_write(data, n);   // as many times as needed
+//   ota_end(sha256);      // or ota_abort()
+//   ota_reboot();
+//
+// Only one update can be in progress at a time.
+//
+
+#define OTA_SHA256_HEX_SIZE 64
+
+// The health signals (see ota_set_health)
+#define OTA_HEALTH_WIFI  (1<<0)   // Got an IP address
+#define OTA_HEALTH_HTTP  (1<<1)   // The HTTP server is running
+#define OTA_HEALTH_MQTT  (1<<2)   // Connected to the MQTT broker
+
+// Called once at startup. Arm the rollback timer if the running image is
+// not yet confirmed.
+void ota_init(void);
+
+// Start an update of 'size' bytes.
+bool ota_begin(size_t size);
+
+// Write the next chunk of the image. The update is aborted on failure.
+bool ota_write(const char *data, size_t size);
+
+// Complete the update and select the new image for the next boot.
+//
+// If not NULL, 'sha256' is the expected SHA-256 of the whole image as
+// OTA_SHA256_HEX_SIZE hexadecimal digits. The update is rejected if it
+// does not match.
+bool ota_end(const char *sha256);
+
+void ota_abort(void);
+
+// Reboot after a short delay (so the response of the update can be sent).
+void ota_reboot(void);
+
+// Mark the running image as healthy and cancel the rollback.
+// This is harmless if the image is already confirmed.
+void ota_confirm(void);
+
+// Report that a health signal is set or cleared. Can be called from any task.
+void ota_set_health(int signal, bool ok);
+
+// Confirm the running image (see ota_confirm) if it is healthy. Called
+// periodically by the application task.
+void ota_check_health(void);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdint.h>
+
+//
+// A perfect hash of a fixed set of names computed at compile time.
+//
+// The hash is a seeded FNV-1a. The seed is the first one for which all the
+// names land in different slots of a table of SIZE entries (a power of 2),
+// so a lookup hashes the name once and compares it with a single candidate.
+//
+// Usage:
+//
+//   static constexpr auto index = perfect_hash_build<SIZE>(table, [](const T &item) { return item.name; });
+//   static_assert(index.seed >= 0, "No perfect hash found");
+//   ...
+//   int i = index.lookup(name);   // The only possible index of 'name' in table[] or -1
+//   if (i >= 0 && strcmp(table[i].name, name) == 0) {
+//     ...
+//   }
+//
+// Nothing depends on ESP-IDF so this can be compiled and tested on a host.
+//
+
+// The seeds that are tried by perfect_hash_build()
+#define PERFECT_HASH_MAX_SEED 10000
+
+// A seeded FNV-1a hash
+static constexpr uint32_t
+perfect_hash(const char *name, uint32_t seed)
+{
+  uint32_t h = 2166136261u ^ seed;
+  while (*name) {
+    h ^= uint8_t(*name++);
+    h *= 16777619u;
+  }
+  return h ^ (h >> 15);
+}
+
+// The smallest power of 2 that is at least 'n'
+static constexpr int
+perfect_hash_size(int n)
+{
+  int size = 1;
+  while (size < n) {
+    size <<= 1;
+  }
+  return size;
+}
+
+template <int SIZE>
+struct perfect_hash_t
+{
+  static_assert((SIZE & (SIZE-1)) == 0, "The size of a perfect hash must be a power of 2");
+
+  int32_t seed;          // -1 if no perfect hash was found
+  int8_t  slot[SIZE];    // An index in the table or -1
+
+  constexpr int lookup(const char *name) const {
+    return slot[perfect_hash(name, seed) & (SIZE-1)];
+  }
+};
+
+// Compute the perfect hash of the names of table[]. 'name_of' returns the
+// name of an item.
+template <int SIZE, typename T, int N, typename F>
+constexpr perfect_hash_t<SIZE>
+perfect_hash_build(const T (&table)[N], F name_of)
+{
+  static_assert(N <= SIZE, "The size of the perfect hash is too small");
+  static_assert(N <= 128, "perfect_hash_t::slot is too small");
+
+  perfect_hash_t<SIZE> index = {};
+  index.seed = -1;
+  for (int k=0; k<SIZE; k++) {
+    index.slot[k] = -1;
+  }
+  for (int32_t seed=0; seed<PERFECT_HASH_MAX_SEED; seed++) {
+    bool used[SIZE] = {};
+    bool perfect = true;
+    for (int i=0; i<N && perfect; i++) {
+      int k = perfect_hash(name_of(table[i]), seed) & (SIZE-1);
+      perfect = !used[k];
+      used[k] = true;
+    }
+    if (perfect) {
+      index.seed = seed;
+      for (int i=0; i<N; i++) {
+        index.slot[perfect_hash(name_of(table[i]), seed) & (SIZE-1)] = int8_t(i);
+      }
+      break;
+    }
+  }
+  return index;
+}
@@ -0,0 +1,64 @@
+#include <math.h>
+
+#include "power_filter.h"
+
+power_filter::power_filter(int median, int ema_percent)
+{
+  deadband = 0;
+  configure(median, ema_percent);
+}
+
+void
+power_filter::configure(int median, int ema_percent)
+{
+  this->median_size = (median < 1) ? 1 : (median > POWER_FILTER_MAX_MEDIAN) ? POWER_FILTER_MAX_MEDIAN : median ;
+  this->ema_percent = (ema_percent < 1) ? 1 : (ema_percent > 100) ? 100 : ema_percent ;
+  reset();
+}
+
+void
+power_filter::reset()
+{
+  count  = 0;
+  next   = 0;
+  ema    = 0;
+  last   = 0;
+  primed = false;
+}
+
+bool
+power_filter::update(int sample)
+{
+  // The median of the window. An insertion sort is fine for a few samples.
+  window[next] = sample;
+  next = (next + 1) % median_size;
+  if (count < median_size) {
+    count++;
+  }
+  int sorted[POWER_FILTER_MAX_MEDIAN];
+  for (int i=0; i<count; i++) {
+    int v = window[i];
+    int j = i;
+    for ( ; j>0 && sorted[j-1] > v; j--) {
+      sorted[j] = sorted[j-1];
+    }
+    sorted[j] = v;
+  }
+  double median = (count % 2) ? sorted[count/2] : 0.5 * (double(sorted[count/2-1]) + sorted[count/2]) ;
+
+  if (!primed) {
+    primed = true;
+    ema  = median;
+    last = lround(ema);
+    return true;
+  }
+
+  ema += (median - ema) * ema_percent / 100;
+
+  int value = lround(ema);
+  if (value == last || fabs(ema - last) < deadband) {
+    return false;
+  }
+  last = value;
+  return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+//
+// The conditioning of the available power reported by the energy meter
+// before it reaches the control law (see update_ac_relay in app.cc).
+//
+// The samples pass through three stages:
+//
+//   1. A median over the last N samples that removes isolated spikes
+//      (e.g. a kettle switching on for a few seconds).
+//   2. An exponential moving average that smooths the noise.
+//   3. A deadband: the output only changes when the smoothed value moved
+//      by at least the deadband since the last output. That avoids relay
+//      changes that are smaller than the resolution of the relay.
+//
+// Each stage can be disabled (median of 1 sample, EMA weight of 100%,
+// deadband of 0). Nothing is allocated and nothing depends on ESP-IDF so
+// the filter can be compiled and tested on a host.
+//
+
+#define POWER_FILTER_MAX_MEDIAN 9
+
+class power_filter
+{
+public:
+  // See configure()
+  power_filter(int median=1, int ema_percent=100);
+
+  // Set the size of the median window (between 1 and POWER_FILTER_MAX_MEDIAN)
+  // and the weight of a new sample in the EMA (between 1 and 100 percent).
+  // The values are clamped. The filter is reset.
+  void configure(int median, int ema_percent);
+
+  // Forget all previous samples. The next sample is passed as is.
+  void reset();
+
+  // Set the deadband (0 to disable). Takes effect at the next sample.
+  void set_deadband(int deadband) { this->deadband = (deadband > 0) ? deadband : 0; }
+
+  // Add a sample. Return true if the output changed (see output()).
+  bool update(int sample);
+
+  // The current output of the filter (0 before the first sample)
+  int output() const { return last; }
+
+private:
+  int    window[POWER_FILTER_MAX_MEDIAN];  // The last samples (a ring)
+  int    median_size;
+  int    count;        // The number of samples in window
+  int    next;         // The next slot in window
+  int    ema_percent;
+  double ema;
+  int    deadband;
+  int    last;
+  bool   primed;       // False until the first sample
+};
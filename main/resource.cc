@@ -6,10 +6,16 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <math.h>
+#include <algorithm>
 
 #include "esp_log.h"
+#include "esp_partition.h"
+#include "miniz.h"
+#include "mbedtls/sha256.h"
 
 #include "resource.h"
+#include "perfect_hash.h"
+#include "resource_etag.h"   // generated at build time (see CMakeLists.txt)
 
 static const char TAG[] = "resource" ;
 
@@ -28,22 +34,42 @@ typedef struct {
   const char * name;
   const char * start;
   const char * end; 
+  resource_encoding_t encoding;
+  const char * etag;
 } priv_resource_t ;
 
-#include "resource.inc"
+#define ETAG(SYMBOL) RESOURCE_ETAG_##SYMBOL
+
+//
+// resource.inc is generated from RAW_RESOURCES and GZIP_RESOURCES in
+// CMakeLists.txt (see resource_inc.py). It defines the RESOURCES X-macro
+// where
+//  - the first argument is the internal name of the resource. 
+//  - the second argument is the base label of the symbols created by 
+//    EMBED_FILES or target_add_binary_data. This is the basename of
+//    the embedded file where all 'non-label' characters are replaced
+//    by '_'. For example, 'data/xxx.yyy' becomes 'xxx_yyy' 
+//  - DEF_GZIP is for the text resources that are compressed at build time.
+//    The label of 'data/xxx.yyy' is then 'xxx_yyy_gz'.
+//  - the third argument is the MIME type.
+//
+#include "resource.inc"   // generated at build time
 
 // Declare all the symbols
 
 #define DEF_TEXT(NAME, SYMBOL, TYPE)   extern const char START(SYMBOL)[], END(SYMBOL) [] ;
 #define DEF_BINARY(NAME, SYMBOL, TYPE) extern const char START(SYMBOL)[], END(SYMBOL) [] ;
+#define DEF_GZIP(NAME, SYMBOL, TYPE)   extern const char START(SYMBOL)[], END(SYMBOL) [] ;
 
 RESOURCES
 
 #undef DEF_TEXT
 #undef DEF_BINARY
+#undef DEF_GZIP
 
-#define DEF_TEXT(NAME, SYMBOL, TYPE)   { .name = NAME, .start = START(SYMBOL), .end = END(SYMBOL) },
-#define DEF_BINARY(NAME, SYMBOL, TYPE) { .name = NAME, .start = START(SYMBOL), .end = END(SYMBOL) },
+#define DEF_TEXT(NAME, SYMBOL, TYPE)   { .name = NAME, .start = START(SYMBOL), .end = END(SYMBOL), .encoding = RESOURCE_ENCODING_NONE, .etag = ETAG(SYMBOL) },
+#define DEF_BINARY(NAME, SYMBOL, TYPE) { .name = NAME, .start = START(SYMBOL), .end = END(SYMBOL), .encoding = RESOURCE_ENCODING_NONE, .etag = ETAG(SYMBOL) },
+#define DEF_GZIP(NAME, SYMBOL, TYPE)   { .name = NAME, .start = START(SYMBOL), .end = END(SYMBOL), .encoding = RESOURCE_ENCODING_GZIP, .etag = ETAG(SYMBOL) },
 
 static const priv_resource_t priv[] = {
   RESOURCES
@@ -51,9 +77,11 @@ static const priv_resource_t priv[] = {
 
 #undef DEF_TEXT
 #undef DEF_BINARY
+#undef DEF_GZIP
 
 #define DEF_TEXT(NAME, SYMBOL, TYPE)   { .data=0, .size=0, .type=TYPE, .is_str=true, }, 
 #define DEF_BINARY(NAME, SYMBOL, TYPE) { .data=0, .size=0, .type=TYPE, .is_str=false,}, 
+#define DEF_GZIP(NAME, SYMBOL, TYPE)   { .data=0, .size=0, .type=TYPE, .is_str=true, }, 
 
 static resource_t resources[] = {
   RESOURCES
@@ -61,19 +89,83 @@ static resource_t resources[] = {
   
 #undef DEF_TEXT
 #undef DEF_BINARY
+#undef DEF_GZIP
 
 enum {
   // The number of resources. 
   rescount = sizeof(resources)/sizeof(resource_t)
 } ;
 
+//
+// The resources uploaded at runtime are stored in a dedicated data
+// partition (see partitions.csv) so they survive a reboot. 
+//
+// The partition is split in one fixed slot per resource. Each slot starts
+// with a header followed by the data. The header is written last so a slot
+// only becomes valid once its data is complete.
+//
+// The whole partition is memory-mapped at startup so the resources stored
+// in flash can be accessed directly like the embedded ones. Reminder: the
+// flash writes also invalidate the cache so the mapping remains coherent.
+//
+#define RESOURCE_PARTITION_LABEL   "resources"
+#define RESOURCE_PARTITION_SUBTYPE ((esp_partition_subtype_t) 0x40)
+
+#define FLASH_MAGIC        0x53455243  // "CRES"
+#define FLASH_SECTOR_SIZE  4096
+#define FLASH_HEADER_SIZE  64          // The data follows the header
+
+typedef struct {
+  uint32_t magic;
+  uint32_t size;                       // The size of the data
+  uint32_t encoding;                   // A resource_encoding_t
+  char     name[32];                   // The name of the resource 
+  char     etag[RESOURCE_ETAG_DIGITS+3];
+} flash_header_t ;
+
+static_assert(sizeof(flash_header_t) <= FLASH_HEADER_SIZE, "flash_header_t is too large");
+
+static const esp_partition_t *flash_partition = NULL;
+static size_t flash_slot_size = 0;
+static const char *flash_map = NULL;  // The mapped partition or NULL
+
+// The offset of the data of each resource in the partition or -1 if not in flash.
+static int flash_offset[rescount];
+
+static inline size_t flash_slot(int i)
+{
+  return i * flash_slot_size;
+}
+
+//
+// The lookup by name uses a perfect hash computed at compile time (see
+// perfect_hash.h). The table is at least twice as large as the number of
+// resources so a seed is quickly found.
+//
+
+#define DEF_TEXT(NAME, SYMBOL, TYPE)   NAME,
+#define DEF_BINARY(NAME, SYMBOL, TYPE) NAME,
+#define DEF_GZIP(NAME, SYMBOL, TYPE)   NAME,
+
+static constexpr const char *res_names[] = {
+  RESOURCES
+};
+
+#undef DEF_TEXT
+#undef DEF_BINARY
+#undef DEF_GZIP
+
+static constexpr auto res_index =
+  perfect_hash_build<perfect_hash_size(2*rescount)>(res_names, [](const char *name) { return name; });
+
+static_assert(res_index.seed >= 0, "No perfect hash found for the resource names");
+
 static int resource_index(const char *name) {
   if (!name)
     return -1 ;
-  for (int i=0;i<rescount;i++) {
-    if (!strcmp(priv[i].name, name)) {
-      return i;
-    }
+  int i = res_index.lookup(name);
+  if (i >= 0 && strcmp(priv[i].name, name) == 0) {
+    return i;
   }
   return -1;
 }
@@ -110,21 +202,61 @@ static void
 resource_restore_at(int i)
 {
   if (i>=0 && i<rescount) {
-    if ( resources[i].data && resources[i].data != priv[i].start ) {      
-      free( (void*) resources[i].data ) ;
-    }
+    flash_offset[i] = -1 ;
     resources[i].data = priv[i].start ;
+    resources[i].encoding = priv[i].encoding ;
+    strlcpy(resources[i].etag, priv[i].etag, sizeof(resources[i].etag));
     int size = priv[i].end - priv[i].start;
-    if (resources[i].is_str)
+    // EMBED_TXTFILES adds a trailing \0 
+    if (resources[i].is_str && priv[i].encoding==RESOURCE_ENCODING_NONE)
       size--;
     resources[i].size = size ;
   }
 }
 
+// Invalidate the flash slot of a resource
+static void
+resource_erase_flash_at(int i)
+{
+  if (flash_partition && i>=0 && i<rescount) {
+    esp_partition_erase_range(flash_partition, flash_slot(i), FLASH_SECTOR_SIZE);
+  }
+}
+
+// Use the content of the flash slot of a resource if it is valid.
+static bool
+resource_load_flash_at(int i)
+{
+  if (!flash_partition) {
+    return false;
+  }
+  flash_header_t header;
+  if (esp_partition_read(flash_partition, flash_slot(i), &header, sizeof(header)) != ESP_OK) {
+    return false;
+  }
+  if (header.magic != FLASH_MAGIC ||
+      header.size > flash_slot_size - FLASH_HEADER_SIZE ||
+      header.encoding > RESOURCE_ENCODING_GZIP ||
+      strncmp(header.name, priv[i].name, sizeof(header.name)) != 0 ) {
+    return false;
+  }
+  resource_restore_at(i);
+  flash_offset[i] = flash_slot(i) + FLASH_HEADER_SIZE ;
+  resources[i].data = flash_map ? flash_map + flash_offset[i] : NULL ;
+  resources[i].size = header.size ;
+  resources[i].encoding = (resource_encoding_t) header.encoding ;
+  memcpy(resources[i].etag, header.etag, sizeof(resources[i].etag));
+  resources[i].etag[sizeof(resources[i].etag)-1] = '\0';
+  return true;
+}
+
 void
 resource_restore(const char *name)
 {
   int i = resource_index(name) ;
+  if (i>=0 && flash_offset[i]>=0) {
+    resource_erase_flash_at(i);
+  }
   resource_restore_at(i);  
 }
 
@@ -132,70 +264,309 @@ void
 resource_restore_all()
 {
   for (int i=0;i<rescount; i++) {   
+    if (flash_offset[i]>=0) {
+      resource_erase_flash_at(i);
+    }
     resource_restore_at(i);
   }
 }
 
+bool
+resource_read(const resource_t *res, size_t offset, char *buffer, size_t size)
+{
+  if (offset+size > (size_t) res->size) {
+    return false;
+  }
+  if (res->data) {
+    memcpy(buffer, res->data+offset, size);
+    return true;
+  }
+  // In flash but not mapped
+  int i = res - resources ;
+  return esp_partition_read(flash_partition, flash_offset[i]+offset, buffer, size) == ESP_OK;
+}
+
+//
+// Streaming upload into the flash partition.
+//
+static struct {
+  int    index;      // The resource being uploaded or -1
+  size_t size;
+  size_t pos;
+  resource_encoding_t encoding;
+  mbedtls_sha256_context sha;
+} upload = { .index = -1 } ;
+
 void
-resource_update_binary(const char *name, void *data, int size)
+resource_upload_abort(void)
 {
-  if (data==NULL || size==0) {
-    return;
+  if (upload.index >= 0) {
+    ESP_LOGW(TAG, "Upload of '%s' aborted", priv[upload.index].name);
+    mbedtls_sha256_free(&upload.sha);
+    upload.index = -1;
   }
-  
+}
+
+bool
+resource_upload_begin(const char *name, size_t size, resource_encoding_t encoding)
+{
+  resource_upload_abort();
+
   int i = resource_index(name);
-  if (i<0) {
-    free(data);
-    return;
+  if (i<0 || !flash_partition) {
+    return false;
+  }
+  if (size == 0 || size > flash_slot_size - FLASH_HEADER_SIZE) {
+    ESP_LOGE(TAG, "Cannot store %u bytes for '%s' (max %u)", (unsigned) size, name,
+             (unsigned) (flash_slot_size - FLASH_HEADER_SIZE));
+    return false;
   }
 
-  if (resources[i].is_str) {
-    ESP_LOGE(TAG,"Cannot update string resource '%s' with binary data",name);
-    free(data);
-    return; 
+  // The current content of the slot is lost so fall back to the embedded resource
+  resource_restore_at(i);
+
+  size_t erase_size = (FLASH_HEADER_SIZE + size + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE-1) ;
+  if (esp_partition_erase_range(flash_partition, flash_slot(i), erase_size) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to erase the slot of '%s'", name);
+    return false;
   }
 
-  resource_restore_at(i); /// free the current resource if necessary 
+  upload.index    = i;
+  upload.size     = size;
+  upload.pos      = 0;
+  upload.encoding = encoding;
+  mbedtls_sha256_init(&upload.sha);
+  mbedtls_sha256_starts(&upload.sha, 0);
+  return true;
+}
 
-  resources[i].data = (const char*) data ; 
-  resources[i].size = size ; 
+bool
+resource_upload_write(const char *data, size_t size)
+{
+  if (upload.index < 0) {
+    return false;
+  }
+  int i = upload.index;
+  if (upload.pos + size > upload.size) {
+    ESP_LOGE(TAG, "Too much data for '%s'", priv[i].name);
+    resource_upload_abort();
+    return false;
+  }
+  if (resources[i].is_str && upload.encoding == RESOURCE_ENCODING_NONE && memchr(data, 0, size)) {
+    ESP_LOGE(TAG, "Unexpected null byte in string resource '%s'", priv[i].name);
+    resource_upload_abort();
+    return false;
+  }
+  if (upload.encoding == RESOURCE_ENCODING_GZIP && upload.pos == 0 &&
+      (size < 2 || uint8_t(data[0]) != 0x1f || uint8_t(data[1]) != 0x8b)) {
+    ESP_LOGE(TAG, "Malformed gzip data for '%s'", priv[i].name);
+    resource_upload_abort();
+    return false;
+  }
+  if (esp_partition_write(flash_partition, flash_slot(i) + FLASH_HEADER_SIZE + upload.pos, data, size) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to write '%s'", priv[i].name);
+    resource_upload_abort();
+    return false;
+  }
+  mbedtls_sha256_update(&upload.sha, (const unsigned char *) data, size);
+  upload.pos += size;
+  return true;
 }
 
-void
-resource_update_string(const char *name, char *data, int size)
+bool
+resource_upload_end(void)
 {
-  if (data==NULL || size==0) {
-    return;
+  if (upload.index < 0) {
+    return false;
+  }
+  int i = upload.index;
+  if (upload.pos != upload.size) {
+    ESP_LOGE(TAG, "Incomplete upload for '%s'", priv[i].name);
+    resource_upload_abort();
+    return false;
   }
+
+  uint8_t hash[32];
+  mbedtls_sha256_finish(&upload.sha, hash);
+  mbedtls_sha256_free(&upload.sha);
+  upload.index = -1;
+
+  flash_header_t header = {};
+  header.magic    = FLASH_MAGIC;
+  header.size     = upload.size;
+  header.encoding = upload.encoding;
+  strlcpy(header.name, priv[i].name, sizeof(header.name));
+  // The ETag must match what resource_etag.py does at build time
+  char *out = header.etag;
+  *out++ = '"';
+  for (int k=0; k<RESOURCE_ETAG_DIGITS/2; k++) {
+    out += sprintf(out, "%02x", hash[k]);
+  }
+  *out++ = '"';
   
-  int i = resource_index(name);
-  if (i<0) {
-    free(data);
-    return;
+  // Commit
+  if (esp_partition_write(flash_partition, flash_slot(i), &header, sizeof(header)) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to write the header of '%s'", priv[i].name);
+    return false;
+  }
+  return resource_load_flash_at(i);
+}
+
+//
+// Skip the header of a gzip member (see RFC 1952) and return the
+// offset of the deflate data or -1 if the header is malformed. 
+//
+static int
+gzip_header_size(const uint8_t *data, int size)
+{
+  constexpr uint8_t FHCRC=0x02, FEXTRA=0x04, FNAME=0x08, FCOMMENT=0x10;
+  
+  if (size < 10 || data[0]!=0x1f || data[1]!=0x8b || data[2]!=8 ) {
+    return -1;
+  }
+  uint8_t flags = data[3];
+  int pos = 10;
+  if (flags & FEXTRA) {
+    if (pos+2 > size)
+      return -1;
+    pos += 2 + (data[pos] | (data[pos+1]<<8));
+  }
+  if (flags & FNAME) {
+    while (pos < size && data[pos]) 
+      pos++;
+    pos++;
+  }
+  if (flags & FCOMMENT) {
+    while (pos < size && data[pos]) 
+      pos++;
+    pos++;
+  }
+  if (flags & FHCRC) {
+    pos += 2;
+  }
+  return (pos < size) ? pos : -1 ;
+}
+
+bool
+resource_decode(const resource_t *res, resource_writer_t writer, void *ctx)
+{
+  // The input is read by blocks of that size 
+  constexpr int INPUT_SIZE = 1024;
+  
+  if (res->encoding == RESOURCE_ENCODING_NONE && res->data) {
+    return writer(ctx, res->data, res->size);
+  } else if (res->encoding == RESOURCE_ENCODING_NONE) {
+    char buffer[256];
+    for (int pos=0; pos<res->size; pos += sizeof(buffer)) {
+      int n = std::min(res->size-pos, (int) sizeof(buffer));
+      if (!resource_read(res, pos, buffer, n) || !writer(ctx, buffer, n)) {
+        return false;
+      }
+    }
+    return true;
   }
 
-  if (!resources[i].is_str) {
-    ESP_LOGE(TAG,"Cannot update binary resource '%s' with string data",name);
-    free(data);
-    return ;
+  // So RESOURCE_ENCODING_GZIP
+
+  // The decompressor and its dictionary are too large for the stack.
+  // The dictionary is used as a circular output buffer.
+  typedef struct {
+    tinfl_decompressor inflator;
+    uint8_t dict[TINFL_LZ_DICT_SIZE];
+    uint8_t input[INPUT_SIZE];
+  } inflate_t ;
+  
+  inflate_t *z = (inflate_t *) malloc(sizeof(inflate_t));
+  if (!z) {
+    ESP_LOGE(TAG, "Not enough memory to decode resource");
+    return false;
   }
+  tinfl_init(&z->inflator);
 
-  // Make sure that data is a valid string of the specified size
-  if ( data[size]!=0 || strlen(data)!=size ) {
-    ESP_LOGE(TAG,"Malformed data for string resource '%s'",name);
-    free(data);
-    return ;
+  // The gzip header is assumed to fit in the first block
+  int in_end = std::min(res->size, INPUT_SIZE);
+  if (!resource_read(res, 0, (char*) z->input, in_end)) {
+    free(z);
+    return false;
   }
-  resource_restore_at(i); // free the current resource if necessary
-  resources[i].data = data ; 
-  resources[i].size = size ; 
+  int in_pos = gzip_header_size(z->input, in_end);
+  if (in_pos<0) {
+    ESP_LOGE(TAG, "Malformed gzip header");
+    free(z);
+    return false;
+  }
+  int pos = in_end; // The position in the resource after the input block
+
+  bool ok = true;
+  size_t out_pos = 0;
+  while (ok) {
+    if (in_pos == in_end && pos < res->size) {
+      in_end = std::min(res->size-pos, INPUT_SIZE);
+      if (!resource_read(res, pos, (char*) z->input, in_end)) {
+        ok = false;
+        break;
+      }
+      pos += in_end;
+      in_pos = 0;
+    }
+    size_t in_size  = in_end - in_pos;
+    size_t out_size = TINFL_LZ_DICT_SIZE - out_pos;
+    tinfl_status status = tinfl_decompress(&z->inflator,
+                                           z->input+in_pos, &in_size,
+                                           z->dict, z->dict+out_pos, &out_size,
+                                           (pos < res->size) ? TINFL_FLAG_HAS_MORE_INPUT : 0);
+    in_pos += in_size;
+    if (out_size>0) {
+      ok = writer(ctx, (const char*) z->dict+out_pos, out_size);
+    }
+    out_pos = (out_pos + out_size) & (TINFL_LZ_DICT_SIZE-1);
+    if (status == TINFL_STATUS_DONE) {
+      break;
+    } else if (status < TINFL_STATUS_DONE) {
+      ESP_LOGE(TAG, "Failed to decode resource (status %d)", (int) status);
+      ok = false;
+    } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && pos >= res->size) {
+      // All the input was provided so that cannot happen with valid data 
+      ESP_LOGE(TAG, "Truncated resource");
+      ok = false;
+    }
+  }
+  
+  free(z);
+  return ok;
 }
 
 void resource_init()
 {  
-  resource_restore_all() ;
+  flash_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                             RESOURCE_PARTITION_SUBTYPE,
+                                             RESOURCE_PARTITION_LABEL);
+  if (flash_partition) {
+    flash_slot_size = (flash_partition->size / rescount) & ~(FLASH_SECTOR_SIZE-1) ;
+    const void *ptr;
+    esp_partition_mmap_handle_t handle; // Never unmapped
+    if (esp_partition_mmap(flash_partition, 0, flash_partition->size,
+                           ESP_PARTITION_MMAP_DATA, &ptr, &handle) == ESP_OK) {
+      flash_map = (const char *) ptr;
+    } else {
+      ESP_LOGW(TAG, "Failed to map the '%s' partition", RESOURCE_PARTITION_LABEL);
+    }
+  } else {
+    ESP_LOGW(TAG, "No '%s' partition. Uploads are disabled", RESOURCE_PARTITION_LABEL);
+  }
+
+  for (int i=0;i<rescount; i++) {   
+    flash_offset[i] = -1 ;
+    resource_restore_at(i);
+    resource_load_flash_at(i);
+  }
+  
   for (int i=0;i<rescount; i++) {
-    ESP_LOGI(TAG, "%c %5d %s ", (resources[i].is_str?'S':'B'),  resources[i].size, priv[i].name );
+    ESP_LOGI(TAG, "%c%c%c %6d %s ",
+             (resources[i].is_str?'S':'B'),
+             (resources[i].encoding==RESOURCE_ENCODING_GZIP?'z':' '),
+             (flash_offset[i]>=0?'f':' '),
+             resources[i].size, priv[i].name );
   }
 }
 
@@ -1,10 +1,26 @@
 #pragma once
 
+#include <stddef.h>
+
+typedef enum {
+  RESOURCE_ENCODING_NONE,  // .data is the content
+  RESOURCE_ENCODING_GZIP,  // .data is the gzip compressed content
+} resource_encoding_t ;
+
+// The number of hexadecimal digits in the ETag of a resource 
+#define RESOURCE_ETAG_DIGITS 16
+
+//
+// Reminder: .is_str describes the content and not the data. If the resource
+//           is encoded then .data is not a NULL-terminated string.
+//
 typedef struct {
-  const char * data;
+  const char * data;   // NULL if the resource is stored in flash but could not be mapped (see resource_read)
   int          size; 
   const char * type;
   bool         is_str;
+  resource_encoding_t encoding;
+  char         etag[RESOURCE_ETAG_DIGITS+3]; // A quoted hash of .data (so a strong HTTP ETag)
 } resource_t ;
 
 // Initialize the resources
@@ -23,27 +39,47 @@ const resource_t * resource_get_string(const char *name);
 // Return true if a resource exists and contains a string.
 bool resource_is_string(const char *name);
 
-// Restore a resource to its initial state
+// Restore a resource to its initial state.
+// This also erases the resource from the flash partition.
 void resource_restore(const char *name);
 
 // Restore all resources to their initial state
 void resource_restore_all();
 
-// Temporarily update the data associated to a binary resource.
+// Read 'size' bytes of the data of a resource starting at 'offset'.
 //
-// The data must have been allocated with malloc and the caller
-// should never attempt to free it. 
+// This works for all resources, including those stored in flash.
 //
 // Return true in case of success and false otherwise.
+bool resource_read(const resource_t *res, size_t offset, char *buffer, size_t size);
+
+//
+// Streaming update of a resource in the flash partition.
 //
-void resource_update_binary(const char *name, void *data, int size);
+// The data is written to flash as it is received so it survives a reboot
+// and the resource is updated only once resource_upload_end() succeeds.
+// The resource falls back to its embedded content during the upload
+// or if the upload fails.
+//
+// Only one upload can be in progress at a time. 
+//
+// The resource is stored as is so 'encoding' must describe the data.
+//
+bool resource_upload_begin(const char *name, size_t size, resource_encoding_t encoding);
+bool resource_upload_write(const char *data, size_t size);
+bool resource_upload_end(void);
+void resource_upload_abort(void);
+
+// Called by resource_decode() for each block of decoded data.
+// Shall return false to abort the decoding.
+typedef bool (*resource_writer_t)(void *ctx, const char *data, size_t size);
 
-// Temporarily update the data associated to a string resource.
+// Decode the content of an encoded resource and pass it by blocks to 'writer'.
 //
-// The data must have been allocated with malloc and the caller
-// should never attempt to free it. 
+// This is meant for the rare clients that do not accept the encoding
+// since a temporary buffer of about 43KB is needed for gzip.
 //
-// The size shall match strlen(data) and so, does not include
-// the trailing \0. 
-// 
-void resource_update_string(const char *name, char *data, int size);
+// Return true in case of success and false otherwise.
+//
+bool resource_decode(const resource_t *res, resource_writer_t writer, void *ctx);
+
@@ -0,0 +1,41 @@
+#!/usr/bin/env python3
+#
+# Generate a C header with a content hash for each embedded resource.
+#
+# For each FILE, the header defines RESOURCE_ETAG_<label> as a quoted
+# strong ETag where <label> is the label used by EMBED_FILES (so the
+# basename of FILE with all 'non-label' characters replaced by '_').
+#
+# The hash is the first 8 bytes of the SHA-256 of the file content. This
+# is the same hash that resource.cc computes for the uploaded resources.
+#
+# Usage: resource_etag.py OUTPUT FILE...
+#
+
+import hashlib
+import os
+import re
+import sys
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit('Usage: resource_etag.py OUTPUT FILE...')
+    lines = ['// Generated by resource_etag.py. Do not edit.', '']
+    for path in sys.argv[2:]:
+        label = re.sub(r'[^A-Za-z0-9_]', '_', os.path.basename(path))
+        with open(path, 'rb') as f:
+            digest = hashlib.sha256(f.read()).hexdigest()[:16]
+        lines.append('#define RESOURCE_ETAG_%s "\\"%s\\""' % (label, digest))
+    content = '\n'.join(lines) + '\n'
+    # Do not touch the output if nothing changed to avoid useless recompilations
+    if os.path.exists(sys.argv[1]):
+        with open(sys.argv[1]) as f:
+            if f.read() == content:
+                return
+    with open(sys.argv[1], 'w') as f:
+        f.write(content)
+
+
+if __name__ == '__main__':
+    main()
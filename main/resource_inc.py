@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+#
+# Generate resource.inc (the RESOURCES X-macro used by resource.cc) from
+# the resource lists of CMakeLists.txt.
+#
+# Each ENTRY is KIND=NAME=FILE where
+#   - KIND is 'binary' (embedded as is) or 'gzip' (compressed at build time)
+#   - NAME is the internal name of the resource (e.g. '/index.html')
+#   - FILE is the source file (e.g. 'data/index.html')
+#
+# The label of the embedded symbols is the basename of FILE with all
+# 'non-label' characters replaced by '_' (plus '_gz' for 'gzip').
+# The MIME type is derived from the extension of FILE.
+#
+# Usage: resource_inc.py OUTPUT ENTRY...
+#
+
+import os
+import re
+import sys
+
+MIME_TYPES = {
+    '.css':  'text/css',
+    '.html': 'text/html',
+    '.ico':  'image/x-icon',
+    '.js':   'text/javascript',
+    '.json': 'application/json',
+    '.png':  'image/png',
+    '.svg':  'image/svg+xml',
+    '.txt':  'text/plain',
+}
+
+MACROS = {
+    'binary': 'DEF_BINARY',
+    'gzip':   'DEF_GZIP',
+}
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit('Usage: resource_inc.py OUTPUT ENTRY...')
+    lines = ['// Generated by resource_inc.py from CMakeLists.txt. Do not edit.',
+             '',
+             '#define RESOURCES \\']
+    names = set()
+    for entry in sys.argv[2:]:
+        kind, name, path = entry.split('=', 2)
+        if kind not in MACROS:
+            sys.exit('resource_inc.py: unknown kind %s for %s' % (kind, path))
+        if name in names:
+            sys.exit('resource_inc.py: duplicate resource %s' % name)
+        names.add(name)
+        ext = os.path.splitext(path)[1].lower()
+        if ext not in MIME_TYPES:
+            sys.exit('resource_inc.py: unknown MIME type for %s' % path)
+        label = re.sub(r'[^A-Za-z0-9_]', '_', os.path.basename(path))
+        if kind == 'gzip':
+            label += '_gz'
+        lines.append('  %s("%s", %s, "%s") \\' % (MACROS[kind], name, label, MIME_TYPES[ext]))
+    lines.append('')
+    content = '\n'.join(lines) + '\n'
+    # Do not touch the output if nothing changed to avoid useless recompilations
+    if os.path.exists(sys.argv[1]):
+        with open(sys.argv[1]) as f:
+            if f.read() == content:
+                return
+    with open(sys.argv[1], 'w') as f:
+        f.write(content)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,269 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+#include "telemetry.h"
+#include "history.h"
+
+static const char TAG[] = "telemetry" ;
+
+#define TELEMETRY_RECORDS CONFIG_APP_TELEMETRY_RECORDS
+
+// An earlier time means that the clock was not set yet (see SNTP)
+#define TELEMETRY_MIN_TIME 1600000000
+
+// The record with the sequence number S is stored in ring[S % TELEMETRY_RECORDS]
+static telemetry_record_t ring[TELEMETRY_RECORDS];
+
+// Protects the ring and the counters below. The records of the ring are
+// only written by telemetry_poll().
+static portMUX_TYPE telemetry_mutex = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t first   = 0;    // The sequence number of the oldest record
+static uint32_t count   = 0;    // The number of pending records
+static uint32_t dropped = 0;
+
+// Only used by telemetry_poll()
+static uint32_t next_sample = 0;   // The time of the next history sample to read
+static double   energy_wh   = 0;
+
+#ifdef CONFIG_APP_TELEMETRY_FLASH
+
+// The pending records are saved in the NVS as two blobs: 'ring' is the
+// whole ring and 'index' describes its content.
+typedef struct {
+  uint32_t size;     // TELEMETRY_RECORDS when saved
+  uint32_t first;
+  uint32_t count;
+} telemetry_index_t ;
+
+static nvs_handle_t telemetry_nvs;
+
+// Held by telemetry_save() while the ring is written to the NVS so the
+// records are not modified in the meantime (see telemetry_poll).
+static StaticSemaphore_t ring_lock_buffer;
+static SemaphoreHandle_t ring_lock;
+
+static volatile bool link_up = false;   // As given to telemetry_poll()
+
+// Only used by telemetry_save()
+static bool     nvs_ok     = false;
+static bool     saved      = false;   // True if the NVS contains records
+static uint32_t saved_end  = 0;       // first+count when saved
+static uint32_t saved_time = 0;       // The history time when saved
+
+static void
+restore(void)
+{
+  if (nvs_open("telemetry", NVS_READWRITE, &telemetry_nvs) != ESP_OK) {
+    ESP_LOGE(TAG, "Cannot open the NVS");
+    return;
+  }
+  nvs_ok = true;
+
+  telemetry_index_t index;
+  size_t size = sizeof(index);
+  if (nvs_get_blob(telemetry_nvs, "index", &index, &size) != ESP_OK || size != sizeof(index)) {
+    return;   // Nothing saved
+  }
+  saved = true;   // Erased once published (or replaced)
+  if (index.size != TELEMETRY_RECORDS || index.count > TELEMETRY_RECORDS) {
+    ESP_LOGW(TAG, "Ignored the saved records (the size of the ring changed)");
+    return;
+  }
+  size = sizeof(ring);
+  if (nvs_get_blob(telemetry_nvs, "ring", ring, &size) != ESP_OK || size != sizeof(ring)) {
+    ESP_LOGW(TAG, "Cannot read the saved records");
+    return;
+  }
+  first = index.first;
+  count = index.count;
+  ESP_LOGI(TAG, "Restored %u records", (unsigned) count);
+}
+
+// Reminder: telemetry_ack only moves first and the records are only
+// written by telemetry_poll (excluded by ring_lock).
+static void
+save(uint32_t now)
+{
+  telemetry_index_t index;
+  xSemaphoreTake(ring_lock, portMAX_DELAY);
+  taskENTER_CRITICAL(&telemetry_mutex);
+  index = { .size = TELEMETRY_RECORDS, .first = first, .count = count };
+  taskEXIT_CRITICAL(&telemetry_mutex);
+
+  esp_err_t err = nvs_set_blob(telemetry_nvs, "ring", ring, sizeof(ring));
+  xSemaphoreGive(ring_lock);
+  if (err == ESP_OK) {
+    err = nvs_set_blob(telemetry_nvs, "index", &index, sizeof(index));
+  }
+  if (err == ESP_OK) {
+    err = nvs_commit(telemetry_nvs);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Cannot save the records (%s)", esp_err_to_name(err));
+  }
+  saved      = true;
+  saved_end  = index.first + index.count;
+  saved_time = now;
+}
+
+static void
+erase(void)
+{
+  nvs_erase_key(telemetry_nvs, "index");
+  nvs_erase_key(telemetry_nvs, "ring");
+  nvs_commit(telemetry_nvs);
+  saved = false;
+}
+
+// Save the pending records every few minutes while they cannot be published
+// and forget them once they are published. That limits the wear of the flash.
+static void
+update_flash(bool connected, uint32_t now)
+{
+  if (!nvs_ok) {
+    return;
+  }
+  taskENTER_CRITICAL(&telemetry_mutex);
+  uint32_t pending = count;
+  uint32_t end     = first + count;
+  taskEXIT_CRITICAL(&telemetry_mutex);
+
+  if (connected) {
+    if (saved && pending == 0) {
+      erase();
+    }
+  } else if (pending > 0 && end != saved_end &&
+             (!saved || now - saved_time >= CONFIG_APP_TELEMETRY_SAVE_PERIOD*60)) {
+    save(now);
+  }
+}
+
+#endif
+
+static void
+push(const telemetry_record_t &record)
+{
+  taskENTER_CRITICAL(&telemetry_mutex);
+  if (count == TELEMETRY_RECORDS) {
+    first++;
+    count--;
+    dropped++;
+  }
+  ring[(first + count) % TELEMETRY_RECORDS] = record;
+  count++;
+  taskEXIT_CRITICAL(&telemetry_mutex);
+}
+
+typedef struct {
+  uint32_t period;
+  int64_t  offset;    // From the time of the history to the Unix time (or 0)
+} poll_context_t ;
+
+static bool
+on_sample(void *arg, const history_sample_t &sample)
+{
+  const poll_context_t &ctx = *(const poll_context_t *) arg;
+  int32_t relay_power = sample.value[HISTORY_CHANNEL_relay_power];
+  uint32_t end = sample.time + ctx.period;
+
+  energy_wh += (relay_power > 0 ? relay_power : 0) * (ctx.period / 3600.0);
+
+  telemetry_record_t record = {
+    .time            = ctx.offset ? uint32_t(end + ctx.offset) : 0,
+    .available_power = sample.value[HISTORY_CHANNEL_available_power],
+    .relay_power     = relay_power,
+    .acr_ratio       = sample.value[HISTORY_CHANNEL_acr_ratio],
+    .energy_wh       = uint32_t(lround(energy_wh)),
+  };
+  push(record);
+  next_sample = end;
+  return true;
+}
+
+void
+telemetry_start(void)
+{
+#ifdef CONFIG_APP_TELEMETRY_FLASH
+  ring_lock = xSemaphoreCreateMutexStatic(&ring_lock_buffer);
+  restore();
+#endif
+}
+
+void
+telemetry_poll(bool connected)
+{
+  poll_context_t ctx = { .period = history_period(HISTORY_TIER_1M), .offset = 0 };
+  uint32_t now = history_now();
+
+#ifdef CONFIG_APP_TELEMETRY_FLASH
+  link_up = connected;
+  // Never wait for a save in progress. The records are produced by the
+  // next call instead.
+  if (xSemaphoreTake(ring_lock, 0) != pdTRUE) {
+    return;
+  }
+#endif
+
+  // The sample of a minute is available at the end of that minute
+  if (now >= next_sample + ctx.period) {
+    time_t unix_now = time(NULL);
+    if (unix_now >= TELEMETRY_MIN_TIME) {
+      ctx.offset = int64_t(unix_now) - now;
+    }
+    history_read(HISTORY_TIER_1M, next_sample, now, on_sample, &ctx);
+  }
+
+#ifdef CONFIG_APP_TELEMETRY_FLASH
+  xSemaphoreGive(ring_lock);
+#endif
+}
+
+void
+telemetry_save(void)
+{
+#ifdef CONFIG_APP_TELEMETRY_FLASH
+  update_flash(link_up, history_now());
+#endif
+}
+
+int
+telemetry_peek(telemetry_record_t records[], int max, uint32_t *next)
+{
+  taskENTER_CRITICAL(&telemetry_mutex);
+  int n = (count < uint32_t(max)) ? int(count) : max ;
+  for (int i=0; i<n; i++) {
+    records[i] = ring[(first + i) % TELEMETRY_RECORDS];
+  }
+  *next = first + n;
+  taskEXIT_CRITICAL(&telemetry_mutex);
+  return n;
+}
+
+void
+telemetry_ack(uint32_t next)
+{
+  taskENTER_CRITICAL(&telemetry_mutex);
+  // Reminder: 'first' may have moved beyond 'next' if the ring was full
+  uint32_t n = next - first;
+  if (n <= count) {
+    first += n;
+    count -= n;
+  }
+  taskEXIT_CRITICAL(&telemetry_mutex);
+}
+
+void
+telemetry_get_stats(telemetry_stats_t *stats)
+{
+  taskENTER_CRITICAL(&telemetry_mutex);
+  stats->pending = count;
+  stats->dropped = dropped;
+  taskEXIT_CRITICAL(&telemetry_mutex);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+//
+// The telemetry published on MQTT (see ui_mqtt.cc).
+//
+// A record is produced each minute from the averages of the history (see
+// history.h) with the estimated energy sent to the AC load.
+//
+// The records wait in a bounded ring until the broker acknowledges them so
+// the records produced during an outage are published when the connection
+// is back. When the ring is full, the oldest records are dropped.
+//
+// If CONFIG_APP_TELEMETRY_FLASH is set, the pending records are also saved
+// in NVS every few minutes while they cannot be published so they survive
+// a reboot (see telemetry_save).
+//
+
+typedef struct {
+  uint32_t time;             // Unix time of the end of the minute (0 if the time was not set)
+  int32_t  available_power;  // W
+  int32_t  relay_power;      // W
+  int32_t  acr_ratio;        // 1/1000
+  uint32_t energy_wh;        // Energy sent to the AC load since boot (estimated from relay_power)
+} telemetry_record_t ;
+
+typedef struct {
+  uint32_t pending;   // The number of records waiting in the ring
+  uint32_t dropped;   // The number of records dropped because the ring was full
+} telemetry_stats_t ;
+
+// Restore the saved records (if any). Shall be called once after the NVS is
+// initialized.
+void telemetry_start(void);
+
+// Produce the records of the minutes completed since the previous call.
+// 'connected' tells if the records can currently be published. Never
+// blocks.
+//
+// Shall always be called from the same task.
+void telemetry_poll(bool connected);
+
+// Save the pending records in the NVS (or erase them once published) if
+// needed. Writing the flash can take a while so that is done by the
+// application task once per minute (see APP_EVENT_MINUTE_TIC).
+void telemetry_save(void);
+
+// Copy up to 'max' of the oldest pending records and return their number.
+// '*next' receives the sequence number that follows the last copied record.
+int telemetry_peek(telemetry_record_t records[], int max, uint32_t *next);
+
+// Remove the records before the sequence number 'next' (as returned by
+// telemetry_peek) once they are published. The records that were dropped
+// in the meantime because the ring was full are taken into account.
+void telemetry_ack(uint32_t next);
+
+void telemetry_get_stats(telemetry_stats_t *stats);
@@ -1,93 +1,546 @@
 #include <math.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #include "mqtt_client.h"
-#include "cJSON.h"
 
 // Local includes
 #include "app.h"
+#include "command.h"
+#include "meter_expr.h"
+#include "latency.h"
+#include "ota.h"
+#include "telemetry.h"
 #include "ui_mqtt.h"
 
 static const char TAG[] = "ui_mqtt";
 
 #define MATCH_TOPIC(EVENT,TOPIC) ((strlen(TOPIC)==EVENT->topic_len) && memcmp(EVENT->topic,TOPIC,EVENT->topic_len)==0)
 
-#define  TOPIC_ENERGY_METER "zigbee2mqtt/energy_meter"
-
 #define QOS_0 0
 #define QOS_1 1
 #define QOS_2 2
 
+#ifdef CONFIG_APP_MQTT_PERSISTENT_SESSION
+#define MQTT_PERSISTENT_SESSION true
+#else
+#define MQTT_PERSISTENT_SESSION false
+#endif
+
+static char topic_meter[APP_METER_TOPIC_MAXLEN];
 static char *topic_set;  // "hostname"
 static char *topic_reboot;  // "hostname/reboot"
 
-static void process_energy_meter_msg(cJSON *root, esp_mqtt_client_handle_t client) {
-    
-  double power_a = cJSON_GetNumberValue( cJSON_GetObjectItemCaseSensitive(root,"power_a") ) ;
-  double power_b = cJSON_GetNumberValue( cJSON_GetObjectItemCaseSensitive(root,"power_b") ) ;
+static ui_mqtt_stats_t stats;
+static portMUX_TYPE     stats_mutex = portMUX_INITIALIZER_UNLOCKED;
+
+// The program that computes the available power (compiled once).
+static meter_expr_t meter_expr;
+
+// The keys passed to json_extract_numbers: the keys of meter_expr
+// followed by 'update_frequency'.
+static const char *meter_keys[METER_EXPR_MAX_FIELDS+1];
+static int meter_update_frequency;   // The index of 'update_frequency' in meter_keys
+
+// Return false if the expression and the default expression are both invalid.
+static bool compile_meter_expr(const char *text)
+{
+  char error[64];
+  if (!meter_expr_compile(meter_expr, text, error, sizeof(error))) {
+    // Should not happen since the expression was validated before being saved
+    ESP_LOGE(TAG, "Bad meter expression '%s': %s", text, error);
+    if (!meter_expr_compile(meter_expr, CONFIG_APP_METER_EXPR, error, sizeof(error))) {
+      ESP_LOGE(TAG, "Bad default meter expression: %s", error);
+      return false;
+    }
+  }
+  for (int i=0; i<meter_expr.nkeys; i++) {
+    meter_keys[i] = meter_expr.keys[i];
+  }
+  meter_update_frequency = meter_expr.nkeys;
+  meter_keys[meter_update_frequency] = "update_frequency";
+  return true;
+}
+
+// The message is a JSON object. Only the needed fields are extracted
+// in a single pass (see json_extract_numbers).
+//
+// 'received_us' is the time of the first fragment of the message.
+static void process_energy_meter_msg(const char *data, int len, int64_t received_us, esp_mqtt_client_handle_t client) {
+
+  double values[METER_EXPR_MAX_FIELDS+1];
+  int found = json_extract_numbers(data, len, meter_keys, meter_update_frequency+1, values);
 
-  if ( isnan(power_a) ) {
-    ESP_LOGW(TAG, "Missing or malformed 'power_a'");
+  if ( found < 0 ) {
+    ESP_LOGW(TAG, "Malformed energy meter message");
     return;
   }
 
-  if ( isnan(power_b) ) {
-    ESP_LOGW(TAG, "Missing or malformed 'power_b'");
+  double power;
+  if ( !meter_expr_eval(meter_expr, found, values, &power) ) {
+    ESP_LOGW(TAG, "Missing or malformed field in energy meter message");
     return;
   }
 
-  int available_power = power_b-power_a ;
-  app_post_auto_available_power(available_power); 
+  int available_power = lround(power) ;
+  uint32_t trace = latency_begin(received_us);
+  latency_mark(trace, LATENCY_POSTED);
+  app_post_auto_available_power(available_power, trace); 
+
+  taskENTER_CRITICAL(&stats_mutex);
+  stats.meter_messages++;
+  stats.meter_last_us = esp_timer_get_time();
+  taskEXIT_CRITICAL(&stats_mutex);
   
-  ESP_LOGI(TAG, "Energy meter: available_power = %d", available_power);
+  ESP_LOGD(TAG, "Energy meter: available_power = %d", available_power);
 
   // My energy has a tendancy to reset its update_frequency to 10s about once a day.   
-  int update_frequency = cJSON_GetNumberValue( cJSON_GetObjectItemCaseSensitive(root,"update_frequency") ) ;  
-  if (update_frequency==10) {
+  if ( (found & (1<<meter_update_frequency)) && values[meter_update_frequency] == 10 ) {
+    char topic[APP_METER_TOPIC_MAXLEN + 32];
+    snprintf(topic, sizeof(topic), "%s/set/update_frequency", topic_meter);
     ESP_LOGW(TAG, "Reset Energy Meter update frequency to 3");
-    esp_mqtt_client_publish(client, TOPIC_ENERGY_METER "/set/update_frequency" , "3", 0, QOS_0, false);
+    esp_mqtt_client_publish(client, topic, "3", 0, QOS_0, false);
   }
   
 }
 
-static void process_set_msg(cJSON *root)
+// The maximum size of a message on the 'set' topic
+#define SET_MSG_MAX_SIZE 512
+
+static bool log_output(void *ctx, const char *data, size_t size)
 {
-    
-    double frame_size   = cJSON_GetNumberValue( cJSON_GetObjectItemCaseSensitive(root,"frame_size") ) ;
-    if ( !isnan(frame_size) ) {
-      app_post_frame_size(frame_size);
+  ESP_LOGW(TAG, "%.*s", (int) size, data);
+  return true;
+}
+
+// The message is a JSON object processed by the command registry (see command.h). 
+//
+// If the message has no "action" field then it is processed as the "set"
+// action so all fields found in the message are applied at once. The MQTT
+// clients are not authenticated so the other actions are refused (see
+// CMD_MQTT).
+static void process_set_msg(const char *data, int len)
+{
+  if (len > SET_MSG_MAX_SIZE) {
+    ESP_LOGW(TAG, "Set message is too large");
+    return;
+  }
+  char text[SET_MSG_MAX_SIZE+1];
+  memcpy(text, data, len);
+  text[len] = '\0';
+
+  // Only the errors are written to the output
+  char buffer[128];
+  json_writer output(buffer, sizeof(buffer), log_output, NULL);
+
+  json_reader input;
+  if (!input.parse(text, len)) {
+    cmd_write_error(output, "Bad json");
+  } else {
+    const char *action = "set";
+    const json_field_t *item = input.find("action");
+    if (item && item->type == JSON_TYPE_STRING) {
+      action = item->str;
     }
+    // The MQTT clients are not authenticated
+    cmd_execute(action, input, output, false, false);
+  }
+  output.flush();
+}
+
+//
+// Publication of the state.
+//
+// Each field below is published as a retained message on the topic
+// "<hostname>/state/<name>" when it changes by at least DEADBAND and at
+// most once per INTERVAL milliseconds. A change that arrives too early
+// is published when the interval expires.
+//
+// The listener only records the values. The publication is done by
+// the publisher task, woken by a periodic timer, so neither the
+// application task nor the timer task is ever delayed by the MQTT client.
+//
+//   DEF_STATE(NAME, MASK, KIND, DEADBAND, INTERVAL, UNIT, DEVICE_CLASS, VALUE)
+//
+// where VALUE is an expression of 'state'. The UNIT and the DEVICE_CLASS
+// are for the Home Assistant discovery (NULL if not applicable).
+//
+#define STATE_TOPICS \
+  DEF_STATE("mode",            stf::mode,                 STATE_MODE,  0,     0,     NULL, NULL,    state.mode)               \
+  DEF_STATE("relay_ratio",     stf::relay_ratio,          STATE_RATIO, 0.01,  5000,  NULL, NULL,    state.relay.ratio)        \
+  DEF_STATE("relay_power",     stf::relay_power,          STATE_INT,   10,    5000,  "W",  "power", state.relay.power)        \
+  DEF_STATE("available_power", stf::auto_available_power, STATE_INT,   20,    10000, "W",  "power", state.a.available_power)  \
+  DEF_STATE("full_power",      stf::full_power,           STATE_INT,   0,     0,     "W",  "power", state.full_power)         \
+  DEF_STATE("manual_power",    stf::manual_power,         STATE_INT,   0,     0,     "W",  "power", state.m.power)            \
+  DEF_STATE("auto_over_power", stf::auto_over_power,      STATE_INT,   0,     0,     "W",  "power", state.a.over_power)       \
+  DEF_STATE("auto_min_power",  stf::auto_min_power,       STATE_INT,   0,     0,     "W",  "power", state.a.min_power)        \
+  DEF_STATE("frame_size",      stf::frame_size,           STATE_INT,   0,     0,     NULL, NULL,    state.frame_size)         \
+
+typedef enum {
+  STATE_INT,
+  STATE_RATIO,
+  STATE_MODE,
+} state_kind_t ;
+
+typedef struct {
+  const char   *name;
+  stf::mask_t   mask;
+  state_kind_t  kind;
+  double        deadband;
+  int64_t       interval_us;
+  const char   *unit;
+  const char   *device_class;
+} state_topic_t ;
+
+static const state_topic_t state_topics[] = {
+#define DEF_STATE(NAME, MASK, KIND, DEADBAND, INTERVAL, UNIT, DEVICE_CLASS, VALUE) \
+  { NAME, MASK, KIND, DEADBAND, (INTERVAL)*1000LL, UNIT, DEVICE_CLASS },
+  STATE_TOPICS
+#undef DEF_STATE
+};
+
+constexpr int state_topic_count = sizeof(state_topics)/sizeof(state_topics[0]);
+
+// The publication period of the state
+#define STATE_TIMER_PERIOD_MS 500
+
+// The publisher task formats the discovery messages and the telemetry
+// batches on its stack and may wait for the lock of the MQTT client.
+#define PUBLISHER_TASK_STACK_SIZE 4096
+#define PUBLISHER_TASK_PRIORITY   5
+
+static esp_mqtt_client_handle_t mqtt_client = NULL;
+
+static struct {
+  double   latest[state_topic_count];     // The latest value (written by the listener)
+  double   published[state_topic_count];  // The last published value
+  int64_t  published_us[state_topic_count];
+  uint32_t force;          // A bit per topic that must be published regardless of the deadband
+  bool     connected;
+  bool     discovery;      // The discovery messages must be published
+  int      telemetry_msg_id;   // The message of the telemetry batch in flight (0 if none)
+  uint32_t telemetry_next;     // See telemetry_peek()
+} pub ;
+
+static portMUX_TYPE pub_mutex = portMUX_INITIALIZER_UNLOCKED;
+
+static_assert(state_topic_count <= 32, "pub.force is too small");
+
+// The topics and the payloads are formatted in those buffers. The state
+// topics share the prefix "<hostname>/state/" which is written only once.
+// Only used by the publisher task.
+static char   state_topic[APP_HOSTNAME_MAXLEN + 32];
+static size_t state_topic_prefix_len;
+static char   status_topic[APP_HOSTNAME_MAXLEN + 16];
+static char   hostname[APP_HOSTNAME_MAXLEN + 1];
+static char   telemetry_topic[APP_HOSTNAME_MAXLEN + 16];
+
+#define DISCOVERY_TOPIC_PREFIX "homeassistant/sensor"
 
-    double full_power   = cJSON_GetNumberValue( cJSON_GetObjectItemCaseSensitive(root,"full_power") ) ;
-    if ( !isnan(full_power) ) {
-      app_post_full_power(full_power);
+static void state_listener(stf::mask_t mask, const app_state_t &state)
+{
+  taskENTER_CRITICAL(&pub_mutex);
+  int i=0;
+#define DEF_STATE(NAME, MASK, KIND, DEADBAND, INTERVAL, UNIT, DEVICE_CLASS, VALUE) \
+  if (mask & (MASK)) {                                                             \
+    pub.latest[i] = (VALUE);                                                       \
+  }                                                                                \
+  i++;
+  STATE_TOPICS
+#undef DEF_STATE
+  taskEXIT_CRITICAL(&pub_mutex);
+}
+
+static int format_state(char *payload, size_t size, state_kind_t kind, double value)
+{
+  switch (kind) {
+    case STATE_MODE:
+      return snprintf(payload, size, "%s", (value == AC_MODE_AUTO) ? "auto" : "manual");
+    case STATE_RATIO:
+      return snprintf(payload, size, "%.3f", value);
+    case STATE_INT:
+    default:
+      return snprintf(payload, size, "%ld", (long) lround(value));
+  }
+}
+
+static bool write_buffer(void *ctx, const char *data, size_t size)
+{
+  return false;  // The discovery messages must fit in the buffer
+}
+
+// Publish the Home Assistant discovery messages
+static void publish_discovery(void)
+{
+  char topic[sizeof(DISCOVERY_TOPIC_PREFIX) + APP_HOSTNAME_MAXLEN + 32];
+  char payload[512];
+
+  for (int i=0; i<state_topic_count; i++) {
+    const state_topic_t &st = state_topics[i];
+    char unique_id[APP_HOSTNAME_MAXLEN + 32];
+    char name[32];
+    snprintf(unique_id, sizeof(unique_id), "%s_%s", hostname, st.name);
+    strlcpy(name, st.name, sizeof(name));
+    for (char *p=name; *p; p++) {
+      if (*p == '_') *p = ' ';
     }
+    strcpy(state_topic + state_topic_prefix_len, st.name);
 
-    double manual_power = cJSON_GetNumberValue( cJSON_GetObjectItemCaseSensitive(root,"manual_power") ) ;
-    if ( !isnan(manual_power) ) {
-      app_post_manual_power(manual_power);
+    json_writer out(payload, sizeof(payload), write_buffer, NULL);
+    out.begin_object();
+    out.add_string("name", name);
+    out.add_string("unique_id", unique_id);
+    out.add_string("state_topic", state_topic);
+    out.add_string("availability_topic", status_topic);
+    if (st.unit) {
+      out.add_string("unit_of_measurement", st.unit);
+      out.add_string("state_class", "measurement");
+    }
+    if (st.device_class) {
+      out.add_string("device_class", st.device_class);
     }
-    
-    double auto_min_power  = cJSON_GetNumberValue( cJSON_GetObjectItemCaseSensitive(root,"auto_min_power") ) ;
-    if ( !isnan(auto_min_power) ) {
-      app_post_auto_min_power(auto_min_power);
+    out.begin_object("device");
+    out.begin_array("identifiers");
+    out.add_string(NULL, hostname);
+    out.end_array();
+    out.add_string("name", hostname);
+    out.add_string("manufacturer", "cumulus");
+    out.end_object();
+    out.end_object();
+    if (!out.ok()) {
+      ESP_LOGE(TAG, "Discovery message too large for '%s'", st.name);
+      continue;
     }
 
-    double auto_over_power = cJSON_GetNumberValue( cJSON_GetObjectItemCaseSensitive(root,"auto_over_power") ) ;
-    if ( !isnan(auto_over_power) ) {
-      app_post_auto_over_power(auto_over_power);
+    snprintf(topic, sizeof(topic), DISCOVERY_TOPIC_PREFIX "/%s/%s/config", hostname, st.name);
+    esp_mqtt_client_enqueue(mqtt_client, topic, payload, out.count(), QOS_1, true, true);
+  }
+}
+
+//
+// The telemetry records (see telemetry.h) are published on the topic
+// "<hostname>/telemetry" as JSON arrays of up to TELEMETRY_BATCH records.
+// A batch is removed from the ring when the broker acknowledges it (see
+// MQTT_EVENT_PUBLISHED) and only one batch is in flight at a time. After
+// an outage, the ring is thus replayed at one batch per publication period.
+//
+// The batch in flight is kept across a disconnection: the outbox of the
+// MQTT client sends it again after the reconnection. It is only sent again
+// by us if the outbox gives up on it (see MQTT_EVENT_DELETED).
+//
+#define TELEMETRY_BATCH 8
+
+static void publish_telemetry(void)
+{
+  static char payload[TELEMETRY_BATCH * 128];   // Only used by the publisher task
+
+  taskENTER_CRITICAL(&pub_mutex);
+  bool busy = (pub.telemetry_msg_id != 0);
+  taskEXIT_CRITICAL(&pub_mutex);
+  if (busy) {
+    return;
+  }
+
+  telemetry_record_t records[TELEMETRY_BATCH];
+  uint32_t next;
+  int n = telemetry_peek(records, TELEMETRY_BATCH, &next);
+  if (n == 0) {
+    return;
+  }
+
+  json_writer out(payload, sizeof(payload), write_buffer, NULL);
+  out.begin_array();
+  for (int i=0; i<n; i++) {
+    const telemetry_record_t &r = records[i];
+    out.begin_object();
+    out.add_double("time", r.time);   // Reminder: 'long' has only 32 bits
+    out.add_int("available_power", r.available_power);
+    out.add_int("relay_power", r.relay_power);
+    out.add_double("acr_ratio", r.acr_ratio / 1000.0);
+    out.add_double("energy_wh", r.energy_wh);
+    out.end_object();
+  }
+  out.end_array();
+  if (!out.ok()) {
+    ESP_LOGE(TAG, "Telemetry batch too large");
+    return;
+  }
+
+  // Reminder: the message is only sent by the MQTT task so the
+  // acknowledgment cannot arrive before msg_id is recorded.
+  int msg_id = esp_mqtt_client_enqueue(mqtt_client, telemetry_topic, payload, out.count(), QOS_1, false, true);
+  if (msg_id <= 0) {
+    return;   // Retry later
+  }
+  taskENTER_CRITICAL(&pub_mutex);
+  pub.telemetry_msg_id = msg_id;
+  pub.telemetry_next   = next;
+  taskEXIT_CRITICAL(&pub_mutex);
+}
+
+static void publish_state(void)
+{
+  double   latest[state_topic_count];
+  uint32_t force;
+  bool     discovery;
+
+  taskENTER_CRITICAL(&pub_mutex);
+  bool connected = pub.connected;
+  taskEXIT_CRITICAL(&pub_mutex);
+
+  // The telemetry is also produced while disconnected
+  telemetry_poll(connected);
+  if (!connected) {
+    return;
+  }
+  publish_telemetry();
+
+  taskENTER_CRITICAL(&pub_mutex);
+  memcpy(latest, pub.latest, sizeof(latest));
+  force = pub.force;
+  pub.force = 0;
+  discovery = pub.discovery;
+  pub.discovery = false;
+  taskEXIT_CRITICAL(&pub_mutex);
+
+  if (discovery) {
+    publish_discovery();
+    esp_mqtt_client_enqueue(mqtt_client, status_topic, "online", 0, QOS_1, true, true);
+  }
+
+  // The publisher task is the only user of pub.published and pub.published_us
+  int64_t now = esp_timer_get_time();
+  char payload[32];
+  for (int i=0; i<state_topic_count; i++) {
+    const state_topic_t &st = state_topics[i];
+    bool forced = force & (1<<i) ;
+    if (!forced) {
+      if (latest[i] == pub.published[i] || fabs(latest[i] - pub.published[i]) < st.deadband) {
+        continue;
+      }
+      if (now - pub.published_us[i] < st.interval_us) {
+        continue;   // Too early. Retry later.
+      }
     }
+    int len = format_state(payload, sizeof(payload), st.kind, latest[i]);
+    strcpy(state_topic + state_topic_prefix_len, st.name);
+    if (esp_mqtt_client_enqueue(mqtt_client, state_topic, payload, len, QOS_0, true, true) < 0) {
+      continue;   // Retry later
+    }
+    pub.published[i]    = latest[i];
+    pub.published_us[i] = now;
+  }
+}
+
+static TaskHandle_t publisher_task_handle = NULL;
+
+static void publisher_task(void *arg)
+{
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    publish_state();
+  }
+}
+
+// Runs in the esp_timer task: only wake the publisher
+static void state_timer_callback(void *arg)
+{
+  xTaskNotifyGive(publisher_task_handle);
+}
+
+// The topics of the received messages
+typedef enum {
+  MSG_NONE,       // Unknown topic or dropped message
+  MSG_METER,
+  MSG_SET,
+  MSG_REBOOT,
+} msg_kind_t ;
+
+// The maximum size of a reassembled message (any topic)
+#define MSG_MAX_SIZE 1024
+
+// A message larger than the input buffer of the MQTT client is received in
+// several MQTT_EVENT_DATA events. Only the first one has the topic. 
+//
+// The fragments are accumulated in a fixed buffer. Reminder: the events
+// are all processed by the MQTT task so there is a single message in
+// progress at a time.
+static struct {
+  msg_kind_t kind;
+  int        total;     // The expected size
+  int        received;
+  int64_t    received_us;  // The time of the first fragment
+  char       data[MSG_MAX_SIZE];
+} reassembly = { .kind = MSG_NONE } ;
+
+static msg_kind_t get_msg_kind(esp_mqtt_event_handle_t event)
+{
+  if (MATCH_TOPIC(event,topic_meter)) {
+    return MSG_METER;
+  } else if (MATCH_TOPIC(event,topic_set)) {
+    return MSG_SET;
+  } else if (MATCH_TOPIC(event,topic_reboot)) {
+    return MSG_REBOOT;
+  }
+  return MSG_NONE;
+}
+
+static void process_msg(msg_kind_t kind, const char *data, int len, int64_t received_us, esp_mqtt_client_handle_t client)
+{
+  switch (kind) {
+    case MSG_METER:
+      process_energy_meter_msg(data, len, received_us, client);
+      break;
+    case MSG_SET:
+      process_set_msg(data, len);
+      break;
+    case MSG_REBOOT:
+      ota_reboot();   // Delayed so that the message is acknowledged first
+      break;
+    case MSG_NONE:
+      break;
+  }
+}
 
-    const char * mode   = cJSON_GetStringValue( cJSON_GetObjectItemCaseSensitive(root,"mode") ) ;
-    if (mode) {
-      if (!strcmp(mode,"auto"))
-        app_post_mode(AC_MODE_AUTO);
-      else if (!strcmp(mode,"manual"))
-        app_post_mode(AC_MODE_MANUAL);
+static void process_data_event(esp_mqtt_event_handle_t event)
+{
+  int64_t now = esp_timer_get_time();
+
+  // The usual case: a complete message. No copy is needed.
+  if (event->current_data_offset == 0 && event->data_len == event->total_data_len) {
+    reassembly.kind = MSG_NONE;
+    process_msg(get_msg_kind(event), event->data, event->data_len, now, event->client);
+    return;
+  }
+
+  if (event->current_data_offset == 0) {
+    reassembly.kind     = get_msg_kind(event);
+    reassembly.total    = event->total_data_len;
+    reassembly.received = 0;
+    reassembly.received_us = now;
+    if (reassembly.kind != MSG_NONE && reassembly.total > MSG_MAX_SIZE) {
+      ESP_LOGW(TAG, "Dropped a message of %d bytes on '%.*s'", reassembly.total, event->topic_len, event->topic);
+      reassembly.kind = MSG_NONE;
     }
-    
+  }
+  if (reassembly.kind == MSG_NONE) {
+    return;
+  }
+  if (event->current_data_offset != reassembly.received ||
+      reassembly.received + event->data_len > reassembly.total) {
+    ESP_LOGW(TAG, "Unexpected message fragment");
+    reassembly.kind = MSG_NONE;
+    return;
+  }
+  memcpy(reassembly.data + reassembly.received, event->data, event->data_len);
+  reassembly.received += event->data_len;
+  if (reassembly.received == reassembly.total) {
+    process_msg(reassembly.kind, reassembly.data, reassembly.total, reassembly.received_us, event->client);
+    reassembly.kind = MSG_NONE;
+  }
 }
 
 static void log_error_if_nonzero(const char *message, int error_code)
@@ -121,19 +574,34 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
       ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
       //msg_id = esp_mqtt_client_publish(client, "/topic/qos1", "data_3", 0, 1, 0);
       //ESP_LOGI(TAG, "sent publish successful, msg_id=%d", msg_id);
-      const char * topic;
-      
-      topic = TOPIC_ENERGY_METER ;
-      msg_id = esp_mqtt_client_subscribe(client, topic, 1);
-      ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d  topic='%s'", msg_id, topic);
-      
-      topic = topic_set ;
-      msg_id = esp_mqtt_client_subscribe(client, topic, 1);
-      ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d  topic='%s'", msg_id, topic);
-      
-      topic = topic_reboot;          
-      msg_id = esp_mqtt_client_subscribe(client, topic, 1);
-      ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d  topic='%s'", msg_id, topic);
+      ESP_LOGI(TAG, "session_present=%d", event->session_present);
+
+      // All topics are subscribed with a single SUBSCRIBE. That is also
+      // done when the broker kept the session because the meter topic may
+      // have changed since the previous connection.
+      //
+      // The commands use QoS 1 so the broker keeps them for us during an
+      // outage (with a persistent session). The meter messages use QoS 0
+      // because an old meter reading is useless. The reboot also uses QoS 0:
+      // with QoS 1, the restart could happen before the PUBACK is sent and
+      // the broker would deliver the reboot again after each reconnection.
+      esp_mqtt_topic_t topics[3];
+      int count = 0;
+      if (topic_meter[0]) {
+        topics[count++] = { .filter = topic_meter, .qos = QOS_0 };
+      }
+      topics[count++] = { .filter = topic_set,    .qos = QOS_1 };
+      topics[count++] = { .filter = topic_reboot, .qos = QOS_0 };
+      msg_id = esp_mqtt_client_subscribe_multiple(client, topics, count);
+      ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d  topics=%d", msg_id, count);
+
+      // Publish everything again (see publish_state)
+      taskENTER_CRITICAL(&pub_mutex);
+      pub.connected = true;
+      pub.discovery = true;
+      pub.force = (state_topic_count < 32) ? (1u<<state_topic_count)-1 : ~0u ;
+      taskEXIT_CRITICAL(&pub_mutex);
+      ota_set_health(OTA_HEALTH_MQTT, true);
     }      
     //msg_id = esp_mqtt_client_unsubscribe(client, "/topic/qos1");
     //ESP_LOGI(TAG, "sent unsubscribe successful, msg_id=%d", msg_id);
@@ -141,6 +609,10 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        taskENTER_CRITICAL(&pub_mutex);
+        pub.connected = false;
+        taskEXIT_CRITICAL(&pub_mutex);
+        ota_set_health(OTA_HEALTH_MQTT, false);
         break;
 
     case MQTT_EVENT_SUBSCRIBED:
@@ -152,22 +624,37 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
       ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
       break;
     case MQTT_EVENT_PUBLISHED:
-      ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+    {
+      ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+      bool acked = false;
+      uint32_t next = 0;
+      taskENTER_CRITICAL(&pub_mutex);
+      if (pub.telemetry_msg_id != 0 && event->msg_id == pub.telemetry_msg_id) {
+        acked = true;
+        next  = pub.telemetry_next;
+        pub.telemetry_msg_id = 0;
+      }
+      taskEXIT_CRITICAL(&pub_mutex);
+      if (acked) {
+        telemetry_ack(next);
+      }
+    }
+      break;
+
+    case MQTT_EVENT_DELETED:
+      // The outbox expired a message. If that is the telemetry batch, its
+      // records are still in the ring and will be part of the next batch.
+      ESP_LOGW(TAG, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
+      taskENTER_CRITICAL(&pub_mutex);
+      if (pub.telemetry_msg_id != 0 && event->msg_id == pub.telemetry_msg_id) {
+        pub.telemetry_msg_id = 0;
+      }
+      taskEXIT_CRITICAL(&pub_mutex);
       break;
 
     case MQTT_EVENT_DATA:
       //ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-      if (MATCH_TOPIC(event,TOPIC_ENERGY_METER)) {
-        cJSON *root = cJSON_Parse(event->data);
-        process_energy_meter_msg(root, client) ;
-        cJSON_Delete(root);
-      } else if (MATCH_TOPIC(event,topic_set)) {
-        cJSON *root = cJSON_Parse(event->data);
-        process_set_msg(root) ;
-        cJSON_Delete(root);
-      } else if (MATCH_TOPIC(event,topic_reboot)) {
-        app_post_reboot();
-      }
+      process_data_event(event);
       break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -185,10 +672,39 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 }
 
 
-void ui_mqtt_start(const char *uri, const char *hostname)
+void ui_mqtt_start(const app_state_t &state)
 {
+  const char *uri = state.mqtt.uri.data;
+  strlcpy(hostname, state.hostname.data, sizeof(hostname));
+
+  // The meter settings take effect after a reboot
+  // An empty topic is never subscribed.
+  if (compile_meter_expr(state.mqtt.meter_expr.data)) {
+    strlcpy(topic_meter, state.mqtt.meter_topic.data, sizeof(topic_meter));
+  }
+  ESP_LOGI(TAG, "Energy meter: topic='%s' available_power='%s'", topic_meter, state.mqtt.meter_expr.data);
+
   asprintf(&topic_set,"%s/set",hostname);
   asprintf(&topic_reboot,"%s/reboot",hostname);
+
+  snprintf(status_topic, sizeof(status_topic), "%s/status", hostname);
+  snprintf(telemetry_topic, sizeof(telemetry_topic), "%s/telemetry", hostname);
+
+  telemetry_start();
+  state_topic_prefix_len = snprintf(state_topic, sizeof(state_topic), "%s/state/", hostname);
+
+  state_listener(stf::all, state);
+  app_add_listener(state_listener);
+
+  xTaskCreate(publisher_task, "mqtt_pub", PUBLISHER_TASK_STACK_SIZE, NULL, PUBLISHER_TASK_PRIORITY, &publisher_task_handle);
+
+  esp_timer_handle_t state_timer;
+  const esp_timer_create_args_t state_timer_args = {
+    .callback = state_timer_callback,
+    .name = "mqtt_state"
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&state_timer_args, &state_timer));
+  ESP_ERROR_CHECK(esp_timer_start_periodic(state_timer, STATE_TIMER_PERIOD_MS*1000));
   
   // Warning: LWIP DNS is only using mDNS to resolve hostnames that end with '.local'
   //          so that won't work if your '.local' hostnames are manually configured.
@@ -201,13 +717,32 @@ void ui_mqtt_start(const char *uri, const char *hostname)
       .address = {
         .uri = uri, 
       }
+    },
+    .session = {
+      // The default client id is derived from the MAC address so it is
+      // stable and the broker can resume the session.
+      .disable_clean_session = MQTT_PERSISTENT_SESSION,
+      // The broker publishes "offline" on our behalf if the connection is lost
+      .last_will = {
+        .topic = status_topic,
+        .msg = "offline",
+        .qos = QOS_1,
+        .retain = true,
+      }
     }
   };
   ESP_LOGI(TAG, "MQTT URI: %s", mqtt_cfg.broker.address.uri);
   
-  esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
+  mqtt_client = esp_mqtt_client_init(&mqtt_cfg);
   /* The last argument may be used to pass data to the event handler, in this example mqtt_event_handler */
-  esp_mqtt_client_register_event(client, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
-  esp_mqtt_client_start(client);
+  esp_mqtt_client_register_event(mqtt_client, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
+  esp_mqtt_client_start(mqtt_client);
 }
 
+
+void ui_mqtt_get_stats(ui_mqtt_stats_t *out)
+{
+  taskENTER_CRITICAL(&stats_mutex);
+  *out = stats;
+  taskEXIT_CRITICAL(&stats_mutex);
+}
@@ -1,4 +1,16 @@
 
 #pragma once
 
-void ui_mqtt_start(const char *mqtt_uri, const char *hostname);
+#include <stdint.h>
+
+#include "app.h"
+
+// Start the MQTT client with the broker URI and the hostname of the state.
+void ui_mqtt_start(const app_state_t &state);
+
+typedef struct {
+  uint32_t meter_messages;  // The number of valid energy meter messages
+  int64_t  meter_last_us;   // esp_timer_get_time() at the last one or 0
+} ui_mqtt_stats_t ;
+
+void ui_mqtt_get_stats(ui_mqtt_stats_t *stats);
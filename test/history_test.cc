@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "esp_timer.h"
+#include "app.h"
+#include "acr.h"
+#include "history.h"
+#include "test.h"
+
+//
+// Tests of the history (see history.h). The sampling timer, the state
+// listener and the AC relay are simulated so each call of tick() is one
+// second of history.
+//
+
+static esp_timer_cb_t timer_callback = NULL;
+static app_listener_t listener = NULL;
+static double         achieved_ratio = 0;
+
+int64_t
+esp_timer_get_time(void)
+{
+  return 0;
+}
+
+esp_err_t
+esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *handle)
+{
+  timer_callback = args->callback;
+  *handle = NULL;
+  return ESP_OK;
+}
+
+esp_err_t
+esp_timer_start_periodic(esp_timer_handle_t, uint64_t period_us)
+{
+  CHECK(period_us == 1000*1000);
+  return ESP_OK;
+}
+
+void
+app_add_listener(app_listener_t fn)
+{
+  listener = fn;
+}
+
+double
+acr_get_last_achieved_ratio()
+{
+  return achieved_ratio;
+}
+
+typedef struct {
+  int32_t value[HISTORY_CHANNEL_COUNT];
+} values_t ;
+
+// All the samples given to the history, indexed by time
+static std::vector<values_t> truth;
+
+// Give one second of samples to the history
+static void
+tick(const values_t &v)
+{
+  app_state_t state = {};
+  state.a.available_power = v.value[HISTORY_CHANNEL_available_power];
+  state.relay.power       = v.value[HISTORY_CHANNEL_relay_power];
+  listener(stf::auto_available_power|stf::relay_power, state);
+  achieved_ratio = v.value[HISTORY_CHANNEL_acr_ratio] / 1000.0;
+  timer_callback(NULL);
+  truth.push_back(v);
+}
+
+// A signal with small variations and a few large jumps of both signs
+// (so the varints take from 1 to 5 bytes)
+static values_t
+signal(uint32_t t)
+{
+  values_t v;
+  v.value[HISTORY_CHANNEL_available_power] = (t % 1013 == 0) ? -300000000 : (t % 97 == 0) ? 250000 : int32_t(t % 50) - 1500;
+  v.value[HISTORY_CHANNEL_relay_power]     = (t / 30) % 3000;
+  v.value[HISTORY_CHANNEL_acr_ratio]       = (t * 37) % 1001;
+  return v;
+}
+
+// The same rounding as the history (to the nearest, half away from zero)
+static int32_t
+average(int64_t sum, int64_t count)
+{
+  return (sum >= 0) ? int32_t((sum + count/2) / count) : -int32_t((-sum + count/2) / count);
+}
+
+// The expected samples of each tier, indexed by time/period
+static std::vector<values_t> expected[HISTORY_TIER_COUNT];
+
+static void
+compute_expected(void)
+{
+  expected[HISTORY_TIER_1S] = truth;
+  for (int t=1; t<HISTORY_TIER_COUNT; t++) {
+    const std::vector<values_t> &src = expected[t-1];
+    uint32_t n = history_period(history_tier_t(t)) / history_period(history_tier_t(t-1));
+    expected[t].clear();
+    for (size_t k=0; k+n <= src.size(); k+=n) {
+      values_t avg;
+      for (int c=0; c<HISTORY_CHANNEL_COUNT; c++) {
+        int64_t sum = 0;
+        for (uint32_t i=0; i<n; i++) {
+          sum += src[k+i].value[c];
+        }
+        avg.value[c] = average(sum, n);
+      }
+      expected[t].push_back(avg);
+    }
+  }
+}
+
+typedef struct {
+  history_tier_t tier;
+  uint32_t first;    // The time of the first sample read
+  uint32_t next;     // The expected time of the next sample
+  uint32_t count;
+  uint32_t stop;     // Stop after that number of samples (or 0)
+} read_context_t ;
+
+// Check each sample against the expected ones
+static bool
+on_sample(void *arg, const history_sample_t &sample)
+{
+  read_context_t &ctx = *(read_context_t *) arg;
+  uint32_t period = history_period(ctx.tier);
+  if (ctx.count == 0) {
+    ctx.first = sample.time;
+  } else {
+    CHECK(sample.time == ctx.next);   // No hole and in chronological order
+  }
+  CHECK(sample.time % period == 0);
+  const std::vector<values_t> &e = expected[ctx.tier];
+  CHECK(sample.time / period < e.size());
+  for (int c=0; c<HISTORY_CHANNEL_COUNT; c++) {
+    CHECK(sample.value[c] == e[sample.time / period].value[c]);
+  }
+  ctx.next = sample.time + period;
+  ctx.count++;
+  return ctx.stop == 0 || ctx.count < ctx.stop;
+}
+
+static read_context_t
+read_tier(history_tier_t tier, uint32_t from, uint32_t to)
+{
+  read_context_t ctx = { .tier = tier, .first = 0, .next = 0, .count = 0, .stop = 0 };
+  CHECK(history_read(tier, from, to, on_sample, &ctx));
+  return ctx;
+}
+
+// Run the history for 'seconds' and check that each tier ends with the
+// last complete sample.
+static void
+run(uint32_t seconds)
+{
+  uint32_t start = truth.size();
+  for (uint32_t t=start; t<start+seconds; t++) {
+    tick(signal(t));
+  }
+  CHECK(history_now() == truth.size());
+  compute_expected();
+
+  for (int t=0; t<HISTORY_TIER_COUNT; t++) {
+    history_tier_t tier = history_tier_t(t);
+    read_context_t ctx = read_tier(tier, 0, history_now());
+    CHECK(ctx.count > 0 || expected[t].empty());
+    CHECK(ctx.count == 0 || ctx.next / history_period(tier) == expected[t].size());
+  }
+}
+
+static void
+test_first_minutes(void)
+{
+  run(5*60);
+  // Nothing was dropped yet
+  for (int t=0; t<HISTORY_TIER_15M; t++) {
+    read_context_t ctx = read_tier(history_tier_t(t), 0, history_now());
+    CHECK(ctx.first == 0);
+  }
+  CHECK(expected[HISTORY_TIER_1M].size() == 5);
+  CHECK(read_tier(HISTORY_TIER_15M, 0, history_now()).count == 0);
+  CHECK(history_oldest(HISTORY_TIER_1S) == 0);
+  CHECK(history_oldest(HISTORY_TIER_1M) == 0);
+  CHECK(history_oldest(HISTORY_TIER_15M) == UINT32_MAX);
+
+  // A window and an early stop
+  read_context_t ctx = read_tier(HISTORY_TIER_1S, 100, 159);
+  CHECK(ctx.first == 100 && ctx.count == 60);
+  ctx = read_tier(HISTORY_TIER_1M, 61, 179);
+  CHECK(ctx.first == 120 && ctx.count == 1);
+  read_context_t stopped = { .tier = HISTORY_TIER_1S, .first = 0, .next = 0, .count = 0, .stop = 10 };
+  CHECK(!history_read(HISTORY_TIER_1S, 0, history_now(), on_sample, &stopped));
+  CHECK(stopped.count == 10);
+}
+
+// The oldest blocks of a tier are dropped once its ring is full
+static void
+test_rollover(void)
+{
+  static const uint32_t retention[HISTORY_TIER_COUNT] = { 10*60, 24*60*60, 30*24*60*60 };
+
+  run(45*24*3600 - history_now());
+  for (int t=0; t<HISTORY_TIER_COUNT; t++) {
+    history_tier_t tier = history_tier_t(t);
+    read_context_t ctx = read_tier(tier, 0, history_now());
+    printf("history: tier %d keeps %u samples (%u s)\n", t, (unsigned) ctx.count,
+           (unsigned) (ctx.next - ctx.first));
+    CHECK(ctx.first > 0);
+    CHECK(history_oldest(tier) == ctx.first);
+    // The retention is approximate (the large jumps take more space)
+    CHECK(ctx.next - ctx.first >= retention[t] / 2);
+    CHECK(ctx.next - ctx.first <= retention[t] * 2);
+  }
+}
+
+int
+main(void)
+{
+  app_state_t state = {};
+  history_start(state);
+  CHECK(timer_callback != NULL && listener != NULL);
+
+  test_first_minutes();
+  test_rollover();
+  return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_reader.h"
+#include "test.h"
+
+#ifdef HAVE_CJSON
+#include "cJSON.h"
+#endif
+
+//
+// Benchmark of json_extract_numbers on a typical message of the energy
+// meter (see process_energy_meter_msg in ui_mqtt.cc) compared with
+// json_reader and cJSON (when available, see CJSON_DIR in CMakeLists.txt).
+//
+//   json_extract_bench [SECONDS]
+//
+
+// A message of a Zigbee energy meter as published by zigbee2mqtt. The
+// message is not terminated in the MQTT buffer.
+static const char message[] =
+  "{\"ac_frequency\":50.02,\"current_a\":1.23,\"current_b\":4.56,\"energy_a\":1234.56,"
+  "\"energy_b\":2345.67,\"energy_flow_a\":\"consuming\",\"energy_flow_b\":\"producing\","
+  "\"energy_produced_a\":12.34,\"energy_produced_b\":3456.78,\"linkquality\":156,"
+  "\"power_a\":285,\"power_b\":-1520,\"power_factor_a\":0.98,\"power_factor_b\":0.97,"
+  "\"update_frequency\":3,\"voltage\":231.4}";
+
+static const char * const keys[] = { "power_a", "power_b", "update_frequency" };
+
+#define NKEYS int(sizeof(keys)/sizeof(keys[0]))
+
+// Prevent the compiler from removing the extraction
+static volatile double sink;
+
+static void
+extract_numbers(const char *data, size_t size)
+{
+  double values[NKEYS];
+  int found = json_extract_numbers(data, size, keys, NKEYS, values);
+  CHECK(found == 7);
+  sink = values[1] - values[0] + values[2];
+}
+
+static void
+extract_json_reader(const char *data, size_t size)
+{
+  char buffer[sizeof(message)];
+  memcpy(buffer, data, size);   // A copy is needed for the '\0' and the in place parsing
+  buffer[size] = '\0';
+  json_reader reader;
+  CHECK(reader.parse(buffer, size));
+  // Reminder: the message has 16 fields (JSON_READER_MAX_FIELDS)
+  sink = reader.find("power_b")->number - reader.find("power_a")->number
+       + reader.find("update_frequency")->number;
+}
+
+#ifdef HAVE_CJSON
+static void
+extract_cjson(const char *data, size_t size)
+{
+  cJSON *root = cJSON_ParseWithLength(data, size);
+  CHECK(root != NULL);
+  sink = cJSON_GetObjectItem(root, "power_b")->valuedouble - cJSON_GetObjectItem(root, "power_a")->valuedouble
+       + cJSON_GetObjectItem(root, "update_frequency")->valuedouble;
+  cJSON_Delete(root);
+}
+#endif
+
+typedef void (*extract_fn_t)(const char *data, size_t size);
+
+// Return the number of allocations per message
+static double
+bench(const char *name, extract_fn_t fn, double duration)
+{
+  size_t size = sizeof(message) - 1;
+  long count = 0;
+  size_t allocations = test_allocations();
+  double start = test_now();
+  double elapsed;
+  do {
+    for (int i=0; i<1000; i++) {
+      fn(message, size);
+    }
+    count += 1000;
+    elapsed = test_now() - start;
+  } while (elapsed < duration);
+  allocations = test_allocations() - allocations;
+
+  printf("%-20s %6.0f ns/message, %6.1f MB/s, %5.1f allocations/message\n",
+         name, elapsed / count * 1e9, size * count / elapsed / 1e6, double(allocations) / count);
+  return double(allocations) / count;
+}
+
+int
+main(int argc, char *argv[])
+{
+  double duration = (argc > 1) ? atof(argv[1]) : 0.2;
+
+  printf("Message of %zu bytes\n", sizeof(message) - 1);
+  CHECK(bench("json_extract_numbers", extract_numbers, duration) == 0);
+  CHECK(bench("json_reader", extract_json_reader, duration) == 0);
+#ifdef HAVE_CJSON
+  bench("cJSON", extract_cjson, duration);
+#else
+  printf("cJSON                not found (see CJSON_DIR)\n");
+#endif
+  return 0;
+}
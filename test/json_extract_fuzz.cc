@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "json_reader.h"
+#include "json_gen.h"
+#include "test.h"
+
+//
+// Fuzz tests of json_extract_numbers (see json_reader.h).
+//
+//   json_extract_fuzz [ITERATIONS [SEED]]
+//
+// 1. Random valid objects (see json_gen.h) whose keys are partly taken from
+//    the extracted keys are generated and the result is compared with the
+//    expected members.
+// 2. The same texts are mutated and scanned from an exact-size copy without
+//    a trailing '\0'. json_reader is used as an oracle: the extraction must
+//    succeed when the reader accepts the text.
+//
+
+static const char * const keys[] = {
+  "power_a", "power_b", "update_frequency", "p", "energy"
+};
+
+#define NKEYS int(sizeof(keys)/sizeof(keys[0]))
+
+// Scan a copy of 'text' of the exact size so the sanitizers catch an
+// access beyond it.
+static int
+extract_copy(const std::string &text, double values[])
+{
+  std::vector<char> copy(text.begin(), text.end());
+  copy.shrink_to_fit();
+  for (int i=0; i<NKEYS; i++) {
+    values[i] = -1;
+  }
+  int found = json_extract_numbers(copy.data(), copy.size(), keys, NKEYS, values);
+  CHECK(found >= -1 && found < (1<<NKEYS));
+  for (int i=0; i<NKEYS; i++) {
+    if (found >= 0 && !(found & (1<<i))) {
+      CHECK(values[i] == -1);   // Not modified
+    }
+  }
+  return found;
+}
+
+// The keys with an escape sequence are never matched and the last number
+// of a key wins.
+static void
+check_generated(const std::string &text, const std::vector<gen_field_t> &fields)
+{
+  int expected = 0;
+  double expected_values[NKEYS];
+  for (const gen_field_t &f : fields) {
+    for (int i=0; i<NKEYS; i++) {
+      if (!f.escaped_key && f.type == JSON_TYPE_NUMBER && f.key == keys[i]) {
+        expected |= 1<<i;
+        expected_values[i] = f.number;
+      }
+    }
+  }
+
+  double values[NKEYS];
+  int found = extract_copy(text, values);
+  CHECK(found == expected);
+  for (int i=0; i<NKEYS; i++) {
+    if (found & (1<<i)) {
+      CHECK(values[i] == expected_values[i]);
+    }
+  }
+}
+
+// The extraction refuses the numbers of more than 31 characters which the
+// reader accepts.
+static bool
+has_long_number(const std::string &text)
+{
+  size_t run = 0;
+  for (char c : text) {
+    run = strchr("0123456789+-.eE", c) && c ? run+1 : 0 ;
+    if (run >= 32) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void
+test_cases(void)
+{
+  static const struct {
+    const char *text;
+    int         found;
+    double      power_a;
+  } cases[] = {
+    { "{}", 0, 0 },
+    { "{\"power_a\":12.5}", 1, 12.5 },
+    { " {\"power_a\" : -3e2 , \"x\":[1,{\"power_b\":2}]} ", 1, -300 },
+    { "{\"power_a\":\"12\"}", 0, 0 },
+    { "{\"power_\\u0061\":12}", 0, 0 },
+    { "{\"power_a\":1,\"power_a\":2}", 1, 2 },
+    { "{\"power_a\":1,\"power_a\":null}", 1, 1 },
+    { "{\"power_ab\":1,\"power_\":2}", 0, 0 },
+    { "{\"power_a\":1", -1, 0 },
+    { "{\"power_a\":01}", -1, 0 },
+    { "{\"power_a\":1}x", -1, 0 },
+    { "[{\"power_a\":1}]", -1, 0 },
+    { "{\"a\":[[[[[[[[[]]]]]]]]]}", -1, 0 },
+    { "{\"power_a\":1234567890123456789012345678901}", 1, 1234567890123456789012345678901.0 },
+    { "{\"power_a\":12345678901234567890123456789012}", -1, 0 },
+  };
+  for (const auto &c : cases) {
+    double values[NKEYS];
+    int found = extract_copy(c.text, values);
+    if (found != c.found) {
+      fprintf(stderr, "%s: %d\n", c.text, found);
+    }
+    CHECK(found == c.found);
+    if (found > 0) {
+      CHECK(values[0] == c.power_a);
+    }
+  }
+
+  // The text does not need to be terminated
+  const char text[] = "{\"p\":12}{\"p\":34}";
+  double values[NKEYS];
+  CHECK(json_extract_numbers(text, 8, keys, NKEYS, values) == (1<<3) && values[3] == 12);
+  CHECK(json_extract_numbers(text, 7, keys, NKEYS, values) == -1);
+  CHECK(json_extract_numbers(text, 0, keys, NKEYS, values) == -1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  long iterations = (argc > 1) ? atol(argv[1]) : 20000;
+  gen_seed((argc > 2) ? strtoull(argv[2], NULL, 0) : 0x5eed);
+
+  test_cases();
+
+  long valid = 0;
+  for (long i=0; i<iterations; i++) {
+    std::string text;
+    std::vector<gen_field_t> fields;
+    gen_object(text, fields, keys, NKEYS);
+    check_generated(text, fields);
+
+    for (int m=0; m<8; m++) {
+      std::string mutated = text;
+      gen_mutate(mutated);
+
+      double values[NKEYS];
+      int found = extract_copy(mutated, values);
+
+      std::vector<char> copy(mutated.begin(), mutated.end());
+      copy.push_back('\0');
+      json_reader reader;
+      if (reader.parse(copy.data(), mutated.size())) {
+        valid++;
+        CHECK(found >= 0 || has_long_number(mutated));
+      }
+    }
+  }
+
+  printf("json_extract_numbers: %ld objects and %ld mutations (%ld still valid)\n", iterations, iterations*8, valid);
+  return 0;
+}
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "json_gen.h"
+
+static uint64_t rng_state = 1;
+
+void
+gen_seed(uint64_t seed)
+{
+  rng_state = seed ? seed : 1;
+}
+
+uint32_t
+gen_random(uint32_t n)
+{
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return uint32_t((rng_state * 0x2545F4914F6CDD1Dull) >> 32) % n;
+}
+
+// Append a code point encoded as \uXXXX (or a surrogate pair) to 'text'
+// and its UTF-8 encoding to 'value'
+static void
+add_code_point(std::string &text, std::string &value, uint32_t cp)
+{
+  char tmp[16];
+  if (cp >= 0x10000) {
+    uint32_t v = cp - 0x10000;
+    snprintf(tmp, sizeof(tmp), "\\u%04X\\u%04x", 0xD800 + (v>>10), 0xDC00 + (v & 0x3FF));
+  } else {
+    snprintf(tmp, sizeof(tmp), gen_random(2) ? "\\u%04x" : "\\u%04X", cp);
+  }
+  text += tmp;
+  if (cp < 0x80) {
+    value += char(cp);
+  } else if (cp < 0x800) {
+    value += char(0xC0 | (cp>>6));
+    value += char(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    value += char(0xE0 | (cp>>12));
+    value += char(0x80 | ((cp>>6) & 0x3F));
+    value += char(0x80 | (cp & 0x3F));
+  } else {
+    value += char(0xF0 | (cp>>18));
+    value += char(0x80 | ((cp>>12) & 0x3F));
+    value += char(0x80 | ((cp>>6) & 0x3F));
+    value += char(0x80 | (cp & 0x3F));
+  }
+}
+
+// Return true if an escape sequence was written
+static bool
+gen_string(std::string &text, std::string &value)
+{
+  bool escaped = false;
+  static const char escapes[] = "\"\\/bfnrt";
+  static const char decoded[] = "\"\\/\b\f\n\r\t";
+  text += '"';
+  int n = gen_random(12);
+  for (int i=0; i<n; i++) {
+    switch (gen_random(8)) {
+      case 0: {
+        escaped = true;
+        int k = gen_random(8);
+        text += '\\';
+        text += escapes[k];
+        value += decoded[k];
+        break;
+      }
+      case 1: {
+        static const uint32_t ranges[][2] = {
+          { 0x1, 0x80 }, { 0x80, 0x800 }, { 0x800, 0xD800 }, { 0xE000, 0x10000 }, { 0x10000, 0x110000 }
+        };
+        escaped = true;
+        int r = gen_random(5);
+        add_code_point(text, value, ranges[r][0] + gen_random(ranges[r][1] - ranges[r][0]));
+        break;
+      }
+      case 2:
+        text += "\xc3\xa9";   // Raw UTF-8
+        value += "\xc3\xa9";
+        break;
+      default: {
+        char c = ' ' + gen_random(95);
+        if (c == '"' || c == '\\') {
+          c = 'x';
+        }
+        text += c;
+        value += c;
+        break;
+      }
+    }
+  }
+  text += '"';
+  return escaped;
+}
+
+static void
+gen_number(std::string &text, double &value)
+{
+  std::string num;
+  if (gen_random(3) == 0) {
+    num += '-';
+  }
+  if (gen_random(4) == 0) {
+    num += '0';
+  } else {
+    num += char('1' + gen_random(9));
+    for (int n = gen_random(10); n > 0; n--) {
+      num += char('0' + gen_random(10));
+    }
+  }
+  if (gen_random(2)) {
+    num += '.';
+    for (int n = 1 + gen_random(6); n > 0; n--) {
+      num += char('0' + gen_random(10));
+    }
+  }
+  if (gen_random(4) == 0) {
+    num += "eE"[gen_random(2)];
+    if (gen_random(2)) {
+      num += "+-"[gen_random(2)];
+    }
+    num += char('0' + gen_random(10));
+    if (gen_random(2)) {
+      num += char('0' + gen_random(10));
+    }
+  }
+  text += num;
+  value = strtod(num.c_str(), NULL);
+}
+
+static void
+gen_space(std::string &text)
+{
+  if (gen_random(4) == 0) {
+    text += " \t\r\n"[gen_random(4)];
+  }
+}
+
+static void gen_value(std::string &text, int depth, gen_field_t *field);
+
+static void
+gen_container(std::string &text, int depth)
+{
+  bool object = gen_random(2);
+  text += object ? '{' : '[';
+  int n = (depth >= JSON_READER_MAX_DEPTH) ? 0 : gen_random(4);
+  for (int i=0; i<n; i++) {
+    if (i > 0) {
+      text += ',';
+    }
+    gen_space(text);
+    if (object) {
+      std::string key;
+      gen_string(text, key);
+      gen_space(text);
+      text += ':';
+    }
+    gen_space(text);
+    gen_value(text, depth+1, NULL);
+    gen_space(text);
+  }
+  text += object ? '}' : ']';
+}
+
+// Generate a value. Its expected type and value are stored in 'field'
+// (unless NULL).
+static void
+gen_value(std::string &text, int depth, gen_field_t *field)
+{
+  gen_field_t dummy;
+  if (!field) {
+    field = &dummy;
+  }
+  switch (gen_random(7)) {
+    case 0:
+      field->type = JSON_TYPE_STRING;
+      gen_string(text, field->str);
+      break;
+    case 1:
+    case 2:
+      field->type = JSON_TYPE_NUMBER;
+      gen_number(text, field->number);
+      break;
+    case 3:
+      field->type = JSON_TYPE_TRUE;
+      text += "true";
+      break;
+    case 4:
+      field->type = JSON_TYPE_FALSE;
+      text += "false";
+      break;
+    case 5:
+      field->type = JSON_TYPE_NULL;
+      text += "null";
+      break;
+    default:
+      field->type = JSON_TYPE_OTHER;
+      gen_container(text, depth);
+      break;
+  }
+}
+
+// Write a key of the pool, sometimes with its first character escaped
+static bool
+gen_pool_key(std::string &text, const char *key)
+{
+  bool escaped = (gen_random(4) == 0);
+  text += '"';
+  if (escaped) {
+    char tmp[8];
+    snprintf(tmp, sizeof(tmp), "\\u%04x", (unsigned char) key[0]);
+    text += tmp;
+    text += key+1;
+  } else {
+    text += key;
+  }
+  text += '"';
+  return escaped;
+}
+
+void
+gen_object(std::string &text, std::vector<gen_field_t> &fields, const char * const pool[], int npool)
+{
+  gen_space(text);
+  text += '{';
+  int n = gen_random(JSON_READER_MAX_FIELDS + 1);
+  for (int i=0; i<n; i++) {
+    gen_field_t field;
+    if (i > 0) {
+      text += ',';
+    }
+    gen_space(text);
+    if (pool && gen_random(2)) {
+      field.key = pool[gen_random(npool)];
+      field.escaped_key = gen_pool_key(text, field.key.c_str());
+    } else {
+      field.escaped_key = gen_string(text, field.key);
+    }
+    gen_space(text);
+    text += ':';
+    gen_space(text);
+    gen_value(text, 1, &field);
+    gen_space(text);
+    fields.push_back(field);
+  }
+  text += '}';
+  gen_space(text);
+}
+
+void
+gen_mutate(std::string &text)
+{
+  for (int n = 1 + gen_random(3); n > 0 && !text.empty(); n--) {
+    size_t pos = gen_random(text.size());
+    switch (gen_random(5)) {
+      case 0:
+        text[pos] ^= 1 << gen_random(8);
+        break;
+      case 1:
+        text.insert(pos, 1, "{}[]\",:\\u0e-.\x01"[gen_random(15)]);
+        break;
+      case 2:
+        text.erase(pos, 1 + gen_random(4));
+        break;
+      case 3:
+        text.resize(pos);
+        break;
+      default:
+        text[pos] = char(gen_random(256));
+        break;
+    }
+  }
+}
+
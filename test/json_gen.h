@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "json_reader.h"
+
+//
+// The random JSON texts of the fuzz tests (see json_reader_fuzz.cc and
+// json_extract_fuzz.cc).
+//
+// The generated objects are valid (with escape sequences, surrogate pairs,
+// numbers of all shapes and nested values) and the expected top-level
+// members are returned with the text. gen_mutate() then turns them into
+// mostly invalid texts.
+//
+// The sequence is deterministic for a given seed.
+//
+
+typedef struct {
+  std::string key;          // Unescaped
+  bool        escaped_key;  // The key contains an escape sequence in the text
+  json_type_t type;
+  std::string str;          // For JSON_TYPE_STRING (unescaped)
+  double      number;       // For JSON_TYPE_NUMBER
+} gen_field_t ;
+
+void gen_seed(uint64_t seed);
+
+// A random number in [0, n)
+uint32_t gen_random(uint32_t n);
+
+// Append a random object to 'text' and its top-level members to 'fields'.
+// There are at most JSON_READER_MAX_FIELDS members. If 'pool' is not NULL
+// then half of the keys are taken from it (and are sometimes escaped).
+void gen_object(std::string &text, std::vector<gen_field_t> &fields,
+                const char * const pool[] = NULL, int npool = 0);
+
+// Flip, insert, delete or truncate a few bytes
+void gen_mutate(std::string &text);
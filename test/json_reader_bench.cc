@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_reader.h"
+#include "test.h"
+
+#ifdef HAVE_CJSON
+#include "cJSON.h"
+#endif
+
+//
+// Benchmark of json_reader on typical requests of the /json endpoint.
+//
+// When the sources of cJSON are available (see CJSON_DIR in CMakeLists.txt),
+// the same requests are also parsed with cJSON as uri_json_handler did
+// before json_reader (cJSON_ParseWithLength and a lookup of each field).
+//
+//   json_reader_bench [SECONDS]
+//
+
+static const char * const requests[] = {
+  "{\"action\":\"get_state\"}",
+  "{\"action\":\"set_config\",\"mode\":\"auto\",\"frame_size\":100,\"full_power\":2000,"
+  "\"hostname\":\"cumulus\",\"timezone\":\"CET-1CEST,M3.5.0,M10.5.0/3\"}",
+  "{ \"action\": \"set_manual_power\", \"power\": 1234.5, \"note\": \"caf\\u00e9 \\\"test\\\"\" }",
+};
+
+static const char * const keys[] = {
+  "action", "mode", "frame_size", "full_power", "hostname", "timezone", "power", "note"
+};
+
+#define NKEYS int(sizeof(keys)/sizeof(keys[0]))
+
+// Prevent the compiler from removing the lookups
+static volatile size_t sink;
+
+static void
+lookup_json_reader(const char *request, size_t size)
+{
+  char buffer[512];
+  memcpy(buffer, request, size+1);   // The text is modified in place
+  json_reader reader;
+  CHECK(reader.parse(buffer, size));
+  for (int k=0; k<NKEYS; k++) {
+    const json_field_t *field = reader.find(keys[k]);
+    if (field && field->type == JSON_TYPE_STRING) {
+      sink += field->str[0];
+    } else if (field && field->type == JSON_TYPE_NUMBER) {
+      sink += size_t(field->number);
+    }
+  }
+}
+
+#ifdef HAVE_CJSON
+static void
+lookup_cjson(const char *request, size_t size)
+{
+  cJSON *root = cJSON_ParseWithLength(request, size);
+  CHECK(root != NULL);
+  for (int k=0; k<NKEYS; k++) {
+    const cJSON *item = cJSON_GetObjectItem(root, keys[k]);
+    if (cJSON_IsString(item)) {
+      sink += item->valuestring[0];
+    } else if (cJSON_IsNumber(item)) {
+      sink += size_t(item->valuedouble);
+    }
+  }
+  cJSON_Delete(root);
+}
+#endif
+
+typedef void (*lookup_fn_t)(const char *request, size_t size);
+
+// Return the number of allocations per request
+static double
+bench(const char *name, lookup_fn_t fn, double duration)
+{
+  size_t bytes = 0;
+  long count = 0;
+  size_t allocations = test_allocations();
+  double start = test_now();
+  double elapsed;
+  do {
+    for (int i=0; i<1000; i++) {
+      const char *request = requests[i % 3];
+      size_t size = strlen(request);
+      fn(request, size);
+      bytes += size;
+    }
+    count += 1000;
+    elapsed = test_now() - start;
+  } while (elapsed < duration);
+  allocations = test_allocations() - allocations;
+
+  printf("%-12s %8.0f ns/request, %6.1f MB/s, %5.1f allocations/request\n",
+         name, elapsed / count * 1e9, bytes / elapsed / 1e6, double(allocations) / count);
+  return double(allocations) / count;
+}
+
+int
+main(int argc, char *argv[])
+{
+  double duration = (argc > 1) ? atof(argv[1]) : 0.2;
+
+  CHECK(bench("json_reader", lookup_json_reader, duration) == 0);
+#ifdef HAVE_CJSON
+  bench("cJSON", lookup_cjson, duration);
+#else
+  printf("cJSON        not found (see CJSON_DIR)\n");
+#endif
+  return 0;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "json_reader.h"
+#include "json_gen.h"
+#include "test.h"
+
+//
+// Fuzz tests of json_reader (see json_reader.h).
+//
+//   json_reader_fuzz [ITERATIONS [SEED]]
+//
+// 1. Random valid objects (see json_gen.h) are generated with their
+//    expected fields and compared with the result of the parsing.
+// 2. The same texts are mutated (flipped, inserted, deleted and truncated
+//    bytes) and parsed from an exact-size copy. The reader must never read
+//    or write outside of the text and the fields of a successful parsing
+//    must point inside the text.
+//
+
+static void
+check_fields(const json_reader &reader, const std::vector<gen_field_t> &fields)
+{
+  CHECK(reader.size() == int(fields.size()));
+  for (int i=0; i<reader.size(); i++) {
+    const json_field_t &f = reader[i];
+    const gen_field_t  &e = fields[i];
+    CHECK(e.key == f.key);
+    CHECK(f.type == e.type);
+    if (e.type == JSON_TYPE_STRING) {
+      CHECK(e.str == f.str);
+    } else if (e.type == JSON_TYPE_NUMBER) {
+      CHECK(f.number == e.number);
+    }
+    // find() returns the last field with that key
+    const json_field_t *found = reader.find(f.key);
+    CHECK(found != NULL && found >= &f && strcmp(found->key, f.key) == 0);
+  }
+}
+
+// Parse a copy of 'text' in 'copy' which is resized to the exact size of
+// the text (plus the '\0') so the sanitizers catch an access beyond it.
+static bool
+parse_copy(const std::string &text, std::vector<char> &copy, json_reader &reader)
+{
+  copy.assign(text.begin(), text.end());
+  copy.push_back('\0');
+  copy.shrink_to_fit();
+  const char *start = copy.data();
+  const char *end   = start + text.size();
+  bool ok = reader.parse(copy.data(), text.size());
+  if (ok) {
+    CHECK(reader.size() <= JSON_READER_MAX_FIELDS);
+    for (int i=0; i<reader.size(); i++) {
+      const json_field_t &f = reader[i];
+      CHECK(f.key >= start && f.key + strlen(f.key) < end);
+      if (f.type == JSON_TYPE_STRING) {
+        CHECK(f.str >= start && f.str + strlen(f.str) < end);
+      }
+    }
+  } else {
+    CHECK(reader.size() == 0);
+  }
+  CHECK(*end == '\0');
+  return ok;
+}
+
+typedef struct {
+  const std::vector<gen_field_t> *objects;
+  int count;
+} array_context_t ;
+
+static bool
+on_item(void *arg, const json_reader &item)
+{
+  array_context_t &ctx = *(array_context_t *) arg;
+  check_fields(item, ctx.objects[ctx.count++]);
+  return true;
+}
+
+static void
+test_cases(void)
+{
+  static const struct {
+    const char *text;
+    bool ok;
+  } cases[] = {
+    { "{}", true },
+    { " { } ", true },
+    { "{\"a\":1}", true },
+    { "{\"a\":-0.5e+3}", true },
+    { "{\"a\":\"\\ud83d\\ude00\"}", true },
+    { "", false },
+    { "[]", false },
+    { "{", false },
+    { "{\"a\"}", false },
+    { "{\"a\":}", false },
+    { "{\"a\":1,}", false },
+    { "{\"a\":01}", false },
+    { "{\"a\":1.}", false },
+    { "{\"a\":.5}", false },
+    { "{\"a\":1e}", false },
+    { "{\"a\":+1}", false },
+    { "{\"a\":0x10}", false },
+    { "{\"a\":tru}", false },
+    { "{\"a\":\"\\u0000\"}", false },
+    { "{\"a\":\"\\ud83d\"}", false },
+    { "{\"a\":\"\\ude00\"}", false },
+    { "{\"a\":\"\\x\"}", false },
+    { "{\"a\":\"\t\"}", false },
+    { "{\"a\":[1,]}", false },
+    { "{\"a\":1} x", false },
+    { "{\"a\":1}{}", false },
+    { "{\"a\":[[[[[[[[]]]]]]]]}", true },
+    { "{\"a\":[[[[[[[[[]]]]]]]]]}", false },
+  };
+  for (const auto &c : cases) {
+    json_reader reader;
+    std::vector<char> copy;
+    bool ok = parse_copy(c.text, copy, reader);
+    if (ok != c.ok) {
+      fprintf(stderr, "%s\n", c.text);
+    }
+    CHECK(ok == c.ok);
+  }
+
+  // Too many fields
+  std::string text = "{";
+  for (int i=0; i<=JSON_READER_MAX_FIELDS; i++) {
+    text += (i ? ",\"k" : "\"k") + std::to_string(i) + "\":" + std::to_string(i);
+  }
+  text += "}";
+  json_reader reader;
+  std::vector<char> copy;
+  CHECK(!parse_copy(text, copy, reader));
+
+  // A repeated key
+  char repeated[] = "{\"a\":1,\"b\":2,\"a\":3}";
+  CHECK(reader.parse(repeated, strlen(repeated)));
+  CHECK(reader.find("a")->number == 3);
+  CHECK(reader.find("c") == NULL);
+}
+
+int
+main(int argc, char *argv[])
+{
+  long iterations = (argc > 1) ? atol(argv[1]) : 20000;
+  gen_seed((argc > 2) ? strtoull(argv[2], NULL, 0) : 0x5eed);
+
+  test_cases();
+
+  long valid = 0;
+  for (long i=0; i<iterations; i++) {
+    std::string text;
+    std::vector<gen_field_t> fields;
+    gen_object(text, fields);
+
+    json_reader reader;
+    std::vector<char> copy;
+    if (!parse_copy(text, copy, reader)) {
+      fprintf(stderr, "Rejected: %s\n", text.c_str());
+      CHECK(false);
+    }
+    check_fields(reader, fields);
+
+    for (int m=0; m<8; m++) {
+      std::string mutated = text;
+      gen_mutate(mutated);
+      valid += parse_copy(mutated, copy, reader);
+    }
+  }
+
+  // Arrays of objects
+  for (long i=0; i<iterations/10; i++) {
+    std::vector<gen_field_t> objects[4];
+    std::string text = "[";
+    int n = gen_random(5);
+    for (int k=0; k<n; k++) {
+      if (k > 0) {
+        text += ',';
+      }
+      gen_object(text, objects[k]);
+    }
+    text += "]";
+    std::vector<char> copy(text.begin(), text.end());
+    copy.push_back('\0');
+    json_reader reader;
+    array_context_t ctx = { objects, 0 };
+    CHECK(reader.parse_array(copy.data(), text.size(), on_item, &ctx));
+    CHECK(ctx.count == n);
+  }
+
+  printf("json_reader: %ld objects and %ld mutations (%ld still valid)\n", iterations, iterations*8, valid);
+  return 0;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "json_writer.h"
+#include "test.h"
+
+//
+// Tests and benchmark of json_writer (see json_writer.h).
+//
+// The benchmark writes a response similar to the full state returned by
+// the /json endpoint through the same 256 bytes buffer as uri_json_handler
+// and reports the throughput and the allocations per response.
+//
+
+typedef struct {
+  char   data[4096];
+  size_t size;
+  int    flushes;
+} sink_t ;
+
+static bool
+to_sink(void *ctx, const char *data, size_t size)
+{
+  sink_t &sink = *(sink_t *) ctx;
+  if (sink.size + size > sizeof(sink.data)) {
+    return false;
+  }
+  memcpy(sink.data + sink.size, data, size);
+  sink.size += size;
+  sink.flushes++;
+  return true;
+}
+
+static bool
+to_nowhere(void *ctx, const char *, size_t size)
+{
+  *(size_t *) ctx += size;
+  return true;
+}
+
+static void
+write_state(json_writer &out)
+{
+  out.begin_object();
+  out.add_string("mode", "auto");
+  out.add_int("frame_size", 100);
+  out.add_int("full_power", 2000);
+  out.add_string("timezone", "CET-1CEST,M3.5.0,M10.5.0/3");
+  out.add_string("localtime", "2024-06-01 12:34:56 UTC+0200");
+  out.add_string("hostname", "cumulus");
+  out.add_string("mqtt_uri", "mqtt://192.168.1.10:1883");
+  out.add_string("meter_topic", "zigbee2mqtt/energy_meter");
+  out.add_string("meter_expr", "power_b - power_a");
+  out.add_string("wifi_ssid", "my \"home\" network");
+  out.add_int("auto_available_power", -1234);
+  out.add_double("auto_ratio", 0.4567);
+  out.add_int("manual_power", 500);
+  out.add_bool("connected", true);
+  out.add_null("error");
+  out.begin_array("history");
+  for (int i=0; i<8; i++) {
+    out.add_int(NULL, i * 250 - 1000);
+  }
+  out.end_array();
+  out.end_object();
+}
+
+static void
+test_output(void)
+{
+  sink_t sink = {};
+  char buffer[8];   // Small so the values are split across flushes
+  json_writer out(buffer, sizeof(buffer), to_sink, &sink);
+  out.begin_object();
+  out.add_string("s", "a\"b\\c\n\x01");
+  out.add_int("i", -42);
+  out.add_double("d", 0.1);
+  out.add_double("nan", NAN);
+  out.add_bool("t", true);
+  out.add_bool("f", false);
+  out.add_null("n");
+  out.begin_array("a");
+  out.add_int(NULL, 1);
+  out.begin_object();
+  out.end_object();
+  out.begin_array();
+  out.end_array();
+  out.end_array();
+  out.end_object();
+  CHECK(out.flush());
+  CHECK(out.ok());
+
+  const char expected[] =
+    "{\"s\":\"a\\\"b\\\\c\\n\\u0001\",\"i\":-42,\"d\":0.1,\"nan\":null,"
+    "\"t\":true,\"f\":false,\"n\":null,\"a\":[1,{},[]]}";
+  CHECK(sink.size == strlen(expected));
+  CHECK(memcmp(sink.data, expected, sink.size) == 0);
+  CHECK(out.count() == sink.size);
+  CHECK(sink.flushes > 1);
+}
+
+// The output does not depend on the size of the buffer
+static void
+test_buffer_sizes(void)
+{
+  sink_t reference = {};
+  char large[4096];
+  json_writer ref(large, sizeof(large), to_sink, &reference);
+  write_state(ref);
+  CHECK(ref.flush());
+
+  for (size_t size=1; size<=64; size++) {
+    sink_t sink = {};
+    char buffer[64];
+    json_writer out(buffer, size, to_sink, &sink);
+    write_state(out);
+    CHECK(out.flush());
+    CHECK(sink.size == reference.size);
+    CHECK(memcmp(sink.data, reference.data, sink.size) == 0);
+  }
+}
+
+static void
+test_errors(void)
+{
+  // A failed flush is sticky
+  sink_t sink = {};
+  sink.size = sizeof(sink.data) - 4;
+  char buffer[4];
+  json_writer out(buffer, sizeof(buffer), to_sink, &sink);
+  write_state(out);
+  CHECK(!out.ok());
+  CHECK(!out.flush());
+
+  // Too deep
+  size_t total = 0;
+  char buffer2[64];
+  json_writer deep(buffer2, sizeof(buffer2), to_nowhere, &total);
+  for (int i=0; i<JSON_WRITER_MAX_DEPTH; i++) {
+    deep.begin_array();
+  }
+  CHECK(!deep.ok());
+}
+
+static void
+bench(double duration)
+{
+  size_t bytes = 0;
+  long responses = 0;
+  size_t allocations = test_allocations();
+  double start = test_now();
+  double elapsed;
+  do {
+    for (int i=0; i<1000; i++) {
+      char buffer[256];
+      json_writer out(buffer, sizeof(buffer), to_nowhere, &bytes);
+      write_state(out);
+      out.flush();
+    }
+    responses += 1000;
+    elapsed = test_now() - start;
+  } while (elapsed < duration);
+  allocations = test_allocations() - allocations;
+
+  printf("json_writer: %ld responses of %zu bytes in %.3f s: %.1f MB/s, %.0f responses/s, %.2f allocations/response\n",
+         responses, bytes / responses, elapsed, bytes / elapsed / 1e6, responses / elapsed,
+         double(allocations) / responses);
+  CHECK(allocations == 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  test_output();
+  test_buffer_sizes();
+  test_errors();
+  bench(argc > 1 ? atof(argv[1]) : 0.2);
+  return 0;
+}
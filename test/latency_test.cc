@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_timer.h"
+#include "latency.h"
+#include "test.h"
+
+//
+// Tests of the latency histograms (see latency.h) with a simulated clock.
+//
+
+static int64_t now_us = 1000000;
+
+int64_t
+esp_timer_get_time(void)
+{
+  return now_us;
+}
+
+// The histogram of a hop accumulated since the previous call
+static latency_histogram_t
+delta(int hop)
+{
+  static latency_histogram_t previous[LATENCY_HOP_COUNT];
+  latency_histogram_t h, d;
+  latency_get_histogram(hop, &h);
+  d.count  = h.count  - previous[hop].count;
+  d.sum_us = h.sum_us - previous[hop].sum_us;
+  for (int b=0; b<LATENCY_BUCKETS; b++) {
+    d.buckets[b] = h.buckets[b] - previous[hop].buckets[b];
+  }
+  previous[hop] = h;
+  return d;
+}
+
+// The only non-empty bucket of a histogram with a single sample
+static int
+single_bucket(const latency_histogram_t &h)
+{
+  CHECK(h.count == 1);
+  int bucket = -1;
+  for (int b=0; b<LATENCY_BUCKETS; b++) {
+    if (h.buckets[b]) {
+      CHECK(bucket < 0 && h.buckets[b] == 1);
+      bucket = b;
+    }
+  }
+  return bucket;
+}
+
+// Trace a message whose hops take the given durations
+static void
+trace(const uint32_t hops_us[LATENCY_POINT_COUNT-1])
+{
+  uint32_t id = latency_begin(now_us);
+  CHECK(id != 0);
+  for (int p=1; p<LATENCY_POINT_COUNT; p++) {
+    now_us += hops_us[p-1];
+    latency_mark(id, latency_point_t(p));
+  }
+}
+
+// The bucket of a single duration (see bucket_of in latency.cc)
+static int
+bucket_of(uint32_t us)
+{
+  const uint32_t hops[LATENCY_POINT_COUNT-1] = { us, 0, 0, 0 };
+  trace(hops);
+  for (int hop=1; hop<LATENCY_HOP_COUNT-1; hop++) {
+    CHECK(single_bucket(delta(hop)) == 0);
+  }
+  latency_histogram_t total = delta(LATENCY_HOP_COUNT-1);
+  CHECK(total.sum_us == us);
+  int b = single_bucket(delta(0));
+  CHECK(single_bucket(total) == b);
+  return b;
+}
+
+static void
+test_buckets(void)
+{
+  CHECK(latency_bucket_le_us(0) == 64);
+  CHECK(latency_bucket_le_us(1) == 128);
+  CHECK(latency_bucket_le_us(LATENCY_BUCKETS-2) == (1u << LATENCY_MAX_SHIFT));
+  CHECK(latency_bucket_le_us(LATENCY_BUCKETS-1) == UINT32_MAX);
+
+  CHECK(bucket_of(0) == 0);
+  CHECK(bucket_of(1) == 0);
+  for (int b=0; b<LATENCY_BUCKETS-1; b++) {
+    uint32_t le = latency_bucket_le_us(b);
+    CHECK(bucket_of(le) == b);          // The upper bound is inclusive
+    CHECK(bucket_of(le + 1) == b + 1);
+    if (b > 0) {
+      CHECK(bucket_of(latency_bucket_le_us(b-1) + 1) == b);
+    }
+  }
+  CHECK(bucket_of(UINT32_MAX) == LATENCY_BUCKETS-1);
+}
+
+static void
+test_hops(void)
+{
+  const uint32_t hops[LATENCY_POINT_COUNT-1] = { 100, 2000, 30, 9000 };
+  trace(hops);
+  uint32_t total = 0;
+  for (int hop=0; hop<LATENCY_HOP_COUNT-1; hop++) {
+    latency_histogram_t h = delta(hop);
+    CHECK(h.count == 1 && h.sum_us == hops[hop]);
+    total += hops[hop];
+  }
+  latency_histogram_t h = delta(LATENCY_HOP_COUNT-1);
+  CHECK(h.count == 1 && h.sum_us == total);
+
+  CHECK(strcmp(latency_hop_name(0), "parse") == 0);
+  CHECK(strcmp(latency_hop_name(LATENCY_HOP_COUNT-1), "total") == 0);
+  CHECK(strcmp(latency_hop_name(LATENCY_HOP_COUNT), "?") == 0);
+  CHECK(strcmp(latency_hop_name(-1), "?") == 0);
+}
+
+static bool
+nothing_recorded(void)
+{
+  for (int hop=0; hop<LATENCY_HOP_COUNT; hop++) {
+    if (delta(hop).count != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void
+test_dropped(void)
+{
+  // A trace that skips a point (e.g. in MANUAL mode) is dropped
+  uint32_t id = latency_begin(now_us);
+  latency_mark(id, LATENCY_POSTED);
+  latency_mark(id, LATENCY_DISPATCHED);
+  latency_mark(id, LATENCY_APPLIED);
+  CHECK(nothing_recorded());
+
+  // ... and closed
+  latency_mark(id, LATENCY_RELAY_SET);
+  latency_mark(id, LATENCY_APPLIED);
+  CHECK(nothing_recorded());
+
+  // The trace 0 is ignored
+  latency_mark(0, LATENCY_APPLIED);
+  CHECK(nothing_recorded());
+
+  // The slot of an old trace is reused
+  uint32_t old = latency_begin(now_us);
+  for (int i=0; i<8; i++) {
+    latency_begin(now_us);
+  }
+  for (int p=1; p<LATENCY_POINT_COUNT; p++) {
+    latency_mark(old, latency_point_t(p));
+  }
+  CHECK(nothing_recorded());
+
+  // A clock that goes backward is counted as 0
+  id = latency_begin(now_us + 500);
+  for (int p=1; p<LATENCY_POINT_COUNT; p++) {
+    latency_mark(id, latency_point_t(p));
+  }
+  CHECK(single_bucket(delta(0)) == 0);
+  CHECK(delta(LATENCY_HOP_COUNT-1).sum_us == 0);
+  for (int hop=1; hop<LATENCY_HOP_COUNT-1; hop++) {
+    delta(hop);
+  }
+}
+
+int
+main(void)
+{
+  test_buckets();
+  test_hops();
+  test_dropped();
+  printf("latency: ok\n");
+  return 0;
+}
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+#include "meter_expr.h"
+#include "json_reader.h"
+#include "test.h"
+
+//
+// Tests of meter_expr (see meter_expr.h).
+//
+
+// Describe a compiled expression as "KEY*COEF ... +OFFSET" or "error: MESSAGE"
+static std::string
+describe(const char *text)
+{
+  meter_expr_t expr;
+  char error[64] = "";
+  char tmp[128];
+  if (!meter_expr_compile(expr, text, error, sizeof(error))) {
+    return std::string("error: ") + error;
+  }
+  std::string out;
+  for (int i=0; i<expr.nkeys; i++) {
+    snprintf(tmp, sizeof(tmp), "%s*%g ", expr.keys[i], expr.coef[i]);
+    out += tmp;
+  }
+  snprintf(tmp, sizeof(tmp), "%+g", expr.offset);
+  return out + tmp;
+}
+
+static void
+test_compile(void)
+{
+  static const struct {
+    const char *text;
+    const char *expected;
+  } cases[] = {
+    { "power_b - power_a",        "power_b*1 power_a*-1 +0" },
+    { "-power",                   "power*-1 -0" },
+    { "+power",                   "power*1 +0" },
+    { "(import - export) * 1000", "import*1000 export*-1000 +0" },
+    { "\"Power In\" / 10 + 5",    "Power In*0.1 +5" },
+    { "2*(a+b)-a",                "a*1 b*2 +0" },
+    { "a + a + a",                "a*3 +0" },
+    { "-(-x)",                    "x*1 +0" },
+    { "x / 4 * 2",                "x*0.5 +0" },
+    { "2 * 3 * x",                "x*6 +0" },
+    { "1.5e3 * x - .5",           "x*1500 -0.5" },
+    { "\t a_1 \t",                "a_1*1 +0" },
+    { "((((a))))",                "a*1 +0" },
+    { "\"a.b[0]\" + \"a b\"",     "a.b[0]*1 a b*1 +0" },
+    { "",                         "error: Expected a number or a field at position 0" },
+    { "3+4",                      "error: No field at position 3" },
+    { "a*b",                      "error: Product of two fields at position 3" },
+    { "(a+1)*(b+1)",              "error: Product of two fields at position 11" },
+    { "a/b",                      "error: Division by a field at position 3" },
+    { "a/0",                      "error: Division by zero at position 3" },
+    { "a/(1-1)",                  "error: Division by zero at position 7" },
+    { "a +",                      "error: Expected a number or a field at position 3" },
+    { "a b",                      "error: Unexpected character at position 2" },
+    { "a )",                      "error: Unexpected character at position 2" },
+    { "(a",                       "error: Expected ')' at position 2" },
+    { "(((((a)))))",              "error: Too many parentheses at position 4" },
+    { "\"a\\b\"",                 "error: Malformed quoted field at position 2" },
+    { "\"ab",                     "error: Malformed quoted field at position 3" },
+    { "\"\" + a",                 "error: Empty field at position 2" },
+    { "1e400*x",                  "error: Overflow at position 7" },
+    { "x*1e200*1e200",            "error: Overflow at position 13" },
+    { "a+b+c+d+e+f+g+h+i",        "error: Too many fields at position 17" },
+  };
+  for (const auto &c : cases) {
+    std::string result = describe(c.text);
+    if (result != c.expected) {
+      fprintf(stderr, "'%s': got '%s' instead of '%s'\n", c.text, result.c_str(), c.expected);
+    }
+    CHECK(result == c.expected);
+  }
+
+  // The names of the keys share a fixed buffer
+  std::string text = "a2345678901234567890 + b2345678901234567890 + c2345678901234567890 + d";
+  CHECK(describe(text.c_str()).find("error: Field names are too long") == 0);
+
+  // A small error buffer is truncated
+  meter_expr_t expr;
+  char error[8];
+  CHECK(!meter_expr_compile(expr, "a*b", error, sizeof(error)));
+  CHECK(strcmp(error, "Product") == 0);
+}
+
+static void
+test_eval(void)
+{
+  meter_expr_t expr;
+  char error[64];
+  CHECK(meter_expr_compile(expr, "(power_b - power_a) * 2 + 10", error, sizeof(error)));
+  CHECK(expr.nkeys == 2);
+  CHECK(strcmp(expr.keys[0], "power_b") == 0);   // In the order of appearance
+
+  double values[2] = { 1000, 300 };
+  double result = 0;
+  CHECK(meter_expr_eval(expr, 3, values, &result));
+  CHECK(result == 1410);
+  CHECK(!meter_expr_eval(expr, 1, values, &result));
+  CHECK(!meter_expr_eval(expr, 2, values, &result));
+  CHECK(!meter_expr_eval(expr, 0, values, &result));
+}
+
+// The keys of a compiled expression are given as is to json_extract_numbers
+// (see process_energy_meter_msg in ui_mqtt.cc).
+static void
+test_with_extract(void)
+{
+  meter_expr_t expr;
+  char error[64];
+  CHECK(meter_expr_compile(expr, "\"Power In\" - power_a / 2", error, sizeof(error)));
+
+  const char message[] = "{\"power_a\":300,\"x\":{\"Power In\":1},\"Power In\":1000}";
+  double values[METER_EXPR_MAX_FIELDS];
+  int found = json_extract_numbers(message, strlen(message), expr.keys, expr.nkeys, values);
+  double result = 0;
+  CHECK(found == 3);
+  CHECK(meter_expr_eval(expr, found, values, &result));
+  CHECK(result == 850);
+
+  const char partial[] = "{\"power_a\":300}";
+  found = json_extract_numbers(partial, strlen(partial), expr.keys, expr.nkeys, values);
+  CHECK(found == 2);   // Only power_a (the second key)
+  CHECK(!meter_expr_eval(expr, found, values, &result));
+}
+
+//
+// Random expressions built from a known linear combination must evaluate
+// to the same value as a direct computation.
+//
+
+static uint32_t rng_state = 12345;
+
+static int
+rnd(int n)
+{
+  rng_state = rng_state * 1103515245 + 12345;
+  return int((rng_state >> 16) % n);
+}
+
+static const char * const fields[] = { "a", "b", "\"c d\"" };
+static const double field_values[] = { 3, -7, 11 };
+
+// Append a random sub-expression to 'text' and return its value
+static double
+gen_expr(std::string &text, int depth)
+{
+  double value = 0;
+  int terms = 1 + rnd(3);
+  for (int t=0; t<terms; t++) {
+    bool minus = rnd(2);
+    text += (t == 0) ? (minus ? "-" : "") : (minus ? " - " : " + ");
+
+    // A factor with a field (or a sub-expression) and constant factors
+    double term;
+    if (depth < 3 && rnd(3) == 0) {
+      text += "(";
+      term = gen_expr(text, depth+1);
+      text += ")";
+    } else {
+      int f = rnd(3);
+      text += fields[f];
+      term = field_values[f];
+    }
+    for (int n = rnd(3); n > 0; n--) {
+      int k = 1 + rnd(9);
+      if (rnd(2)) {
+        text += " * " + std::to_string(k);
+        term *= k;
+      } else {
+        text += " / " + std::to_string(k);
+        term /= k;
+      }
+    }
+    value += minus ? -term : term;
+    if (rnd(4) == 0) {
+      int k = rnd(100);
+      text += " + " + std::to_string(k);
+      value += k;
+    }
+  }
+  return value;
+}
+
+static void
+test_random(int iterations)
+{
+  for (int i=0; i<iterations; i++) {
+    std::string text;
+    double expected = gen_expr(text, 0);
+
+    meter_expr_t expr;
+    char error[64];
+    if (!meter_expr_compile(expr, text.c_str(), error, sizeof(error))) {
+      fprintf(stderr, "'%s': %s\n", text.c_str(), error);
+      CHECK(false);
+    }
+    double values[METER_EXPR_MAX_FIELDS];
+    for (int k=0; k<expr.nkeys; k++) {
+      for (int f=0; f<3; f++) {
+        std::string name = fields[f];
+        if (name[0] == '"') {
+          name = name.substr(1, name.size()-2);
+        }
+        if (name == expr.keys[k]) {
+          values[k] = field_values[f];
+        }
+      }
+    }
+    double result;
+    CHECK(meter_expr_eval(expr, (1<<expr.nkeys)-1, values, &result));
+    if (fabs(result - expected) > 1e-9 * (1 + fabs(expected))) {
+      fprintf(stderr, "'%s': got %.17g instead of %.17g\n", text.c_str(), result, expected);
+      CHECK(false);
+    }
+  }
+}
+
+int
+main(void)
+{
+  test_compile();
+  test_eval();
+  test_with_extract();
+  test_random(20000);
+  printf("meter_expr: ok\n");
+  return 0;
+}
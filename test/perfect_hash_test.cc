@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "perfect_hash.h"
+#include "test.h"
+
+//
+// Tests of the compile time perfect hash (see perfect_hash.h).
+//
+
+typedef struct {
+  const char *name;
+  int value;
+} item_t ;
+
+// The command names (see command.cc)
+static constexpr item_t items[] = {
+  { "reboot", 0 },       { "get-state", 1 },    { "set-full-power", 2 },
+  { "set-frame-size", 3 }, { "set-wifi-cred", 4 }, { "set-time", 5 },
+  { "set-hostname", 6 }, { "auto-mode", 7 },    { "manual-mode", 8 },
+  { "mqtt", 9 },         { "meter", 10 },       { "ui", 11 },
+  { "set", 12 },
+};
+
+constexpr int item_count = sizeof(items)/sizeof(items[0]);
+
+static constexpr auto index32 =
+  perfect_hash_build<32>(items, [](const item_t &item) { return item.name; });
+
+static_assert(index32.seed >= 0, "No perfect hash found");
+
+// A table that is exactly full
+static constexpr const char *names[] = { "a", "b", "c", "d" };
+
+static constexpr auto index4 =
+  perfect_hash_build<4>(names, [](const char *name) { return name; });
+
+static_assert(index4.seed >= 0, "No perfect hash found");
+
+static_assert(perfect_hash_size(1) == 1, "");
+static_assert(perfect_hash_size(26) == 32, "");
+static_assert(perfect_hash_size(32) == 32, "");
+
+static const item_t *
+find(const char *name)
+{
+  int i = index32.lookup(name);
+  if (i >= 0 && strcmp(items[i].name, name) == 0) {
+    return &items[i];
+  }
+  return NULL;
+}
+
+static void
+test_found(void)
+{
+  for (int i=0; i<item_count; i++) {
+    const item_t *item = find(items[i].name);
+    CHECK(item == &items[i]);
+  }
+  for (const char *name : names) {
+    int i = index4.lookup(name);
+    CHECK(i >= 0 && strcmp(names[i], name) == 0);
+  }
+}
+
+static void
+test_not_found(void)
+{
+  static const char * const unknown[] = {
+    "", "Reboot", "rebootx", "set-", "sett", "get-state ", "mqtt\x80", "u",
+  };
+  for (const char *name : unknown) {
+    CHECK(find(name) == NULL);
+  }
+}
+
+static void
+test_slots(void)
+{
+  // Each item has its own slot and the other slots are empty
+  int used = 0;
+  for (int k=0; k<32; k++) {
+    int i = index32.slot[k];
+    CHECK(i >= -1 && i < item_count);
+    used += (i >= 0);
+  }
+  CHECK(used == item_count);
+  printf("perfect_hash: seed %d for %d names in 32 slots\n", (int) index32.seed, item_count);
+}
+
+int
+main(void)
+{
+  test_found();
+  test_not_found();
+  test_slots();
+  return 0;
+}
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "power_filter.h"
+#include "test.h"
+
+//
+// Tests of power_filter (see power_filter.h).
+//
+
+// Feed some samples and return the output after the last one
+static int
+feed(power_filter &filter, const int samples[], int n)
+{
+  for (int i=0; i<n; i++) {
+    filter.update(samples[i]);
+  }
+  return filter.output();
+}
+
+static void
+test_pass_through(void)
+{
+  power_filter filter;
+  CHECK(filter.output() == 0);
+  CHECK(filter.update(0));          // The first sample always changes the output
+  CHECK(filter.output() == 0);
+  CHECK(filter.update(-1500));
+  CHECK(filter.output() == -1500);
+  CHECK(!filter.update(-1500));     // Unchanged
+  CHECK(filter.update(7));
+  CHECK(filter.output() == 7);
+}
+
+static void
+test_median(void)
+{
+  // An isolated spike is removed
+  power_filter filter(3, 100);
+  const int spike[] = { 100, 100, 5000, 100, 100 };
+  for (int i=0; i<5; i++) {
+    filter.update(spike[i]);
+    CHECK(filter.output() == 100);
+  }
+
+  // A step passes after half of the window
+  const int step[] = { 2000, 2000 };
+  CHECK(feed(filter, step, 1) == 100);
+  CHECK(feed(filter, step, 1) == 2000);
+
+  // The median of an even window is the mean of the two middle values
+  power_filter even(4, 100);
+  const int samples[] = { 10, 40, 20, 1000 };
+  CHECK(feed(even, samples, 4) == 30);
+
+  // The window is partial at the start
+  power_filter partial(9, 100);
+  const int two[] = { 10, 21 };
+  CHECK(feed(partial, two, 2) == 16);   // lround(15.5)
+}
+
+static void
+test_ema(void)
+{
+  power_filter filter(1, 50);
+  CHECK(filter.update(0));
+  CHECK(filter.update(100));
+  CHECK(filter.output() == 50);
+  CHECK(filter.update(100));
+  CHECK(filter.output() == 75);
+
+  // Converges to a constant input
+  for (int i=0; i<20; i++) {
+    filter.update(100);
+  }
+  CHECK(filter.output() == 100);
+  CHECK(!filter.update(100));
+}
+
+static void
+test_deadband(void)
+{
+  power_filter filter;
+  filter.set_deadband(50);
+  CHECK(filter.update(1000));
+  CHECK(!filter.update(1049));
+  CHECK(!filter.update(951));
+  CHECK(filter.output() == 1000);
+  CHECK(filter.update(1050));
+  CHECK(filter.output() == 1050);
+  CHECK(filter.update(900));
+  CHECK(filter.output() == 900);
+
+  // A slow drift passes once it exceeds the deadband
+  int changes = 0;
+  for (int v=900; v<=1000; v+=10) {
+    changes += filter.update(v);
+  }
+  CHECK(changes == 2);
+  CHECK(filter.output() == 1000);
+
+  filter.set_deadband(-5);
+  CHECK(filter.update(1001));
+}
+
+static void
+test_configure(void)
+{
+  // The values are clamped
+  power_filter filter(0, 0);
+  const int samples[] = { 0, 1000 };
+  CHECK(feed(filter, samples, 2) == 10);     // 1% and no median
+
+  filter.configure(100, 200);                // Median of 9 samples and no EMA
+  const int spikes[] = { 0, 0, 0, 0, 0, 1000, 1000, 1000, 1000 };
+  CHECK(feed(filter, spikes, 9) == 0);
+  CHECK(feed(filter, spikes+5, 1) == 1000);
+
+  // configure() and reset() forget the previous samples but not the deadband
+  filter.set_deadband(100);
+  filter.reset();
+  CHECK(filter.output() == 0);
+  CHECK(filter.update(500));
+  CHECK(filter.output() == 500);
+  CHECK(!filter.update(550));
+}
+
+static uint32_t rng_state = 42;
+
+static int
+rnd(int n)
+{
+  // xorshift32
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return int(rng_state % n);
+}
+
+// A noisy signal with isolated spikes: the filter must change its output far
+// less often than the raw signal and stay close to the true value.
+static void
+test_noise(void)
+{
+  power_filter filter(5, 30);
+  filter.set_deadband(25);
+
+  int raw_changes = 0;
+  int changes = 0;
+  int previous = 0;
+  int max_error = 0;
+  int last_spike = -100;
+  for (int i=0; i<2000; i++) {
+    int level = (i < 1000) ? 1000 : -500;
+    int sample = level + rnd(41) - 20;
+    if (i - last_spike > 5 && rnd(50) == 0) {
+      sample += 3000;   // A kettle (isolated, see the median)
+      last_spike = i;
+    }
+    raw_changes += (sample != previous);
+    previous = sample;
+    changes += filter.update(sample);
+    if ((i % 1000) >= 20) {
+      int error = abs(filter.output() - level);
+      max_error = (error > max_error) ? error : max_error ;
+    }
+  }
+  printf("power_filter: %d changes instead of %d, max error %d W\n", changes, raw_changes, max_error);
+  CHECK(changes * 20 < raw_changes);
+  CHECK(max_error <= 50);
+}
+
+int
+main(void)
+{
+  test_pass_through();
+  test_median();
+  test_ema();
+  test_deadband();
+  test_configure();
+  test_noise();
+  return 0;
+}
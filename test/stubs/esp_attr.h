@@ -0,0 +1,5 @@
+#pragma once
+
+// Host stub (see test/CMakeLists.txt)
+
+#define IRAM_ATTR
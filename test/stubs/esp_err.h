@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Host stub (see test/CMakeLists.txt)
+
+typedef int esp_err_t;
+
+#define ESP_OK                 0
+#define ESP_FAIL               -1
+#define ESP_ERR_NVS_NOT_FOUND  0x1102
+
+#define ESP_ERROR_CHECK(x) do { if ((x) != ESP_OK) abort(); } while (0)
+
+static inline const char *
+esp_err_to_name(esp_err_t err)
+{
+  return (err == ESP_OK) ? "ESP_OK" : "ESP_FAIL";
+}
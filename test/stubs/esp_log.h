@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdio.h>
+
+// Host stub (see test/CMakeLists.txt): only the errors and the warnings
+// are printed.
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W %s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ((void) (tag))
+#define ESP_LOGD(tag, format, ...) ((void) (tag))
@@ -0,0 +1,11 @@
+#pragma once
+
+// Host stub (see test/CMakeLists.txt): the tests are single-threaded.
+
+typedef int portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL_SAFE(mux) ((void) (mux))
+#define portEXIT_CRITICAL_SAFE(mux)  ((void) (mux))
+#define taskENTER_CRITICAL(mux)      ((void) (mux))
+#define taskEXIT_CRITICAL(mux)       ((void) (mux))
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "nvs_flash.h"
+#include "history.h"
+#include "telemetry.h"
+#include "test.h"
+
+//
+// Tests of the telemetry ring (see telemetry.h). The history and the NVS
+// are simulated. The history has one sample per minute whose available
+// power is the number of the minute so each record can be identified.
+//
+// Built with CONFIG_APP_TELEMETRY_RECORDS=16 (see CMakeLists.txt).
+//
+
+#define RECORDS CONFIG_APP_TELEMETRY_RECORDS
+
+static uint32_t now = 0;   // The time of the history
+
+uint32_t
+history_now(void)
+{
+  return now;
+}
+
+uint32_t
+history_period(history_tier_t tier)
+{
+  return 60;
+}
+
+bool
+history_read(history_tier_t tier, uint32_t from, uint32_t to, history_fn_t fn, void *ctx)
+{
+  CHECK(tier == HISTORY_TIER_1M);
+  // Only the complete minutes are stored
+  for (uint32_t t=(from+59)/60*60; t<=to && t+60<=now; t+=60) {
+    history_sample_t sample = {};
+    sample.time = t;
+    sample.value[HISTORY_CHANNEL_available_power] = t/60;
+    if (!fn(ctx, sample)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The NVS namespace "telemetry"
+static std::map<std::string, std::vector<uint8_t>> nvs;
+
+esp_err_t
+nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *handle)
+{
+  CHECK(strcmp(name, "telemetry") == 0);
+  *handle = 1;
+  return ESP_OK;
+}
+
+esp_err_t
+nvs_get_blob(nvs_handle_t handle, const char *key, void *value, size_t *length)
+{
+  auto it = nvs.find(key);
+  if (it == nvs.end()) {
+    return ESP_ERR_NVS_NOT_FOUND;
+  }
+  if (*length < it->second.size()) {
+    return ESP_FAIL;
+  }
+  memcpy(value, it->second.data(), it->second.size());
+  *length = it->second.size();
+  return ESP_OK;
+}
+
+esp_err_t
+nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+  const uint8_t *p = (const uint8_t *) value;
+  nvs[key].assign(p, p + length);
+  return ESP_OK;
+}
+
+esp_err_t
+nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+  return nvs.erase(key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t
+nvs_commit(nvs_handle_t handle)
+{
+  return ESP_OK;
+}
+
+// The layout of the blobs (see telemetry.cc)
+typedef struct {
+  uint32_t size;
+  uint32_t first;
+  uint32_t count;
+} saved_index_t ;
+
+static void
+save_blobs(uint32_t size, uint32_t first, uint32_t count)
+{
+  std::vector<telemetry_record_t> ring(size);
+  for (uint32_t s=first; s<first+count; s++) {
+    ring[s % size].available_power = s;   // The sequence number as the identifier
+  }
+  saved_index_t index = { .size = size, .first = first, .count = count };
+  nvs_set_blob(1, "ring", ring.data(), size * sizeof(telemetry_record_t));
+  nvs_set_blob(1, "index", &index, sizeof(index));
+}
+
+// Produce the records of a few more minutes
+static void
+advance(uint32_t minutes, bool connected)
+{
+  now += minutes * 60;
+  telemetry_poll(connected);
+}
+
+static telemetry_stats_t
+stats(void)
+{
+  telemetry_stats_t s;
+  telemetry_get_stats(&s);
+  return s;
+}
+
+// The identifier of the oldest pending record
+static int32_t
+oldest(void)
+{
+  telemetry_record_t record;
+  uint32_t next;
+  CHECK(telemetry_peek(&record, 1, &next) == 1);
+  return record.available_power;
+}
+
+// The records saved by a firmware with another ring size are ignored and
+// erased once nothing is pending
+static void
+test_restore_other_size(void)
+{
+  save_blobs(RECORDS/2, 0, 4);
+  telemetry_start();
+  CHECK(stats().pending == 0);
+
+  telemetry_poll(true);
+  telemetry_save();
+  CHECK(nvs.empty());
+}
+
+// The oldest records are dropped when the ring is full
+static void
+test_overflow(void)
+{
+  advance(RECORDS + 4, false);
+  CHECK(stats().pending == RECORDS);
+  CHECK(stats().dropped == 4);
+
+  telemetry_record_t records[RECORDS + 1];
+  uint32_t next;
+  CHECK(telemetry_peek(records, RECORDS + 1, &next) == RECORDS);
+  for (int i=0; i<RECORDS; i++) {
+    CHECK(records[i].available_power == 4 + i);
+  }
+
+  // Saved while disconnected
+  telemetry_save();
+  saved_index_t index;
+  size_t size = sizeof(index);
+  CHECK(nvs_get_blob(1, "index", &index, &size) == ESP_OK);
+  CHECK(index.size == RECORDS && index.first == 4 && index.count == RECORDS);
+}
+
+// Acknowledge a batch while the ring overflows
+static void
+test_ack_after_overflow(void)
+{
+  telemetry_record_t records[8];
+  uint32_t next;
+
+  // Some of the records of the batch are dropped: only the others are removed
+  CHECK(telemetry_peek(records, 8, &next) == 8);
+  CHECK(records[0].available_power == 4);
+  advance(3, false);
+  CHECK(oldest() == 7);
+  telemetry_ack(next);
+  CHECK(stats().pending == RECORDS - 5);
+  CHECK(oldest() == 12);
+
+  // All the records of the batch are dropped: nothing is removed
+  CHECK(telemetry_peek(records, 8, &next) == 8);
+  advance(RECORDS + 8, false);
+  int32_t first = oldest();
+  CHECK(uint32_t(first) > next);
+  telemetry_ack(next);
+  CHECK(stats().pending == RECORDS);
+  CHECK(oldest() == first);
+
+  // Everything is published: the saved records are erased
+  while (telemetry_peek(records, 8, &next) > 0) {
+    telemetry_ack(next);
+  }
+  CHECK(stats().pending == 0);
+  CHECK(!nvs.empty());
+  advance(0, true);
+  telemetry_save();
+  CHECK(nvs.empty());
+}
+
+// The records saved by the same firmware are restored
+static void
+test_restore(void)
+{
+  save_blobs(RECORDS, 100, 3);
+  telemetry_start();
+  CHECK(stats().pending == 3);
+
+  telemetry_record_t records[4];
+  uint32_t next;
+  CHECK(telemetry_peek(records, 4, &next) == 3);
+  for (int i=0; i<3; i++) {
+    CHECK(records[i].available_power == 100 + i);
+  }
+  telemetry_ack(next);
+  CHECK(stats().pending == 0);
+}
+
+// Without argument, run the tests of a ring restored from another size.
+// With "restore", run the test of a ring restored from the same size
+// (telemetry_start() can only be called once per process).
+int
+main(int argc, char **argv)
+{
+  if (argc > 1 && strcmp(argv[1], "restore") == 0) {
+    test_restore();
+    return 0;
+  }
+  test_restore_other_size();
+  test_overflow();
+  test_ack_after_overflow();
+  return 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+//
+// The helpers shared by the host tests (see CMakeLists.txt).
+//
+// Each test is a small program that returns 0 on success. CHECK() reports
+// the first failed condition and exits with 1.
+//
+
+#define CHECK(COND) ((COND) ? (void)0 : test_fail(__FILE__, __LINE__, #COND))
+
+[[noreturn]] void test_fail(const char *file, int line, const char *cond);
+
+// A monotonic time in seconds
+double test_now(void);
+
+// The number of calls to malloc, calloc and realloc so far (including the
+// ones done by operator new). Compare two values to count the allocations
+// of some code.
+size_t test_allocations(void);
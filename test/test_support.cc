@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "test.h"
+
+void
+test_fail(const char *file, int line, const char *cond)
+{
+  fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, cond);
+  exit(1);
+}
+
+double
+test_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//
+// The allocations are counted by interposing the allocator of glibc.
+// operator new calls malloc so it is counted too. That is not possible
+// with AddressSanitizer (see SANITIZE in CMakeLists.txt) which has its own
+// allocator so nothing is counted then.
+//
+
+#if defined(__SANITIZE_ADDRESS__)
+
+size_t
+test_allocations(void)
+{
+  return 0;
+}
+
+#else
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static size_t allocations = 0;
+
+extern "C" void *
+malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+extern "C" void *
+calloc(size_t n, size_t size)
+{
+  allocations++;
+  return __libc_calloc(n, size);
+}
+
+extern "C" void *
+realloc(void *ptr, size_t size)
+{
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+size_t
+test_allocations(void)
+{
+  return allocations;
+}
+
+#endif